@@ -3,13 +3,101 @@
 
 #include "jdisk.h"
 
+#define B_TREE_COMPRESS (0x1)     /* Compress records and pack several per sector */
+#define B_TREE_BLOOM    (0x2)     /* Keep a Bloom filter so most misses read nothing */
+#define B_TREE_EXTENTS  (0x4)     /* Records may span sectors (not with B_TREE_COMPRESS) */
+#define B_TREE_COUNTS   (0x8)     /* Keep subtree key counts for rank, select and count_range */
+#define B_TREE_CHECKSUM (0x80)    /* Keep a CRC-32C of every sector and check nodes and records on read */
+#define B_TREE_LOCALITY (0x100)   /* Keep internal nodes, leaves and records in regions of their own (not with B_TREE_EXTENTS) */
+#define B_TREE_FLAGS    (0x1ff)   /* Every flag b_tree_create_flags() knows */
+
+/* One of these may be or'd into the flags to say what the keys are.
+   Integer keys are in native byte order and compare by value. */
+#define B_TREE_KEY_BYTES  (0x00)  /* Bytes compared with memcmp() (the default) */
+#define B_TREE_KEY_U32    (0x10)  /* unsigned int, key_size 4 */
+#define B_TREE_KEY_U64    (0x20)  /* unsigned long, key_size 8 */
+#define B_TREE_KEY_I64    (0x30)  /* long, key_size 8 */
+#define B_TREE_KEY_CUSTOM (0x40)  /* Bytes ordered by the b_tree_set_compare() function */
+#define B_TREE_KEY_TYPE   (0x70)  /* The bits that hold the key type */
+
+#define B_TREE_MAX_RECORD (64 * JDISK_SECTOR_SIZE)   /* Biggest record with B_TREE_EXTENTS */
+#define B_TREE_BAD_CHECKSUM (-2)  /* A record, or a node a traversal, rank or count went through, is damaged */
+#define B_TREE_SCAN_THREADS (64)  /* Most threads b_tree_parallel_scan() runs */
+#define B_TREE_SCAN_PARTS (8)     /* and most partitions it makes per thread */
+
+/* b_tree_space_map() describes the jdisk in regions of B_TREE_REGION_SECTORS
+   sectors: what each one holds and how many of its sectors are in use,
+   counting from its start. */
+#define B_TREE_REGION_SECTORS (64)
+#define B_TREE_REGION_FREE     (0)   /* Nothing yet */
+#define B_TREE_REGION_META     (1)   /* The superblock, first root and the tables after it */
+#define B_TREE_REGION_INTERNAL (2)   /* Internal nodes */
+#define B_TREE_REGION_LEAF     (3)   /* Leaves */
+#define B_TREE_REGION_RECORD   (4)   /* Records */
+#define B_TREE_REGION_MIXED    (5)   /* Any of them (trees without B_TREE_LOCALITY) */
+
+typedef struct {
+  unsigned char kind;           /* B_TREE_REGION_* */
+  unsigned char used;           /* Sectors handed out */
+} B_Tree_Region;
+
+typedef int (*B_Tree_Traverse_Fn)(void *key, unsigned int lba, void *arg);
+typedef int (*B_Tree_Partition_Fn)(int part, void *key, unsigned int lba, void *arg);
+typedef int (*B_Tree_Compare_Fn)(void *a, void *b, int key_size);
+
+/* A trace file from b_tree_set_trace() is B_TREE_TRACE_MAGIC (8 bytes),
+   the key size and the tree's flags (4 bytes each), then a
+   B_Tree_Trace_Op followed by its key for every call. */
+#define B_TREE_TRACE_MAGIC "BTTRACE"
+
+typedef struct {
+  unsigned char op;             /* 'F' for b_tree_find(), 'I' for b_tree_insert() */
+  unsigned char pad[3];
+  unsigned int result;          /* The lba it returned */
+  unsigned int size;            /* The record size, for 'I' */
+  unsigned int latency;         /* How long it took, in ns */
+  unsigned long time;           /* When it started, in ns after tracing started */
+} B_Tree_Trace_Op;
+
 void *b_tree_create(char *filename, long size, int key_size);
+void *b_tree_create_flags(char *filename, long size, int key_size, int flags);
 void *b_tree_attach(char *filename);
+int b_tree_detach(void *b_tree);
 
 unsigned int b_tree_insert(void *b_tree, void *key, void *record);
+unsigned int b_tree_insert_size(void *b_tree, void *key, void *record, int size);
 unsigned int b_tree_find(void *b_tree, void *key);
+int b_tree_read_record(void *b_tree, unsigned int lba, void *record);
+int b_tree_record_size(void *b_tree, unsigned int lba);
+int b_tree_traverse(void *b_tree, B_Tree_Traverse_Fn fn, void *arg);
+int b_tree_scan(void *b_tree, void *lo, B_Tree_Traverse_Fn fn, void *arg);
+int b_tree_parallel_scan(void *b_tree, int nthreads, B_Tree_Partition_Fn fn, void *arg);
+long b_tree_rank(void *b_tree, void *key);
+long b_tree_count_range(void *b_tree, void *lo, void *hi);
+unsigned int b_tree_select(void *b_tree, unsigned long i, void *key);
+void *b_tree_merge(void *a, void *b, char *filename, long size);
+int b_tree_merge_into(void *b_tree, void *delta);
+
+int b_tree_set_compare(void *b_tree, B_Tree_Compare_Fn fn);
+int b_tree_set_grow(void *b_tree, unsigned long extent);
+int b_tree_set_hot_cache(void *b_tree, int entries);
+int b_tree_set_cow(void *b_tree, int on);
+int b_tree_set_append(void *b_tree, int on);
+int b_tree_set_buffer(void *b_tree, int msgs);
+int b_tree_set_writeback(void *b_tree, int max_dirty, int interval_ms);
+int b_tree_checkpoint(void *b_tree);
+int b_tree_set_direct(void *b_tree, int on);
+int b_tree_set_manifest(void *b_tree, int on);
+int b_tree_set_trace(void *b_tree, char *filename);
+int b_tree_preload(void *b_tree, int levels, unsigned long budget);
+void *b_tree_snapshot(void *b_tree);
+int b_tree_snapshot_release(void *snapshot);
+
 void *b_tree_disk(void *b_tree);
 int b_tree_key_size(void *b_tree);
+int b_tree_flags(void *b_tree);
+long b_tree_bad_sectors(void *b_tree);
+long b_tree_space_map(void *b_tree, B_Tree_Region *map, long n);
 void b_tree_print_tree(void *b_tree);
 
 #endif
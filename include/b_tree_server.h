@@ -0,0 +1,45 @@
+#ifndef _B_TREE_SERVER_
+#define _B_TREE_SERVER_
+
+#include "b_tree.h"
+
+/* b_tree_server owns one attached B_Tree and serves it over a Unix domain
+   socket, so short-lived clients share its warm node cache.  Every
+   message, both ways, is a B_Tree_Msg followed by len bytes.  A client
+   may send any number of requests before reading the replies, which come
+   back in order with the request's id.  The server answers everything
+   that arrived in one read with one write.
+
+   On connecting, the server sends a 'H' message with the key size
+   (4 bytes).  The requests are:
+
+     'F'  key                          -> lba (4 bytes, 0 = not found)
+     'I'  key, record (1 or more bytes) -> lba (4 bytes, 0 = failed)
+     'R'  lba (4 bytes)                -> the record (0 bytes = bad lba)
+     'S'  max (4 bytes) [, lo key]     -> up to max (key, lba) pairs,
+                                          from the first key >= lo
+
+   A malformed request closes the connection. */
+
+#define B_TREE_SERVER_SCAN_MAX (4096)   /* Most pairs one 'S' reply holds */
+#define B_TREE_SERVER_WINDOW (256)      /* Most requests a client batch has outstanding */
+
+typedef struct {
+  unsigned char op;             /* 'H', 'F', 'I', 'R' or 'S' */
+  unsigned char pad[3];
+  unsigned int id;              /* Chosen by the client and echoed in the reply */
+  unsigned int len;             /* Bytes that follow */
+} B_Tree_Msg;
+
+void *b_tree_client_connect(char *socket_path);
+int b_tree_client_close(void *c);
+int b_tree_client_key_size(void *c);
+
+unsigned int b_tree_client_find(void *c, void *key);
+unsigned int b_tree_client_insert(void *c, void *key, void *record, int size);
+int b_tree_client_find_batch(void *c, int n, void *keys, unsigned int *lbas);
+int b_tree_client_insert_batch(void *c, int n, void *keys, void *records, unsigned int *lbas);
+int b_tree_client_read_record(void *c, unsigned int lba, void *record);
+int b_tree_client_scan(void *c, void *lo, int max, void *keys, unsigned int *lbas);
+
+#endif
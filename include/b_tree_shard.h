@@ -0,0 +1,25 @@
+#ifndef _B_TREE_SHARD_
+#define _B_TREE_SHARD_
+
+#include "b_tree.h"
+
+#define B_TREE_SHARD_HASH  (0)    /* Keys go to shards by hash -- spreads any key mix */
+#define B_TREE_SHARD_RANGE (1)    /* Keys go to shards by split keys -- keeps key order */
+
+void *b_tree_shard_create(char *filename, int nshards, int mode, long shard_size, int key_size);
+void *b_tree_shard_create_splits(char *filename, int nshards, long shard_size, int key_size, void *splits);
+int b_tree_shard_sample_splits(int nshards, int key_size, int n, void *keys, void *splits);
+void *b_tree_shard_attach(char *filename);
+int b_tree_shard_detach(void *sh);
+
+unsigned int b_tree_shard_insert(void *sh, void *key, void *record);
+unsigned int b_tree_shard_find(void *sh, void *key);
+int b_tree_shard_insert_batch(void *sh, int n, void *keys, void *records, unsigned int *lbas);
+int b_tree_shard_find_batch(void *sh, int n, void *keys, unsigned int *lbas);
+int b_tree_shard_traverse(void *sh, B_Tree_Traverse_Fn fn, void *arg);
+
+void *b_tree_shard_tree(void *sh, void *key);
+int b_tree_shard_count(void *sh);
+int b_tree_shard_key_size(void *sh);
+
+#endif
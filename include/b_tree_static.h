@@ -0,0 +1,27 @@
+#ifndef _B_TREE_STATIC_
+#define _B_TREE_STATIC_
+
+#include "b_tree.h"
+
+/* A static tree is a read-only copy of a B_Tree in one file, for replicas
+   that never insert.  Every block is a full JDISK_SECTOR_SIZE of keys,
+   laid out as a little search tree of cache lines, the levels above the
+   leaves hold only separators (children are found by position, so there
+   are no child pointers), and the records follow in key order.
+   b_tree_static_open() maps the file, so opening costs the same however
+   big the tree is, and a lookup touches one block per level. */
+
+int b_tree_export(void *b_tree, char *filename);
+
+void *b_tree_static_open(char *filename);
+int b_tree_static_close(void *st);
+
+long b_tree_static_find(void *st, void *key);
+void *b_tree_static_key(void *st, long i);
+void *b_tree_static_record(void *st, long i, int *size);
+
+long b_tree_static_count(void *st);
+int b_tree_static_key_size(void *st);
+int b_tree_static_levels(void *st);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _CRC32C_
+#define _CRC32C_
+
+#include <stddef.h>
+
+/* CRC-32C (Castagnoli), the checksum iSCSI and ext4 use.  It runs on the
+   SSE4.2 crc32 instruction when the CPU has it and on tables otherwise;
+   both give the same values.  Start with crc 0, and pass a result back
+   in to go on with more data. */
+
+unsigned int crc32c(unsigned int crc, const void *buf, size_t n);
+
+#endif
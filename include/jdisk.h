@@ -3,16 +3,29 @@
 
 #define JDISK_SECTOR_SIZE (1024)
 #define JDISK_DELAY (1)
+#define JDISK_READAHEAD (64)
+#define JDISK_ALIGN (512)
+
+#include <sys/uio.h>
 
 void *jdisk_create(char *fn, unsigned long size);
 void *jdisk_attach(char *fn);
 int jdisk_unattach(void *jd);
+int jdisk_grow(void *jd, unsigned long size);
 
 int jdisk_read(void *jd, unsigned int lba, void *buf);
 int jdisk_write(void *jd, unsigned int lba, void *buf);
+int jdisk_readv(void *jd, unsigned int lba, const struct iovec *iov, int iovcnt);
+int jdisk_writev(void *jd, unsigned int lba, const struct iovec *iov, int iovcnt);
 
 unsigned long jdisk_size(void *jd);
 long jdisk_reads(void *jd);
 long jdisk_writes(void *jd);
 
+int jdisk_set_readahead(void *jd, int max_sectors);
+int jdisk_set_direct(void *jd, int on);
+long jdisk_ra_fetched(void *jd);
+long jdisk_ra_used(void *jd);
+long jdisk_ra_wasted(void *jd);
+
 #endif
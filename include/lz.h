@@ -0,0 +1,10 @@
+#ifndef _LZ_
+#define _LZ_
+
+/* A small LZ77 block codec in the style of LZ4: byte-aligned tokens,
+   16-bit offsets, no entropy coding.  Meant for buffers up to 64 KB. */
+
+int lz_compress(const void *src, int n, void *dst, int cap);
+int lz_decompress(const void *src, int n, void *dst, int cap);
+
+#endif
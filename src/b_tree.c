@@ -4,45 +4,833 @@
 //  11/7/22
 
 #include <b_tree.h>
+#include <lz.h>
+#include <crc32c.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <stddef.h>
 
 typedef struct tnode {
-  unsigned char bytes[JDISK_SECTOR_SIZE+256]; /* This holds the sector for reading and writing->  
-                                                 It has extra room because your internal representation  
-                                                 will hold an extra key-> */
   unsigned char nkeys;                      /* Number of keys in the node */
   unsigned char flush;                      /* Should I flush this to disk at the end of b_tree_insert()? */
+  unsigned char fresh;                      /* Was this lba handed out during the current b_tree_insert()? */
   unsigned char internal;                   /* Internal or external node */
   unsigned int lba;                         /* LBA when the node is flushed */
-  unsigned char **keys;                     /* Pointers to the keys->  Size = MAXKEY+1 */
   unsigned int *lbas;                       /* Pointer to the array of LBA's->  Size = MAXKEY+2 */
+  unsigned int *counts;                     /* Keys under each lba, with B_TREE_COUNTS (else NULL) */
   struct tnode *parent;                     /* Pointer to my parent -- useful for splitting */
   int parent_index;                         /* My index in my parent */
+  unsigned char bad;                        /* Failed its checksum or couldn't be read, so it's empty */
   struct tnode *ptr;                        /* Free list link */
+  struct tnode *hnext;                      /* Next node in the same node_hash bucket */
+  unsigned char bytes[JDISK_SECTOR_SIZE+256] /* This holds the sector for reading and writing->  
+                                                It has extra room because your internal representation  
+                                                will hold an extra key->  It starts on the second  
+                                                cache line, so the header above fits in the first-> */
+      __attribute__((aligned(64)));
 } Tree_Node;
 
+/* Key i of a node.  Keys sit back to back in bytes, right after internal and nkeys. */
+#define KEY(TREE, t, i) ((t)->bytes + 2 + (TREE)->key_size * (i))
+
+#define SLAB_NODES (64)                     /* Node frames carved out of each slab */
+#define GROW_SLACK (32)                     /* Grow the jdisk when fewer sectors than this are left */
+#define FLUSH_IOV (64)                      /* Most pieces one jdisk_writev() in flush() takes */
+
+/* Sector 0 holds key_size, root_lba and first_free_block in its first 16 bytes.
+   Trees created with flags also have this extension after them. */
+#define SB_MAGIC "BTREEXT"                  /* 8 bytes, with the '\0' */
+#define SB_MAGIC_OFF (16)
+#define SB_FLAGS_OFF (24)
+#define SB_PACK_OFF (28)
+#define SB_BLOOM_LBA_OFF (32)
+#define SB_BLOOM_SECTORS_OFF (36)
+#define SB_CRC_LBA_OFF (40)
+#define SB_CRC_SECTORS_OFF (44)
+#define SB_MAP_LBA_OFF (48)
+#define SB_MAP_SECTORS_OFF (52)
+
+/* With B_TREE_COMPRESS, a record address is (sector << 4) | slot.  A packed
+   sector has a slot count, a table of (offset, length) pairs and the
+   compressed records.  Records that don't compress into it get a raw
+   sector of their own and slot PACK_RAW. */
+#define PACK_SLOTS (15)
+#define PACK_RAW (15)
+#define PACK_HDR (2 + 4 * PACK_SLOTS)
+#define PACK_MAX_LBAS (1UL << 28)
+
+/* With B_TREE_COUNTS, an internal node also has, right before its lbas,
+   the number of keys in each child's subtree.  Every node keeps room for
+   them, so keys_per_block is smaller. */
+#define COUNTS_OFF(TREE) (JDISK_SECTOR_SIZE - 2 * (TREE)->lbas_per_block * 4)
+
+/* With B_TREE_EXTENTS, a record is a run of up to EXT_MAX sectors, and its
+   address is (first sector << EXT_BITS) | (sectors - 1). */
+#define EXT_BITS (6)
+#define EXT_MAX (1 << EXT_BITS)
+#define EXT_MAX_LBAS (1UL << (32 - EXT_BITS))
+
+/* With B_TREE_BLOOM, a blocked Bloom filter sits in the sectors right after
+   the root.  Each key sets BLOOM_K bits inside one 64-byte block, so a
+   lookup touches one cache line.  It is sized for one key per sector of
+   the jdisk as created. */
+#define BLOOM_BITS_PER_KEY (10)
+#define BLOOM_K (7)
+#define BLOOM_BLOCK (64)
+
+/* With B_TREE_CHECKSUM, a table of CRC-32Cs, one for every sector, sits
+   after the Bloom filter (or the root).  Nodes and records are checked
+   when they are read.  An entry of 0 means the tree never wrote the
+   sector, so it isn't checked; a sector whose CRC is 0 is stored as 1.
+   The table covers CRC_GROWTH times the jdisk as created, which is as
+   far as it can grow. */
+#define CRC_PER_SECTOR (JDISK_SECTOR_SIZE / 4)
+#define CRC_GROWTH (4)
+
+/* With B_TREE_LOCALITY, every sector after the tables comes out of a
+   region of B_TREE_REGION_SECTORS that holds one kind of sector, and each
+   region hands its sectors out from its start.  Nodes take regions in a
+   zone at the front, internal ones first, next to the root and tables,
+   so the top of the tree and the leaves a scan walks sit together.  A
+   new leaf goes in its sibling's region, or the nearest one with room.
+   Records take regions after the zone, and each goes in the record
+   region nearest its leaf's.  The map, a B_Tree_Region for each
+   region, sits after the checksum table (or the Bloom filter, or the
+   root), and covers MAP_GROWTH times the jdisk as created. */
+#define MAP_PER_SECTOR (JDISK_SECTOR_SIZE / sizeof(B_Tree_Region))
+#define MAP_GROWTH (4)
+#define FREE_SCAN (32)                      /* Freed sectors to look through for one of the right kind */
+
+/* The warm start manifest, <jdisk file>.warm, is WARM_MAGIC, a count and
+   that many node lbas in ascending order. */
+#define WARM_MAGIC "BTWARM1"                /* 8 bytes, with the '\0' */
+#define WARM_SUFFIX ".warm"
+
+/* The hot cache maps whole keys to record lbas in HOT_WAYS-way sets.  A
+   TinyLFU count-min sketch of recent lookups decides whether a new key
+   may push out the least popular key in its set. */
+#define HOT_WAYS (4)
+#define HOT_DEPTH (4)
+#define HOT_MAX_COUNT (15)
+
+typedef struct {
+  int nsets;                    /* Number of sets (power of 2) */
+  unsigned char *keys;          /* nsets*HOT_WAYS keys */
+  unsigned int *lbas;           /* Their record lbas (0 = empty way) */
+  unsigned char *sketch;        /* HOT_DEPTH rows of width counters */
+  int width_bits;               /* log2 of the sketch width */
+  long additions;               /* Lookups counted since the sketch was last halved */
+  long sample;                  /* Halve the sketch after this many */
+} Hot_Cache;
+
+typedef struct nslab {
+  struct nslab *next;                       /* Next slab owned by the tree */
+  int used;                                 /* Frames handed out so far */
+  int direct;                               /* Laid out for O_DIRECT */
+  size_t node_size;                         /* Bytes from one frame to the next */
+  unsigned char *first;                     /* The first frame */
+  unsigned char *frames;                    /* The allocation they are carved from */
+} Node_Slab;
+
+typedef struct {
+  unsigned int lba;             /* A sector that an older version of the tree still uses */
+  unsigned long gen;            /* The commit that stopped using it */
+} Retired_LBA;
+
 typedef struct {
+  unsigned int lba;             /* First sector of something flush() writes */
+  unsigned int n;               /* How many sectors it is */
+  void *data;                   /* and its contents */
+} Flush_Piece;
+
+typedef struct {
+  Flush_Piece *p;               /* Copies of what a checkpoint writes, in lba order within each part */
+  int np;
+  int ndata;                    /* The first ndata are data; the rest are checksum table sectors */
+  unsigned char super[JDISK_SECTOR_SIZE];      /* and the superblock that commits them */
+} Wb_Batch;
+
+typedef struct {
+  unsigned int lba;             /* A child sector to preload */
+  struct tnode *parent;         /* The held node pointing to it */
+  int index;                    /* and which of its lbas it is */
+} Warm_Ref;
+
+typedef struct btree {
   int key_size;                 /* These are the first 16/12 bytes in sector 0 */
   unsigned int root_lba;
   unsigned long first_free_block;
+  int flags;                    /* B_TREE_* flags the tree was created with */
+  B_Tree_Compare_Fn compare;    /* Orders B_TREE_KEY_CUSTOM keys (NULL = not set yet) */
+  unsigned int pack_lba;        /* Packed record sector being filled (0 = none) */
+  unsigned int bloom_lba;       /* First sector of the Bloom filter */
+  unsigned int bloom_sectors;   /* Its size in sectors */
+  unsigned int crc_lba;         /* First sector of the checksum table */
+  unsigned int crc_sectors;     /* Its size in sectors */
+  unsigned int map_lba;         /* First sector of the region map */
+  unsigned int map_sectors;     /* Its size in sectors */
 
   void *disk;                   /* The jdisk */
+  char *filename;               /* Its file (NULL for snapshots) */
+  int manifest;                 /* Write the warm start manifest at detach */
+  FILE *trace;                  /* Where b_tree_set_trace() logs calls (NULL = off) */
+  unsigned long trace_start;    /* When tracing started, in ns */
+  long trace_errors;            /* Calls that couldn't be written to the trace */
   unsigned long size;           /* The jdisk's size */
   unsigned long num_lbas;       /* size/JDISK_SECTOR_SIZE */
+  unsigned long grow_extent;    /* Bytes to grow the jdisk by when it fills up (0 = don't) */
+  unsigned char *pack_buf;      /* Contents of pack_lba */
+  int pack_used;                /* Bytes of pack_buf in use */
+  int pack_dirty;               /* pack_buf changed and waits for the next flush */
+  void *rec_data;               /* A record write waiting for flush() (NULL = none) */
+  unsigned int rec_lba;         /* where it goes */
+  int rec_size;                 /* and its length in bytes */
+  unsigned char rec_tail[JDISK_SECTOR_SIZE];   /* Its last sector, padded */
+  unsigned char *bloom;         /* The Bloom filter (NULL if the tree has none) */
+  unsigned char *bloom_dirty;   /* Filter sectors changed since the last flush */
+  int bloom_ndirty;             /* and how many */
+  unsigned int *crc;            /* The checksum table (NULL if the tree has none) */
+  unsigned char *crc_dirty;     /* Table sectors changed since the last flush */
+  int crc_ndirty;               /* and how many */
+  long nbad;                    /* Sectors that failed their checksum or couldn't be read */
+  B_Tree_Region *map;           /* The region map (NULL if the tree has none) */
+  unsigned char *map_dirty;     /* Map sectors changed since the last flush */
+  int map_ndirty;               /* and how many */
+  unsigned long map_left;       /* Sectors no region has handed out yet */
+  long map_cur[B_TREE_REGION_MIXED];   /* Region each kind last took a sector from (-1 = none) */
+  Hot_Cache *hot;               /* Key to record lba cache (NULL if off) */
   int keys_per_block;           /* MAXKEY */
   int lbas_per_block;           /* MAXKEY+1 */
   Tree_Node *free_list;         /* List of all held nodes */
+  Tree_Node **node_hash;        /* Held nodes hashed by lba */
+  int hash_size;                /* Buckets in node_hash (power of 2) */
+  int nnodes;                   /* Number of held nodes */
+  Tree_Node **dirty;            /* Held nodes with flush set, for flush() and reset_flush() */
+  int ndirty, dirty_cap;
+  Node_Slab *slabs;             /* Arena that all Tree_Nodes are carved from */
+  size_t node_size;             /* Tree_Node + keys + lbas, rounded up */
+  int direct;                   /* The jdisk uses O_DIRECT (b_tree_set_direct()) */
   
   Tree_Node *tmp_e;             /* When find() fails, this is a pointer to the external node */
   int tmp_e_index;              /* and the index where the key should have gone */
+  Tree_Node *tail;              /* The rightmost leaf, once an insert has looked for it */
+  int append;                   /* Split the right edge unevenly for increasing keys */
+  int appending;                /* This insert went on the end of the tail */
 
   void *root;                   /* Root of B_Tree */
  
   int flush;                    /* Should I flush sector[0] to disk after b_tree_insert() */
+  int failed;                   /* A commit ran out of room or a write failed, so inserts are refused */
+
+  int cow;                      /* Copy-on-write: never overwrite a committed sector */
+  unsigned long gen;            /* Number of b_tree_insert() commits since attaching */
+  unsigned char *msg_keys;      /* Buffered inserts' keys, sorted */
+  unsigned int *msg_lbas;       /* and their record lbas */
+  int nmsgs;                    /* Buffered inserts */
+  int msg_cap;                  /* Buffer size (0 = inserts go straight into the tree) */
+
+  Tree_Node *hit;               /* When find() succeeds, the node holding the record lba */
+  int hit_index;                /* and its index there */
+  unsigned int *free_lbas;      /* Sectors that no version of the tree uses any more */
+  int nfree, free_cap;
+  Retired_LBA *retired;         /* Sectors that only snapshots may still use */
+  int nretired, retired_cap;
+
+  struct btree *snapshots;      /* Live snapshots of this tree */
+  struct btree *snap_next;      /* Next snapshot in the owner's list */
+  struct btree *snap_of;        /* For a snapshot, the tree it was taken of */
+  unsigned long snap_gen;       /* For a snapshot, the gen it was taken at */
+  pthread_mutex_t snap_lock;    /* Protects snapshots; readers release from their own threads */
+
+  int wb_max;                   /* Write-back: most sectors left dirty (0 = inserts flush) */
+  unsigned long wb_interval;    /* Checkpoint at least this often while dirty, in ns (0 = never) */
+  unsigned long wb_last;        /* When the last checkpoint was gathered */
+  Flush_Piece *wb_recs;         /* Record writes since then, with copies of their data */
+  int wb_nrecs, wb_recs_cap;
+  long wb_sectors;              /* and how many sectors they are */
+  Wb_Batch *wb_batch;           /* The checkpoint the flusher is writing (NULL = none) */
+  unsigned long wb_gathered;    /* Checkpoints gathered */
+  unsigned long wb_done;        /* and landed */
+  int wb_quit;                  /* Tells the flusher to write what's left and stop */
+  pthread_t wb_thread;          /* The flusher */
+  pthread_mutex_t wb_lock;      /* Held by the flusher and by every call while write-back is on */
+  pthread_cond_t wb_cond;       /* Wakes the flusher */
+  pthread_cond_t wb_room;       /* Signals that a checkpoint landed */
 } B_Tree;
 
+/*  key_cmp
+ *  Compares two keys the way the tree orders them.
+ *  Returns <0, 0 or >0 like memcmp().
+ *
+ *  @TREE is the B_Tree
+ *  @a and @b are the keys
+ */
+int key_cmp(B_Tree *TREE, void *a, void *b){
+    unsigned long x, y;
+    unsigned int u, v;
+    long i, j;
+
+    switch(TREE->flags & B_TREE_KEY_TYPE){
+    case B_TREE_KEY_U32:
+        memcpy(&u,a,4);
+        memcpy(&v,b,4);
+        return (u > v) - (u < v);
+    case B_TREE_KEY_U64:
+        memcpy(&x,a,8);
+        memcpy(&y,b,8);
+        return (x > y) - (x < y);
+    case B_TREE_KEY_I64:
+        memcpy(&i,a,8);
+        memcpy(&j,b,8);
+        return (i > j) - (i < j);
+    case B_TREE_KEY_CUSTOM:
+        return TREE->compare(a,b,TREE->key_size);
+    default:
+        return memcmp(a,b,TREE->key_size);
+    }
+}
+
+/* Defines a node search for one integer key type.  The key and the stride
+   are fixed at compile time, so each compare is a load and a register
+   compare instead of a call. */
+#define NODE_SEARCH(NAME, TYPE)                                             \
+int NAME(Tree_Node *t, void *key, int *comp){                               \
+    TYPE k, x;                                                              \
+    int i;                                                                  \
+                                                                            \
+    memcpy(&k,key,sizeof(TYPE));                                            \
+    for(i = 0; i < t->nkeys; i++){                                          \
+        memcpy(&x,t->bytes + 2 + sizeof(TYPE) * i,sizeof(TYPE));            \
+        if(k <= x){                                                         \
+            *comp = (k < x) ? -1 : 0;                                       \
+            return i;                                                       \
+        }                                                                   \
+    }                                                                       \
+    *comp = 1;                                                              \
+    return i;                                                               \
+}
+
+NODE_SEARCH(node_search_u32, unsigned int)
+NODE_SEARCH(node_search_u64, unsigned long)
+NODE_SEARCH(node_search_i64, long)
+
+/*  node_search
+ *  Returns the index of the first key in a node that isn't less than key,
+ *  or nkeys if they all are, and sets comp to how key compares with it
+ *  (1 when it's past the end).
+ *
+ *  @TREE is the B_Tree
+ *  @t is the node
+ *  @key is the key
+ *  @comp gets the comparison
+ */
+int node_search(B_Tree *TREE, Tree_Node *t, void *key, int *comp){
+    int i, c;
+
+    switch(TREE->flags & B_TREE_KEY_TYPE){
+    case B_TREE_KEY_U32: return node_search_u32(t,key,comp);
+    case B_TREE_KEY_U64: return node_search_u64(t,key,comp);
+    case B_TREE_KEY_I64: return node_search_i64(t,key,comp);
+    }
+    for(i = 0; i < t->nkeys; i++){
+        c = key_cmp(TREE,key,KEY(TREE,t,i));
+        if(c <= 0){
+            *comp = c;
+            return i;
+        }
+    }
+    *comp = 1;
+    return i;
+}
+
+/*  arena_setup
+ *  Sets up the node arena of a B_Tree.
+ *  Each frame holds the Tree_Node followed by its
+ *  lbas array, so a node is one allocation.
+ *
+ *  @TREE is the B_Tree (keys_per_block must be set)
+ */
+void arena_setup(B_Tree *TREE){
+    size_t size;
+
+    size = sizeof(Tree_Node);
+    size += (TREE->lbas_per_block+1) * sizeof(unsigned int);
+    if(TREE->flags & B_TREE_COUNTS) size += (TREE->lbas_per_block+1) * sizeof(unsigned int);
+
+    TREE->node_size = (size + 63) & ~((size_t) 63);
+    TREE->slabs = NULL;
+    TREE->free_list = NULL;
+    TREE->hash_size = 64;
+    TREE->nnodes = 0;
+    TREE->node_hash = calloc(TREE->hash_size, sizeof(Tree_Node *));
+    TREE->dirty = NULL;
+    TREE->ndirty = TREE->dirty_cap = 0;
+}
+
+/*  t_node_alloc
+ *  Returns a new Tree_Node frame from the arena.
+ *  Grabs a new slab when the current one is used up, or was laid out
+ *  for the other I/O mode.  For O_DIRECT, frames are a multiple of
+ *  JDISK_ALIGN apart and start so that every node's bytes are aligned,
+ *  and the jdisk reads and writes them in place.
+ *
+ *  @TREE is the B_Tree
+ */
+Tree_Node *t_node_alloc(B_Tree *TREE){
+    Node_Slab *s = TREE->slabs;
+    Tree_Node *node;
+    size_t size, lead;
+
+    if(s == NULL || s->used == SLAB_NODES || s->direct != TREE->direct){
+        s = malloc(sizeof(Node_Slab));
+        if(s == NULL) return NULL;
+        size = TREE->node_size;
+        lead = 0;
+        if(TREE->direct){
+            size = (size + JDISK_ALIGN - 1) & ~((size_t) JDISK_ALIGN - 1);
+            lead = JDISK_ALIGN - offsetof(Tree_Node,bytes);
+        }
+        s->frames = aligned_alloc(TREE->direct ? JDISK_ALIGN : 64, size * SLAB_NODES + (lead ? JDISK_ALIGN : 0));
+        if(s->frames == NULL){
+            free(s);
+            return NULL;
+        }
+        s->used = 0;
+        s->direct = TREE->direct;
+        s->node_size = size;
+        s->first = s->frames + lead;
+        s->next = TREE->slabs;
+        TREE->slabs = s;
+    }
+
+    node = (Tree_Node *) (s->first + s->node_size * s->used);
+    s->used++;
+
+    // the lbas (and counts) live in the same frame right after the keys
+    node->lbas = (unsigned int *) (node + 1);
+    node->counts = NULL;
+    if(TREE->flags & B_TREE_COUNTS) node->counts = node->lbas + TREE->lbas_per_block + 1;
+    return node;
+}
+
+/*  arena_free
+ *  Gives all node frames back in one go.
+ *
+ *  @TREE is the B_Tree
+ */
+void arena_free(B_Tree *TREE){
+    Node_Slab *s;
+
+    while(TREE->slabs != NULL){
+        s = TREE->slabs;
+        TREE->slabs = s->next;
+        free(s->frames);
+        free(s);
+    }
+    free(TREE->node_hash);
+    TREE->node_hash = NULL;
+    TREE->free_list = NULL;
+    free(TREE->dirty);
+    TREE->dirty = NULL;
+    TREE->ndirty = TREE->dirty_cap = 0;
+}
+
+/*  mark_dirty
+ *  Sets a node's flush field and puts it on the dirty list.
+ *
+ *  @TREE is the B_Tree
+ *  @t is the node
+ */
+void mark_dirty(B_Tree *TREE, Tree_Node *t){
+    if(t->flush == 1) return;
+    if(TREE->ndirty == TREE->dirty_cap){
+        TREE->dirty_cap = (TREE->dirty_cap == 0) ? 64 : TREE->dirty_cap * 2;
+        TREE->dirty = realloc(TREE->dirty, TREE->dirty_cap * sizeof(Tree_Node *));
+    }
+    t->flush = 1;
+    TREE->dirty[TREE->ndirty++] = t;
+}
+
+/*  node_hash_add
+ *  Adds a node to the lba hash of held nodes.
+ *  Doubles the table when it gets more than one node per bucket.
+ *
+ *  @TREE is the B_Tree
+ *  @node is the node (its lba must be set)
+ */
+void node_hash_add(B_Tree *TREE, Tree_Node *node){
+    Tree_Node *t;
+    int h;
+
+    if(TREE->nnodes >= TREE->hash_size){
+        free(TREE->node_hash);
+        TREE->hash_size *= 2;
+        TREE->node_hash = calloc(TREE->hash_size, sizeof(Tree_Node *));
+        for(t = TREE->free_list; t != NULL; t = t->ptr){
+            if(t == node) continue;
+            h = t->lba & (TREE->hash_size-1);
+            t->hnext = TREE->node_hash[h];
+            TREE->node_hash[h] = t;
+        }
+    }
+
+    h = node->lba & (TREE->hash_size-1);
+    node->hnext = TREE->node_hash[h];
+    TREE->node_hash[h] = node;
+    TREE->nnodes++;
+}
+
+/*  node_hash_remove
+ *  Takes a node out of the lba hash.
+ *
+ *  @TREE is the B_Tree
+ *  @node is the node
+ */
+void node_hash_remove(B_Tree *TREE, Tree_Node *node){
+    Tree_Node **p = &TREE->node_hash[node->lba & (TREE->hash_size-1)];
+
+    while(*p != node) p = &(*p)->hnext;
+    *p = node->hnext;
+    TREE->nnodes--;
+}
+
+/*  node_lookup
+ *  Returns the held node for an lba, or NULL if it isn't held.
+ *  Never reads from disk.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the logical block address
+ */
+Tree_Node *node_lookup(B_Tree *TREE, unsigned int lba){
+    Tree_Node *node = TREE->node_hash[lba & (TREE->hash_size-1)];
+
+    while(node != NULL && node->lba != lba) node = node->hnext;
+    return node;
+}
+
+/*  region_room
+ *  Returns how many sectors a region can still hand out.
+ *
+ *  @TREE is the B_Tree (with B_TREE_LOCALITY)
+ *  @r is the region
+ */
+int region_room(B_Tree *TREE, long r){
+    unsigned long start = (unsigned long) r * B_TREE_REGION_SECTORS;
+    unsigned long end = start + B_TREE_REGION_SECTORS;
+
+    if(start >= TREE->num_lbas) return 0;
+    if(end > TREE->num_lbas) end = TREE->num_lbas;
+    return end - start - TREE->map[r].used;
+}
+
+/*  map_touch
+ *  Marks the map sector holding a region dirty.
+ *
+ *  @TREE is the B_Tree
+ *  @r is the region
+ */
+void map_touch(B_Tree *TREE, long r){
+    long s = r / MAP_PER_SECTOR;
+
+    if(!TREE->map_dirty[s]){
+        TREE->map_dirty[s] = 1;
+        TREE->map_ndirty++;
+    }
+}
+
+/*  region_claim
+ *  Makes a free region one for some kind of sector and returns it.
+ *
+ *  @TREE is the B_Tree
+ *  @r is the region
+ *  @kind is a B_TREE_REGION_* kind
+ */
+long region_claim(B_Tree *TREE, long r, int kind){
+    TREE->map[r].kind = kind;
+    map_touch(TREE,r);
+    return r;
+}
+
+/*  region_find
+ *  Returns the region nearest another that has room for a sector of
+ *  some kind: one of that kind, or a free one between lo and hi, which
+ *  is claimed for it.  Failing those, a free one outside them, then the
+ *  nearest region of another kind with room.  Returns -1 if every
+ *  region is full.
+ *
+ *  @TREE is the B_Tree (with B_TREE_LOCALITY)
+ *  @kind is a B_TREE_REGION_* kind
+ *  @near is the region
+ *  @lo and @hi bound where a free region may be claimed first
+ */
+long region_find(B_Tree *TREE, int kind, long near, long lo, long hi){
+    long nregions = (TREE->num_lbas + B_TREE_REGION_SECTORS - 1) / B_TREE_REGION_SECTORS;
+    long r, d, spare, other;
+    int side;
+
+    spare = other = -1;
+    for(d = 0; d < nregions; d++){
+        for(side = -1; side <= 1; side += 2){
+            r = near + side * d;
+            if(r < 0 || r >= nregions || region_room(TREE,r) == 0) continue;
+            if(TREE->map[r].kind == kind) return r;
+            if(TREE->map[r].kind != B_TREE_REGION_FREE){
+                if(other < 0) other = r;
+            }else if(r >= lo && r < hi){
+                return region_claim(TREE,r,kind);
+            }else if(spare < 0){
+                spare = r;
+            }
+        }
+    }
+    return (spare >= 0) ? region_claim(TREE,spare,kind) : other;
+}
+
+/*  region_alloc
+ *  Returns a sector for alloc_lba() with B_TREE_LOCALITY: a freed one
+ *  from a region of the right kind if one of the last FREE_SCAN freed
+ *  is, else the next one in the region region_find() picks, else the
+ *  last one freed.  Nodes claim regions in the node zone at the front,
+ *  and records past it.
+ *
+ *  @TREE is the B_Tree
+ *  @kind is a B_TREE_REGION_* kind
+ *  @near is a sector to put it near (0 = near the last one of this kind)
+ */
+unsigned int region_alloc(B_Tree *TREE, int kind, unsigned int near){
+    long nregions = (TREE->num_lbas + B_TREE_REGION_SECTORS - 1) / B_TREE_REGION_SECTORS;
+    long zone, r;
+    unsigned int lba;
+    int i;
+
+    for(i = TREE->nfree - 1; i >= 0 && i >= TREE->nfree - FREE_SCAN; i--){
+        lba = TREE->free_lbas[i];
+        if(TREE->map[lba / B_TREE_REGION_SECTORS].kind == kind){
+            TREE->free_lbas[i] = TREE->free_lbas[--TREE->nfree];
+            return lba;
+        }
+    }
+
+    // the node zone: a half full leaf for every sector's worth of records, and at most half the jdisk
+    zone = TREE->num_lbas / (TREE->keys_per_block / 2 + 1) / B_TREE_REGION_SECTORS + 1;
+    if(zone > nregions / 2) zone = nregions / 2;
+    if(zone < 1) zone = 1;
+
+    if(near == 0){
+        r = (TREE->map_cur[kind] >= 0) ? TREE->map_cur[kind] : (kind == B_TREE_REGION_RECORD) ? zone : 0;
+    }else{
+        r = near / B_TREE_REGION_SECTORS;
+    }
+    if(kind == B_TREE_REGION_RECORD) r = region_find(TREE,kind,r,zone,nregions);
+    else r = region_find(TREE,kind,r,0,zone);
+    if(r < 0){
+        if(TREE->nfree > 0) return TREE->free_lbas[--TREE->nfree];
+        if(TREE->first_free_block >= TREE->num_lbas) TREE->failed = 1;
+        return TREE->first_free_block++;
+    }
+
+    lba = r * B_TREE_REGION_SECTORS + TREE->map[r].used;
+    TREE->map[r].used++;
+    map_touch(TREE,r);
+    TREE->map_left--;
+    TREE->map_cur[kind] = r;
+    if(lba >= TREE->first_free_block) TREE->first_free_block = lba + 1;
+    TREE->flush = 1;
+    return lba;
+}
+
+/*  alloc_lba
+ *  Returns a sector for a new node or record.
+ *  Reuses reclaimed sectors before taking one off the end.  With
+ *  B_TREE_LOCALITY, it comes out of a region for its kind instead.
+ *  tree_insert() leaves room for the worst case, but if the end is
+ *  passed anyway, the tree is marked failed and commit() drops the
+ *  insert instead of writing it.
+ *
+ *  @TREE is the B_Tree
+ *  @kind is what goes there: B_TREE_REGION_INTERNAL, _LEAF or _RECORD
+ *  @near is a sector to put it near (0 = none)
+ */
+unsigned int alloc_lba(B_Tree *TREE, int kind, unsigned int near){
+    if(TREE->map != NULL) return region_alloc(TREE,kind,near);
+    if(TREE->nfree > 0) return TREE->free_lbas[--TREE->nfree];
+    if(TREE->first_free_block >= TREE->num_lbas) TREE->failed = 1;
+    TREE->flush = 1;
+    return TREE->first_free_block++;
+}
+
+/*  sectors_left
+ *  Returns how many sectors have never been handed out, not counting
+ *  freed ones.
+ *
+ *  @TREE is the B_Tree
+ */
+unsigned long sectors_left(B_Tree *TREE){
+    if(TREE->map != NULL) return TREE->map_left;
+    return (TREE->first_free_block < TREE->num_lbas) ? TREE->num_lbas - TREE->first_free_block : 0;
+}
+
+/*  retire_lba
+ *  Remembers that the commit in progress stops using a sector.
+ *  It is reused once no snapshot can still see it.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the sector
+ */
+void retire_lba(B_Tree *TREE, unsigned int lba){
+    if(TREE->nretired == TREE->retired_cap){
+        TREE->retired_cap = (TREE->retired_cap == 0) ? 64 : TREE->retired_cap * 2;
+        TREE->retired = realloc(TREE->retired, TREE->retired_cap * sizeof(Retired_LBA));
+    }
+    TREE->retired[TREE->nretired].lba = lba;
+    TREE->retired[TREE->nretired].gen = TREE->gen + 1;
+    TREE->nretired++;
+}
+
+/*  reclaim_lbas
+ *  Moves retired sectors that no live snapshot can see to the free list.
+ *  A sector retired by commit g is only visible to snapshots older than g.
+ *
+ *  @TREE is the B_Tree
+ */
+void reclaim_lbas(B_Tree *TREE){
+    B_Tree *snap;
+    unsigned long oldest;
+    int i, j;
+
+    // find the oldest snapshot still around
+    oldest = TREE->gen;
+    pthread_mutex_lock(&TREE->snap_lock);
+    for(snap = TREE->snapshots; snap != NULL; snap = snap->snap_next){
+        if(snap->snap_gen < oldest) oldest = snap->snap_gen;
+    }
+    pthread_mutex_unlock(&TREE->snap_lock);
+
+    j = 0;
+    for(i = 0; i < TREE->nretired; i++){
+        if(TREE->retired[i].gen <= oldest){
+            if(TREE->nfree == TREE->free_cap){
+                TREE->free_cap = (TREE->free_cap == 0) ? 64 : TREE->free_cap * 2;
+                TREE->free_lbas = realloc(TREE->free_lbas, TREE->free_cap * sizeof(unsigned int));
+            }
+            TREE->free_lbas[TREE->nfree++] = TREE->retired[i].lba;
+        }else{
+            TREE->retired[j++] = TREE->retired[i];
+        }
+    }
+    TREE->nretired = j;
+}
+
+/*  pack_slot
+ *  Finds where a slot's data sits in a packed sector.
+ *  Asking for slot n (the first unused one) gives the offset where new
+ *  data would go.  Returns 0, or -1 if the sector is corrupt.
+ *
+ *  @buf is the packed sector
+ *  @slot is the slot
+ *  @off gets the offset of the data
+ *  @len gets its length (may be NULL)
+ */
+int pack_slot(unsigned char *buf, int slot, int *off, int *len){
+    int n = buf[0] | (buf[1] << 8);
+
+    if(n > PACK_SLOTS || slot > n) return -1;
+    if(slot == n){
+        *off = (n == 0) ? PACK_HDR : (buf[4*n-2] | (buf[4*n-1] << 8)) + (buf[4*n] | (buf[4*n+1] << 8));
+        if(len != NULL) *len = 0;
+    }else{
+        *off = buf[2 + 4*slot] | (buf[3 + 4*slot] << 8);
+        if(len != NULL) *len = buf[4 + 4*slot] | (buf[5 + 4*slot] << 8);
+    }
+    if(*off < PACK_HDR || *off > JDISK_SECTOR_SIZE) return -1;
+    if(len != NULL && *off + *len > JDISK_SECTOR_SIZE) return -1;
+    return 0;
+}
+
+/*  sector_crc
+ *  Returns the checksum table entry for a sector's contents.
+ *
+ *  @buf is the sector
+ */
+unsigned int sector_crc(void *buf){
+    unsigned int c = crc32c(0,buf,JDISK_SECTOR_SIZE);
+
+    return (c == 0) ? 1 : c;
+}
+
+/*  crc_set
+ *  Puts the checksums of sectors about to be written in the table.
+ *  Sectors past what it covers are only handed out once the tree has
+ *  failed, and are never written, so they are left out.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the first sector
+ *  @data is what goes there
+ *  @n is how many sectors
+ */
+void crc_set(B_Tree *TREE, unsigned int lba, void *data, int n){
+    unsigned int s;
+    int i;
+
+    if(TREE->crc == NULL) return;
+    for(i = 0; i < n && lba + i < (unsigned long) TREE->crc_sectors * CRC_PER_SECTOR; i++){
+        TREE->crc[lba + i] = sector_crc((unsigned char *) data + (size_t) i * JDISK_SECTOR_SIZE);
+        s = (lba + i) / CRC_PER_SECTOR;
+        if(!TREE->crc_dirty[s]){
+            TREE->crc_dirty[s] = 1;
+            TREE->crc_ndirty++;
+        }
+    }
+}
+
+/*  crc_check
+ *  Checks sectors just read against the table.
+ *  Returns 0 if they match (or the tree has no table), and -1 if one
+ *  doesn't or lies past what the table covers.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the first sector
+ *  @data is what was read
+ *  @n is how many sectors
+ */
+int crc_check(B_Tree *TREE, unsigned int lba, void *data, int n){
+    unsigned int c;
+    int i;
+
+    if(TREE->crc == NULL) return 0;
+    if((unsigned long) lba + n > (unsigned long) TREE->crc_sectors * CRC_PER_SECTOR) return -1;
+    for(i = 0; i < n; i++){
+        c = TREE->crc[lba + i];
+        if(c != 0 && c != sector_crc((unsigned char *) data + (size_t) i * JDISK_SECTOR_SIZE)) return -1;
+    }
+    return 0;
+}
+
+/*  node_check
+ *  Checks a node sector just read.  One that fails its checksum or
+ *  couldn't be read is counted in nbad and becomes an empty leaf, so
+ *  lookups under it miss instead of following garbage lbas.
+ *  Returns 0 if the sector is good, else B_TREE_BAD_CHECKSUM.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the sector
+ *  @buf is what was read
+ *  @rv is what the read returned
+ */
+int node_check(B_Tree *TREE, unsigned int lba, void *buf, int rv){
+    if(rv == 0 && crc_check(TREE,lba,buf,1) == 0) return 0;
+
+    // a new node past the end of a tree that ran out of room is never written
+    if(!TREE->failed || lba < TREE->num_lbas) TREE->nbad++;
+    memset(buf,0,JDISK_SECTOR_SIZE);
+    return B_TREE_BAD_CHECKSUM;
+}
+
+Tree_Node *t_node_init(B_Tree *TREE, Tree_Node *node, unsigned int lba, Tree_Node *parent, int pindex);
+
 /*  t_node_setup
  *  Returns a handle to a new Tree_Node.
  *  Reads the information into the Tree_Node and stores
@@ -54,10 +842,10 @@ typedef struct {
  *  @pindex is the index in the parent
  */
 void *t_node_setup(B_Tree* TREE, unsigned int lba, void* parent, int pindex){
-    unsigned char buf[JDISK_SECTOR_SIZE];
     Tree_Node *node;
+    int bad;
 
-    node = TREE->free_list;
+    node = TREE->node_hash[lba & (TREE->hash_size-1)];
 
     // see if we have already read that block
     while(node != NULL){
@@ -67,405 +855,3636 @@ void *t_node_setup(B_Tree* TREE, unsigned int lba, void* parent, int pindex){
             if(node->parent != parent) node->parent = parent;
             return node;
         }
-        node = node->ptr;
+        node = node->hnext;
     }
 
-    node = malloc(sizeof(struct tnode));
+    // read it straight into a new frame
+    node = t_node_alloc(TREE);
+    bad = node_check(TREE,lba,node->bytes,jdisk_read(TREE->disk,lba,node->bytes));
+    node = t_node_init(TREE,node,lba,parent,pindex);
+    node->bad = (bad != 0);
+    return node;
+}
+
+/*  t_node_install
+ *  Returns a new held Tree_Node made from a sector that was already read.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the sector's logical block address
+ *  @buf is the sector
+ *  @parent is what the parent should be set to
+ *  @pindex is the index in the parent
+ */
+Tree_Node *t_node_install(B_Tree *TREE, unsigned int lba, void *buf, Tree_Node *parent, int pindex){
+    Tree_Node *node;
 
-    // read in the node
-    jdisk_read(TREE->disk,lba,buf);
+    node = t_node_alloc(TREE);
     memcpy(node->bytes,buf,JDISK_SECTOR_SIZE);
+    return t_node_init(TREE,node,lba,parent,pindex);
+}
 
+/*  t_node_init
+ *  Fills in and holds a new Tree_Node whose bytes hold its sector.
+ *
+ *  @TREE is the B_Tree
+ *  @node is the frame
+ *  @lba is the sector's logical block address
+ *  @parent is what the parent should be set to
+ *  @pindex is the index in the parent
+ */
+Tree_Node *t_node_init(B_Tree *TREE, Tree_Node *node, unsigned int lba, Tree_Node *parent, int pindex){
     // set defaults and add it to the free_list
     node->internal = node->bytes[0];
     node->nkeys = node->bytes[1];
     node->lba = lba;
     node->ptr = TREE->free_list;
     node->flush = 0;
+    node->fresh = 0;
+    node->bad = 0;
     node->parent = parent;
     node->parent_index = pindex;
+    node_hash_add(TREE,node);
     TREE->free_list = node;
 
-    // set up keys
-    node->keys = malloc((TREE->keys_per_block+1) * sizeof(unsigned char *));
-
-    for(int i = 0; i <= TREE->keys_per_block; i++){
-        node->keys[i] = node->bytes + 2 + TREE->key_size * i;
-    }
-    
     // set the lbas
-    node->lbas = malloc((TREE->lbas_per_block+1) * sizeof(int));
     memcpy(node->lbas,(void *) node->bytes + (JDISK_SECTOR_SIZE - TREE->lbas_per_block * 4), TREE->lbas_per_block * 4);
+    if(node->counts != NULL) memcpy(node->counts,node->bytes + COUNTS_OFF(TREE),TREE->lbas_per_block * 4);
 
     return node;
 }
 
-void flush(B_Tree *TREE);
+int flush(B_Tree *TREE);
+unsigned int recursive_find(B_Tree *TREE,Tree_Node *t, void *key);
+void warm_load(B_Tree *TREE);
+void warm_save(B_Tree *TREE);
 
-/*  b_tree_create
- *  Returns a handle to a new B_Tree.
- *  Creates a new jdisk using the filename and size.
- *  Sets all the values in the B_Tree. 
- * 
- *  @filename is the name of the jdisk file
- *  @size is the size of that jdisk file
- *  @key_size is the size of each key
+/*  tree_setup
+ *  Sets up everything in a B_Tree that isn't stored on disk.
+ *  key_size, root_lba, first_free_block and disk must be set.
+ *
+ *  @TREE is the B_Tree
  */
-void *b_tree_create(char *filename, long size, int key_size){
-    B_Tree *TREE = malloc(sizeof(B_Tree));
-    Tree_Node *t;
-    
-    // create the disk and set the B_Tree info
-    TREE->disk = jdisk_create(filename,size);
-    TREE->key_size = key_size;
-    TREE->first_free_block = 2;
-    TREE->root_lba = 1;
-    TREE->flush = 1;
-
-    // get the size and set all the info based off it
+void tree_setup(B_Tree *TREE){
     TREE->size = jdisk_size(TREE->disk);
     TREE->num_lbas = TREE->size/JDISK_SECTOR_SIZE;
     TREE->keys_per_block = (JDISK_SECTOR_SIZE - 6) / (TREE->key_size + 4);
+    if(TREE->flags & B_TREE_COUNTS) TREE->keys_per_block = (JDISK_SECTOR_SIZE - 10) / (TREE->key_size + 8);
     TREE->lbas_per_block = TREE->keys_per_block + 1;
     TREE->tmp_e = NULL;
     TREE->tmp_e_index = -1;
+    TREE->tail = NULL;
+    TREE->direct = 0;
+    TREE->append = 0;
+    TREE->appending = 0;
+    TREE->hit = NULL;
+    TREE->hit_index = -1;
+    TREE->grow_extent = 0;
+    TREE->pack_buf = NULL;
+    TREE->pack_used = PACK_HDR;
+    TREE->bloom = NULL;
+    TREE->bloom_dirty = NULL;
+    TREE->bloom_ndirty = 0;
+    TREE->crc = NULL;
+    TREE->crc_dirty = NULL;
+    TREE->crc_ndirty = 0;
+    TREE->nbad = 0;
+    TREE->failed = 0;
+    TREE->map = NULL;
+    TREE->map_dirty = NULL;
+    TREE->map_ndirty = 0;
+    TREE->map_left = 0;
+    for(int i = 0; i < B_TREE_REGION_MIXED; i++) TREE->map_cur[i] = -1;
+    TREE->pack_dirty = 0;
+    TREE->rec_data = NULL;
+    TREE->msg_keys = NULL;
+    TREE->msg_lbas = NULL;
+    TREE->nmsgs = 0;
+    TREE->msg_cap = 0;
+    TREE->hot = NULL;
+    TREE->filename = NULL;
+    TREE->manifest = 0;
+    TREE->trace = NULL;
+    TREE->trace_errors = 0;
+    TREE->compare = NULL;
+    if(TREE->flags & B_TREE_COMPRESS){
+        TREE->pack_buf = calloc(1,JDISK_SECTOR_SIZE);
+        if(TREE->pack_lba != 0){
+            jdisk_read(TREE->disk,TREE->pack_lba,TREE->pack_buf);
+            pack_slot(TREE->pack_buf,TREE->pack_buf[0] | (TREE->pack_buf[1] << 8),&TREE->pack_used,NULL);
+        }
+    }
+    TREE->cow = 0;
+    TREE->gen = 0;
+    TREE->free_lbas = NULL;
+    TREE->nfree = TREE->free_cap = 0;
+    TREE->retired = NULL;
+    TREE->nretired = TREE->retired_cap = 0;
+    TREE->snapshots = NULL;
+    TREE->snap_next = NULL;
+    TREE->snap_of = NULL;
+    TREE->snap_gen = 0;
+    pthread_mutex_init(&TREE->snap_lock,NULL);
+    TREE->wb_max = 0;
+    TREE->wb_interval = 0;
+    TREE->wb_recs = NULL;
+    TREE->wb_nrecs = TREE->wb_recs_cap = 0;
+    TREE->wb_sectors = 0;
+    TREE->wb_batch = NULL;
+    TREE->wb_gathered = TREE->wb_done = 0;
+    TREE->wb_quit = 0;
+    arena_setup(TREE);
+}
 
-    // setup the root node
-    TREE->root = t_node_setup(TREE,TREE->root_lba,NULL,-1);
-    t = TREE->root;
-    t->lbas[0] = 0;
-    for(int i = 0; i < TREE->keys_per_block; i++) t->lbas[i] = 0;
+/*  superblock_bytes
+ *  Fills in the sector 0 that holds the B_Tree info.
+ *
+ *  @TREE is the B_Tree
+ *  @buf gets JDISK_SECTOR_SIZE bytes
+ */
+void superblock_bytes(B_Tree *TREE, unsigned char *buf){
+    memset(buf,0,JDISK_SECTOR_SIZE);
+    memcpy(buf,&TREE->key_size,4);
+    memcpy(buf+4,&TREE->root_lba,4);
+    memcpy(buf+8,&TREE->first_free_block,8);
+    if(TREE->flags != 0){
+        memcpy(buf+SB_MAGIC_OFF,SB_MAGIC,8);
+        memcpy(buf+SB_FLAGS_OFF,&TREE->flags,4);
+        memcpy(buf+SB_PACK_OFF,&TREE->pack_lba,4);
+        memcpy(buf+SB_BLOOM_LBA_OFF,&TREE->bloom_lba,4);
+        memcpy(buf+SB_BLOOM_SECTORS_OFF,&TREE->bloom_sectors,4);
+        memcpy(buf+SB_CRC_LBA_OFF,&TREE->crc_lba,4);
+        memcpy(buf+SB_CRC_SECTORS_OFF,&TREE->crc_sectors,4);
+        memcpy(buf+SB_MAP_LBA_OFF,&TREE->map_lba,4);
+        memcpy(buf+SB_MAP_SECTORS_OFF,&TREE->map_sectors,4);
+    }
+}
+
+/*  write_superblock
+ *  Writes the B_Tree info to sector 0.
+ *  This single sector write is what commits an insert: until it lands,
+ *  an attach sees the old root.
+ *  Returns 0, or what jdisk_write() returned on failure.
+ *
+ *  @TREE is the B_Tree
+ */
+int write_superblock(B_Tree *TREE){
+    unsigned char buf[JDISK_SECTOR_SIZE];
+
+    superblock_bytes(TREE,buf);
+    return jdisk_write(TREE->disk,0,buf);
+}
+
+/*  map_setup
+ *  Starts the region map of a new tree.  The regions up to
+ *  first_free_block hold the superblock, root and tables; the rest of
+ *  the last of them is the first region for internal nodes.
+ *
+ *  @TREE is the B_Tree (with map_lba, map_sectors and first_free_block set)
+ */
+void map_setup(B_Tree *TREE){
+    unsigned long lba;
+    long r;
+
+    TREE->map = calloc(TREE->map_sectors,JDISK_SECTOR_SIZE);
+    TREE->map_dirty = calloc(TREE->map_sectors,1);
+    for(lba = 0; lba < TREE->first_free_block; lba += B_TREE_REGION_SECTORS){
+        r = lba / B_TREE_REGION_SECTORS;
+        TREE->map[r].kind = B_TREE_REGION_META;
+        TREE->map[r].used = B_TREE_REGION_SECTORS;
+        if(TREE->first_free_block - lba < B_TREE_REGION_SECTORS){
+            TREE->map[r].kind = B_TREE_REGION_INTERNAL;
+            TREE->map[r].used = TREE->first_free_block - lba;
+        }
+        map_touch(TREE,r);
+    }
+    TREE->map_left = (TREE->num_lbas > TREE->first_free_block) ? TREE->num_lbas - TREE->first_free_block : 0;
+}
+
+/*  map_load
+ *  Reads the region map of an existing tree and counts what is left in
+ *  it.  A map that fails its checksum counts as a bad sector, so
+ *  nothing is inserted on top of it.
+ *
+ *  @TREE is the B_Tree (with map_lba and map_sectors set)
+ */
+void map_load(B_Tree *TREE){
+    struct iovec iov;
+    long r, nregions;
+
+    TREE->map = malloc((size_t) TREE->map_sectors * JDISK_SECTOR_SIZE);
+    TREE->map_dirty = calloc(TREE->map_sectors,1);
+    iov.iov_base = TREE->map;
+    iov.iov_len = (size_t) TREE->map_sectors * JDISK_SECTOR_SIZE;
+    if(jdisk_readv(TREE->disk,TREE->map_lba,&iov,1) != 0
+       || crc_check(TREE,TREE->map_lba,TREE->map,TREE->map_sectors) != 0) TREE->nbad++;
+
+    TREE->map_left = 0;
+    nregions = (TREE->num_lbas + B_TREE_REGION_SECTORS - 1) / B_TREE_REGION_SECTORS;
+    for(r = 0; r < nregions; r++) TREE->map_left += region_room(TREE,r);
+}
+
+/*  b_tree_create
+ *  Returns a handle to a new B_Tree.
+ *  Creates a new jdisk using the filename and size.
+ *  Sets all the values in the B_Tree. 
+ * 
+ *  @filename is the name of the jdisk file
+ *  @size is the size of that jdisk file
+ *  @key_size is the size of each key
+ */
+void *b_tree_create(char *filename, long size, int key_size){
+    return b_tree_create_flags(filename,size,key_size,0);
+}
+
+/*  b_tree_create_flags
+ *  Returns a handle to a new B_Tree that uses the given on-disk options,
+ *  or NULL on failure.  The flags are kept in sector 0, so
+ *  b_tree_attach() picks them up again.
+ *
+ *  @filename is the name of the jdisk file
+ *  @size is the size of that jdisk file
+ *  @key_size is the size of each key
+ *  @flags is a mask of B_TREE_* flags
+ */
+void *b_tree_create_flags(char *filename, long size, int key_size, int flags){
+    B_Tree *TREE;
+    Tree_Node *t;
+
+    if(flags & ~B_TREE_FLAGS) return NULL;
+    if((flags & B_TREE_COMPRESS) && size / JDISK_SECTOR_SIZE > PACK_MAX_LBAS) return NULL;
+    if((flags & B_TREE_COMPRESS) && (flags & B_TREE_EXTENTS)) return NULL;
+    if((flags & B_TREE_EXTENTS) && size / JDISK_SECTOR_SIZE > EXT_MAX_LBAS) return NULL;
+    if((flags & B_TREE_EXTENTS) && (flags & B_TREE_LOCALITY)) return NULL;
+    switch(flags & B_TREE_KEY_TYPE){
+    case B_TREE_KEY_BYTES: case B_TREE_KEY_CUSTOM: break;
+    case B_TREE_KEY_U32: if(key_size != 4) return NULL; break;
+    case B_TREE_KEY_U64: case B_TREE_KEY_I64: if(key_size != 8) return NULL; break;
+    default: return NULL;
+    }
+
+    TREE = malloc(sizeof(B_Tree));
+    TREE->flags = flags;
+    TREE->pack_lba = 0;
+    TREE->bloom_lba = 0;
+    TREE->bloom_sectors = 0;
+    TREE->crc_lba = 0;
+    TREE->crc_sectors = 0;
+    TREE->map_lba = 0;
+    TREE->map_sectors = 0;
+    
+    // create the disk and set the B_Tree info
+    TREE->disk = jdisk_create(filename,size);
+    if(TREE->disk == NULL){
+        free(TREE);
+        return NULL;
+    }
+    TREE->key_size = key_size;
+    TREE->first_free_block = 2;
+    TREE->root_lba = 1;
+    TREE->flush = 1;
+
+    // the Bloom filter goes right after the root (the jdisk starts out zeroed)
+    if(flags & B_TREE_BLOOM){
+        TREE->bloom_lba = 2;
+        TREE->bloom_sectors = (size / JDISK_SECTOR_SIZE * BLOOM_BITS_PER_KEY / 8 + JDISK_SECTOR_SIZE - 1) / JDISK_SECTOR_SIZE;
+        TREE->first_free_block += TREE->bloom_sectors;
+    }
+
+    // then the checksum table, all zeros, so nothing is checked yet
+    if(flags & B_TREE_CHECKSUM){
+        TREE->crc_lba = TREE->first_free_block;
+        TREE->crc_sectors = (size / JDISK_SECTOR_SIZE * CRC_GROWTH + CRC_PER_SECTOR - 1) / CRC_PER_SECTOR;
+        TREE->first_free_block += TREE->crc_sectors;
+    }
+
+    // then the region map
+    if(flags & B_TREE_LOCALITY){
+        TREE->map_lba = TREE->first_free_block;
+        TREE->map_sectors = (size / JDISK_SECTOR_SIZE * MAP_GROWTH / B_TREE_REGION_SECTORS + MAP_PER_SECTOR - 1) / MAP_PER_SECTOR;
+        TREE->first_free_block += TREE->map_sectors;
+    }
+
+    // get the size and set all the info based off it
+    tree_setup(TREE);
+    TREE->filename = strdup(filename);
+    if(flags & B_TREE_BLOOM){
+        TREE->bloom = calloc(TREE->bloom_sectors,JDISK_SECTOR_SIZE);
+        TREE->bloom_dirty = calloc(TREE->bloom_sectors,1);
+    }
+    if(flags & B_TREE_CHECKSUM){
+        TREE->crc = calloc(TREE->crc_sectors,JDISK_SECTOR_SIZE);
+        TREE->crc_dirty = calloc(TREE->crc_sectors,1);
+    }
+    if(flags & B_TREE_LOCALITY) map_setup(TREE);
+
+    // setup the root node
+    TREE->root = t_node_setup(TREE,TREE->root_lba,NULL,-1);
+    t = TREE->root;
+    t->lbas[0] = 0;
+    for(int i = 0; i < TREE->keys_per_block; i++) t->lbas[i] = 0;
 
     // empty out the bytes section (random stuff makes lbas funky)
     explicit_bzero(t->bytes,JDISK_SECTOR_SIZE+256);
 
     // set some defaults of root node
-    t->flush = 1;
+    mark_dirty(TREE,t);
     t->internal = 0;
     t->nkeys = 0;
 
-    // flush the information to disk
-    flush(TREE);
-    return TREE;
+    // flush the information to disk
+    if(flush(TREE) != 0){
+        b_tree_detach(TREE);
+        return NULL;
+    }
+    return TREE;
+}
+
+/*  b_tree_attach
+ *  Returns a handle to an existing B_Tree.
+ *  Reads values from jdisk and sets up the B_Tree. 
+ * 
+ *  @filename is the name of the jdisk file
+ */
+void *b_tree_attach(char *filename){
+    unsigned char buf[JDISK_SECTOR_SIZE];
+    struct iovec iov;
+    B_Tree *TREE = malloc(sizeof(B_Tree));
+
+    TREE->disk = jdisk_attach(filename);
+    if(TREE->disk == NULL){
+        free(TREE);
+        return NULL;
+    }
+
+    jdisk_read(TREE->disk,0,buf);
+
+    // read in BTREE info
+    memcpy(&TREE->key_size,buf,4);
+    memcpy(&TREE->root_lba,buf+4,4);
+    memcpy(&TREE->first_free_block,buf+8,8);
+    TREE->flags = 0;
+    TREE->pack_lba = 0;
+    TREE->bloom_lba = 0;
+    TREE->bloom_sectors = 0;
+    TREE->crc_lba = 0;
+    TREE->crc_sectors = 0;
+    TREE->map_lba = 0;
+    TREE->map_sectors = 0;
+    if(memcmp(buf+SB_MAGIC_OFF,SB_MAGIC,8) == 0){
+        memcpy(&TREE->flags,buf+SB_FLAGS_OFF,4);
+        memcpy(&TREE->pack_lba,buf+SB_PACK_OFF,4);
+        memcpy(&TREE->bloom_lba,buf+SB_BLOOM_LBA_OFF,4);
+        memcpy(&TREE->bloom_sectors,buf+SB_BLOOM_SECTORS_OFF,4);
+        memcpy(&TREE->crc_lba,buf+SB_CRC_LBA_OFF,4);
+        memcpy(&TREE->crc_sectors,buf+SB_CRC_SECTORS_OFF,4);
+        memcpy(&TREE->map_lba,buf+SB_MAP_LBA_OFF,4);
+        memcpy(&TREE->map_sectors,buf+SB_MAP_SECTORS_OFF,4);
+    }
+
+    // set up some values
+    tree_setup(TREE);
+
+    // load the checksum table, then check the packed sector tree_setup() read
+    if(TREE->flags & B_TREE_CHECKSUM){
+        TREE->crc = malloc((size_t) TREE->crc_sectors * JDISK_SECTOR_SIZE);
+        TREE->crc_dirty = calloc(TREE->crc_sectors,1);
+        iov.iov_base = TREE->crc;
+        iov.iov_len = (size_t) TREE->crc_sectors * JDISK_SECTOR_SIZE;
+        jdisk_readv(TREE->disk,TREE->crc_lba,&iov,1);
+        if(TREE->pack_lba != 0 && crc_check(TREE,TREE->pack_lba,TREE->pack_buf,1) != 0) TREE->nbad++;
+    }
+
+    // load the Bloom filter; a bad one is dropped, and finds search the tree
+    if(TREE->flags & B_TREE_BLOOM){
+        TREE->bloom = malloc((size_t) TREE->bloom_sectors * JDISK_SECTOR_SIZE);
+        TREE->bloom_dirty = calloc(TREE->bloom_sectors,1);
+        iov.iov_base = TREE->bloom;
+        iov.iov_len = (size_t) TREE->bloom_sectors * JDISK_SECTOR_SIZE;
+        jdisk_readv(TREE->disk,TREE->bloom_lba,&iov,1);
+        if(crc_check(TREE,TREE->bloom_lba,TREE->bloom,TREE->bloom_sectors) != 0){
+            TREE->nbad++;
+            free(TREE->bloom);
+            free(TREE->bloom_dirty);
+            TREE->bloom = NULL;
+            TREE->bloom_dirty = NULL;
+        }
+    }
+
+    if(TREE->flags & B_TREE_LOCALITY) map_load(TREE);
+
+    // go ahead and read the root node, then whatever was hot last time
+    TREE->root = t_node_setup(TREE,TREE->root_lba,NULL,-1);
+    TREE->filename = strdup(filename);
+    warm_load(TREE);
+
+    return TREE;
+}
+
+/*  b_tree_detach
+ *  Closes a B_Tree handle.
+ *  Everything is already on disk after b_tree_insert(), or after the
+ *  last checkpoint with write-back on, so this writes the warm start
+ *  manifest if it was asked for, then
+ *  frees the node arena and unattaches the jdisk.
+ *  Returns 0 on success and -1 if the jdisk couldn't be closed.
+ *
+ *  @b_tree is the B_Tree
+ */
+int b_tree_detach(void *b_tree){
+    B_Tree *TREE = b_tree;
+    int rv;
+
+    if(TREE->snap_of != NULL) return b_tree_snapshot_release(TREE);
+    if(TREE->snapshots != NULL) return -1;
+
+    b_tree_set_buffer(TREE,0);
+    b_tree_set_writeback(TREE,0,0);
+    b_tree_set_trace(TREE,NULL);
+    if(TREE->manifest) warm_save(TREE);
+    arena_free(TREE);
+    rv = jdisk_unattach(TREE->disk);
+    free(TREE->free_lbas);
+    free(TREE->retired);
+    free(TREE->pack_buf);
+    free(TREE->bloom);
+    free(TREE->bloom_dirty);
+    free(TREE->crc);
+    free(TREE->crc_dirty);
+    free(TREE->map);
+    free(TREE->map_dirty);
+    b_tree_set_hot_cache(TREE,0);
+    free(TREE->filename);
+    pthread_mutex_destroy(&TREE->snap_lock);
+    free(TREE);
+    return rv;
+}
+
+/*  piece_cmp
+ *  qsort() comparison that puts Flush_Pieces in lba order.
+ */
+int piece_cmp(const void *a, const void *b){
+    unsigned int x = ((const Flush_Piece *) a)->lba;
+    unsigned int y = ((const Flush_Piece *) b)->lba;
+
+    return (x > y) - (x < y);
+}
+
+/*  flush_room
+ *  Returns how many Flush_Pieces flush_pieces() may fill in: one for each
+ *  dirty node, Bloom filter and region map sector, two for the record
+ *  and one for the packed sector, and with checksums, a table sector for
+ *  each sector those write and each one that is already dirty.
+ *
+ *  @TREE is the B_Tree
+ */
+int flush_room(B_Tree *TREE){
+    int n = TREE->ndirty + TREE->bloom_ndirty + TREE->map_ndirty + 3;
+
+    if(TREE->crc != NULL) n += TREE->crc_ndirty + TREE->ndirty + TREE->bloom_ndirty + TREE->map_ndirty + EXT_MAX + 1;
+    return n;
+}
+
+/*  flush_pieces
+ *  Fills in what flush() writes: the dirty nodes, the record being
+ *  inserted, the Bloom filter, packed record and region map sectors that
+ *  changed, and the checksum table sectors that cover them.
+ *  The pieces point at the tree's own buffers.  All but the nodes are
+ *  marked clean.  Returns how many pieces there are.  The table sectors
+ *  come last, in lba order, so they can be written after what they
+ *  cover.
+ *
+ *  @TREE is the B_Tree
+ *  @p has room for flush_room() pieces
+ *  @ndata gets how many pieces come before the table sectors
+ */
+int flush_pieces(B_Tree *TREE, Flush_Piece *p, int *ndata){
+    Tree_Node *t;
+    unsigned int sec;
+    int np, full, i;
+
+    np = 0;
+
+    // move the dirty nodes' data to their bytes segments
+    for(i = 0; i < TREE->ndirty; i++){
+        t = TREE->dirty[i];
+        t->bytes[0] = t->internal;
+        t->bytes[1] = t->nkeys;
+        memcpy((void *) t->bytes + (JDISK_SECTOR_SIZE - TREE->lbas_per_block * 4),t->lbas, TREE->lbas_per_block * 4);
+        if(t->counts != NULL) memcpy(t->bytes + COUNTS_OFF(TREE),t->counts,TREE->lbas_per_block * 4);
+        p[np].lba = t->lba;
+        p[np].n = 1;
+        p[np].data = t->bytes;
+        np++;
+    }
+
+    // the record, with its last sector padded
+    if(TREE->rec_data != NULL){
+        full = TREE->rec_size / JDISK_SECTOR_SIZE;
+        if(full > 0){
+            p[np].lba = TREE->rec_lba;
+            p[np].n = full;
+            p[np].data = TREE->rec_data;
+            np++;
+        }
+        if(TREE->rec_size % JDISK_SECTOR_SIZE != 0){
+            memcpy(TREE->rec_tail,(unsigned char *) TREE->rec_data + full * JDISK_SECTOR_SIZE,TREE->rec_size % JDISK_SECTOR_SIZE);
+            memset(TREE->rec_tail + TREE->rec_size % JDISK_SECTOR_SIZE,0,JDISK_SECTOR_SIZE - TREE->rec_size % JDISK_SECTOR_SIZE);
+            p[np].lba = TREE->rec_lba + full;
+            p[np].n = 1;
+            p[np].data = TREE->rec_tail;
+            np++;
+        }
+        TREE->rec_data = NULL;
+    }
+
+    // the Bloom filter sectors these inserts touched
+    for(sec = 0; TREE->bloom_ndirty > 0; sec++){
+        if(TREE->bloom_dirty[sec]){
+            p[np].lba = TREE->bloom_lba + sec;
+            p[np].n = 1;
+            p[np].data = TREE->bloom + (size_t) sec * JDISK_SECTOR_SIZE;
+            np++;
+            TREE->bloom_dirty[sec] = 0;
+            TREE->bloom_ndirty--;
+        }
+    }
+
+    // the packed record sector
+    if(TREE->pack_dirty){
+        p[np].lba = TREE->pack_lba;
+        p[np].n = 1;
+        p[np].data = TREE->pack_buf;
+        np++;
+        TREE->pack_dirty = 0;
+    }
+
+    // the region map sectors the allocations changed
+    for(sec = 0; TREE->map_ndirty > 0; sec++){
+        if(TREE->map_dirty[sec]){
+            p[np].lba = TREE->map_lba + sec;
+            p[np].n = 1;
+            p[np].data = TREE->map + (size_t) sec * MAP_PER_SECTOR;
+            np++;
+            TREE->map_dirty[sec] = 0;
+            TREE->map_ndirty--;
+        }
+    }
+
+    // their checksums, and the table sectors that changed
+    *ndata = np;
+    if(TREE->crc != NULL){
+        for(i = 0; i < np; i++) crc_set(TREE,p[i].lba,p[i].data,p[i].n);
+        for(sec = 0; TREE->crc_ndirty > 0; sec++){
+            if(TREE->crc_dirty[sec]){
+                p[np].lba = TREE->crc_lba + sec;
+                p[np].n = 1;
+                p[np].data = (unsigned char *) TREE->crc + (size_t) sec * JDISK_SECTOR_SIZE;
+                np++;
+                TREE->crc_dirty[sec] = 0;
+                TREE->crc_ndirty--;
+            }
+        }
+    }
+    return np;
+}
+
+/*  write_pieces
+ *  Writes Flush_Pieces, each run of adjacent sectors in one jdisk_writev().
+ *  Returns 0, or -1 as soon as a write fails.
+ *
+ *  @disk is the jdisk
+ *  @p are the pieces, in lba order
+ *  @np is how many
+ */
+int write_pieces(void *disk, Flush_Piece *p, int np){
+    struct iovec iov[FLUSH_IOV];
+    unsigned int next;
+    int i, j;
+
+    for(i = 0; i < np; i = j){
+        next = p[i].lba;
+        for(j = i; j < np && j - i < FLUSH_IOV && p[j].lba == next; j++){
+            iov[j-i].iov_base = p[j].data;
+            iov[j-i].iov_len = (size_t) p[j].n * JDISK_SECTOR_SIZE;
+            next += p[j].n;
+        }
+        if(jdisk_writev(disk,p[i].lba,iov,j - i) != 0) return -1;
+    }
+    return 0;
+}
+
+/*  flush
+ *  Flushes data to disk.
+ *  Writes the dirty nodes, the record being inserted, and the Bloom filter
+ *  and packed record sectors that changed, in lba order, with each run
+ *  of adjacent sectors going out in one jdisk_writev().  Then the
+ *  checksum table sectors, so a crash never leaves a table entry for
+ *  data that isn't there, and then sector 0, which commits it all.  If
+ *  a write fails, sector 0 is left alone and the tree is marked failed.
+ *  Returns 0, or -1 on failure.
+ *  
+ *  @TREE is the B_Tree
+ */
+int flush(B_Tree *TREE){
+    Flush_Piece *p;
+    int np, nd, rv;
+
+    p = malloc(flush_room(TREE) * sizeof(Flush_Piece));
+    np = flush_pieces(TREE,p,&nd);
+    qsort(p,nd,sizeof(Flush_Piece),piece_cmp);
+    rv = write_pieces(TREE->disk,p,nd);
+    if(rv == 0) rv = write_pieces(TREE->disk,p + nd,np - nd);
+    free(p);
+
+    // write the B_Tree info if needed, once what it points at is there
+    if(rv == 0 && TREE->flush == 1) rv = write_superblock(TREE);
+    if(rv != 0){
+        TREE->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/*  subtree_keys
+ *  Returns how many keys there are in a node's subtree, with B_TREE_COUNTS.
+ *
+ *  @t is the node
+ */
+unsigned long subtree_keys(Tree_Node *t){
+    unsigned long n = t->nkeys;
+    int i;
+
+    if(t->internal == 1){
+        for(i = 0; i <= t->nkeys; i++) n += t->counts[i];
+    }
+    return n;
+}
+
+/*  split
+ *  Splits a node into two.
+ *  Will create a new node when necessary.
+ *  Recurses up the tree and checks to see if 
+ *  any other nodes need to be split.
+ *
+ *  @TREE is the B_Tree
+ *  @t is the node to split
+ */
+void split(B_Tree *TREE,Tree_Node *t){
+    Tree_Node *parent, *sibling, *child;
+    int middle, pindex, i, comp;
+    
+    // base case
+    if(t == NULL) return;
+
+    // don't need to split so go up
+    if(t->nkeys <= TREE->keys_per_block){
+        split(TREE,t->parent);
+        return;
+    }
+
+    // we have no parent so have to create one
+    if(t->parent == NULL){
+        parent = t_node_setup(TREE,alloc_lba(TREE,B_TREE_REGION_INTERNAL,0),NULL,-1);
+        parent->fresh = 1;
+
+        // set all lbas to 0
+        for(int i = 0; i < TREE->keys_per_block; i++) parent->lbas[i] = 0;
+        if(parent->counts != NULL) memset(parent->counts,0,TREE->lbas_per_block * 4);
+
+        // zero out the bytes (random stuff is not fun)
+        explicit_bzero(parent->bytes,JDISK_SECTOR_SIZE+256);
+
+        // set all the relationship stuff up + set the parent up
+        t->parent = parent;
+        TREE->root = parent;
+        parent->nkeys = 0;
+        parent->lbas[0] = t->lba;
+        t->parent_index = 0;
+        parent->internal = 1;
+        TREE->root_lba = parent->lba;
+    }
+
+    // set local parent to t's parent and make sure to flush it to disk later
+    parent = t->parent;
+    mark_dirty(TREE,parent);
+
+    // find the middle of the node, or keep the left full when keys come in order
+    middle = (TREE->keys_per_block/2);
+    if(TREE->append && TREE->appending) middle = TREE->keys_per_block - 1;
+
+    // find where to put the middle key in the parent
+    pindex = 0;
+    for(i = 0; i < parent->nkeys; i++){
+        comp = key_cmp(TREE,KEY(TREE,t,middle),KEY(TREE,parent,i));
+        if(comp < 0 && pindex == 0){
+            pindex = i;
+            break;
+        }else if(comp > 0 && i == parent->nkeys-1 && pindex == 0){
+            pindex = i+1;
+        }
+    }
+    t->parent_index = pindex;
+    
+    // move all the parent's keys over
+    memmove(KEY(TREE,parent,t->parent_index+1),KEY(TREE,parent,t->parent_index),
+            (parent->nkeys - t->parent_index) * TREE->key_size);
+    
+    // put the middle key into parent
+    memcpy(KEY(TREE,parent,t->parent_index),KEY(TREE,t,middle),TREE->key_size);
+
+    // move all of parents lbas, set the middle on, and increment the nkeys
+    for(i = parent->nkeys; i > t->parent_index; i--){
+        parent->lbas[i+1] = parent->lbas[i];
+        if(parent->counts != NULL) parent->counts[i+1] = parent->counts[i];
+    }
+    parent->nkeys++;
+    parent->lbas[t->parent_index] = t->lba;
+
+    // setup the sibling, next to t, and set its values
+    sibling = t_node_setup(TREE,alloc_lba(TREE,t->internal ? B_TREE_REGION_INTERNAL : B_TREE_REGION_LEAF,t->lba),
+                           parent,t->parent_index+1);
+    sibling->fresh = 1;
+    sibling->nkeys = 0;
+    sibling->internal = t->internal;
+    if(sibling->counts != NULL) memset(sibling->counts,0,TREE->lbas_per_block * 4);
+    mark_dirty(TREE,sibling);
+    parent->lbas[t->parent_index+1] = sibling->lba;
+
+    // move all the stuff to the right of middle to the sibling
+    middle++;
+    memcpy(KEY(TREE,sibling,0),KEY(TREE,t,middle),(t->nkeys - middle) * TREE->key_size);
+    for(i = middle; i < t->nkeys; i++){
+        sibling->lbas[i-middle] = t->lbas[i];
+        sibling->nkeys++;
+    }
+    sibling->lbas[sibling->nkeys] = t->lbas[t->nkeys]; 
+    if(t->counts != NULL){
+        for(i = middle; i <= t->nkeys; i++) sibling->counts[i-middle] = t->counts[i];
+    }
+    if(t == TREE->tail) TREE->tail = sibling;
+
+    // children that moved to the sibling have a new parent
+    if(t->internal == 1){
+        for(i = 0; i <= sibling->nkeys; i++){
+            child = node_lookup(TREE,sibling->lbas[i]);
+            if(child != NULL) child->parent = sibling;
+        }
+    }
+
+    // set the number of keys for the node
+    t->nkeys = middle-1;
+
+    // the parent's counts for the two halves
+    if(parent->counts != NULL){
+        parent->counts[t->parent_index] = subtree_keys(t);
+        parent->counts[t->parent_index+1] = subtree_keys(sibling);
+    }
+
+    // recurse up to see if anything else needs to be split
+    split(TREE,parent);
+}
+
+/*  clear_dirty
+ *  Does the work of reset_flush().
+ *  Only nodes on the dirty list can have flush or fresh set.
+ *
+ *  @b is the B_Tree
+ */
+void clear_dirty(B_Tree *b){
+    int i;
+
+    // set all flushes to 0
+    for(i = 0; i < b->ndirty; i++){
+        b->dirty[i]->flush = 0;
+        b->dirty[i]->fresh = 0;
+    }
+    b->ndirty = 0;
+    b->flush = 0;
+}
+
+/*  reset_flush
+ *  Sets all nodes flush field to 0, unless write-back is on: then they
+ *  stay dirty until a checkpoint gathers them.
+ *  
+ *  @b is the B_Tree
+ */
+void reset_flush(B_Tree *b){
+    if(b->wb_max == 0) clear_dirty(b);
+}
+
+/*  key_hash
+ *  Returns a 64-bit FNV-1a hash of a key.
+ *
+ *  @TREE is the B_Tree
+ *  @key is the key
+ */
+unsigned long key_hash(B_Tree *TREE, void *key){
+    unsigned char *k = key;
+    unsigned long h;
+    int i;
+
+    h = 14695981039346656037UL;
+    for(i = 0; i < TREE->key_size; i++){
+        h ^= k[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/*  hot_count
+ *  Counts a lookup of a key in the hot cache's sketch and returns its
+ *  estimated recent frequency.  With bump 0 it only estimates.
+ *
+ *  @H is the Hot_Cache
+ *  @h is the key's hash
+ *  @bump is 1 to count this lookup
+ */
+int hot_count(Hot_Cache *H, unsigned long h, int bump){
+    static const unsigned long seeds[HOT_DEPTH] = {
+        0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL, 0x165667b19e3779f9UL, 0xd6e8feb86659fd93UL
+    };
+    unsigned char *c;
+    int d, min, j;
+
+    min = HOT_MAX_COUNT;
+    for(d = 0; d < HOT_DEPTH; d++){
+        c = H->sketch + ((long) d << H->width_bits) + ((h * seeds[d]) >> (64 - H->width_bits));
+        if(bump && *c < HOT_MAX_COUNT) (*c)++;
+        if(*c < min) min = *c;
+    }
+
+    // age the sketch so old favorites fade out
+    if(bump && ++H->additions >= H->sample){
+        for(j = 0; j < (HOT_DEPTH << H->width_bits); j++) H->sketch[j] >>= 1;
+        H->additions /= 2;
+    }
+    return min;
+}
+
+/*  hot_way
+ *  Returns the way of a key's set that holds it, or -1.
+ *
+ *  @TREE is the B_Tree
+ *  @key is the key
+ *  @set is the key's set
+ */
+int hot_way(B_Tree *TREE, void *key, long set){
+    Hot_Cache *H = TREE->hot;
+    long e;
+    int w;
+
+    for(w = 0; w < HOT_WAYS; w++){
+        e = set * HOT_WAYS + w;
+        if(H->lbas[e] != 0 && key_cmp(TREE,H->keys + e * TREE->key_size,key) == 0) return w;
+    }
+    return -1;
+}
+
+/*  hot_admit
+ *  Offers a key that was just found in the tree to the hot cache.
+ *  It takes an empty way, or the way of the least popular key if it has
+ *  been looked up more often than that key lately.
+ *
+ *  @TREE is the B_Tree
+ *  @key is the key
+ *  @h is its hash
+ *  @lba is its record lba
+ */
+void hot_admit(B_Tree *TREE, void *key, unsigned long h, unsigned int lba){
+    Hot_Cache *H = TREE->hot;
+    long set, e, victim;
+    int w, f, vf;
+
+    set = h & (H->nsets - 1);
+    victim = -1;
+    vf = HOT_MAX_COUNT + 1;
+    for(w = 0; w < HOT_WAYS; w++){
+        e = set * HOT_WAYS + w;
+        if(H->lbas[e] == 0){
+            victim = e;
+            break;
+        }
+        f = hot_count(H,key_hash(TREE,H->keys + e * TREE->key_size),0);
+        if(f < vf){
+            vf = f;
+            victim = e;
+        }
+    }
+
+    if(H->lbas[victim] != 0 && hot_count(H,h,0) <= vf) return;
+    memcpy(H->keys + victim * TREE->key_size,key,TREE->key_size);
+    H->lbas[victim] = lba;
+}
+
+/*  hot_update
+ *  Points a cached key at its new record lba after it was replaced.
+ *
+ *  @TREE is the B_Tree
+ *  @key is the key
+ *  @lba is the new record lba
+ */
+void hot_update(B_Tree *TREE, void *key, unsigned int lba){
+    long set = key_hash(TREE,key) & (TREE->hot->nsets - 1);
+    int w = hot_way(TREE,key,set);
+
+    if(w >= 0) TREE->hot->lbas[set * HOT_WAYS + w] = lba;
+}
+
+/*  bloom_probe
+ *  Checks a key against the Bloom filter, or adds it.
+ *  Returns 0 if the key is surely not in the tree and 1 if it may be.
+ *
+ *  @TREE is the B_Tree
+ *  @key is the key
+ *  @set is 1 to add the key (and mark its filter sector dirty)
+ */
+int bloom_probe(B_Tree *TREE, void *key, int set){
+    unsigned char *block;
+    unsigned long h, nblocks, b;
+    unsigned int h1, h2, bit;
+    int i;
+
+    // pick the block, then mix again for the bit positions
+    h = key_hash(TREE,key);
+    nblocks = (unsigned long) TREE->bloom_sectors * (JDISK_SECTOR_SIZE / BLOOM_BLOCK);
+    b = h % nblocks;
+    block = TREE->bloom + b * BLOOM_BLOCK;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h1 = h >> 32;
+    h2 = (unsigned int) h | 1;
+
+    for(i = 0; i < BLOOM_K; i++){
+        bit = (h1 + i * h2) % (BLOOM_BLOCK * 8);
+        if(set){
+            block[bit / 8] |= 1 << (bit % 8);
+        }else if(!(block[bit / 8] & (1 << (bit % 8)))){
+            return 0;
+        }
+    }
+
+    if(set && !TREE->bloom_dirty[b * BLOOM_BLOCK / JDISK_SECTOR_SIZE]){
+        TREE->bloom_dirty[b * BLOOM_BLOCK / JDISK_SECTOR_SIZE] = 1;
+        TREE->bloom_ndirty++;
+    }
+    return 1;
+}
+
+/*  write_extent
+ *  Writes size bytes to the sectors starting at lba in one jdisk_writev(),
+ *  padding the last sector with zeros.
+ *  Returns 0, or what jdisk_writev() returned on failure.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the first sector
+ *  @record is the data
+ *  @size is its length in bytes
+ */
+int write_extent(B_Tree *TREE, unsigned int lba, void *record, int size){
+    unsigned char tail[JDISK_SECTOR_SIZE];
+    struct iovec iov[2];
+    int full, n;
+
+    full = size - size % JDISK_SECTOR_SIZE;
+    n = 0;
+    if(full > 0){
+        iov[n].iov_base = record;
+        iov[n].iov_len = full;
+        n++;
+    }
+    if(full < size){
+        memcpy(tail,(unsigned char *) record + full,size - full);
+        memset(tail + size - full,0,JDISK_SECTOR_SIZE - (size - full));
+        iov[n].iov_base = tail;
+        iov[n].iov_len = JDISK_SECTOR_SIZE;
+        n++;
+    }
+    crc_set(TREE,lba,record,full / JDISK_SECTOR_SIZE);
+    if(full < size) crc_set(TREE,lba + full / JDISK_SECTOR_SIZE,tail,1);
+    return jdisk_writev(TREE->disk,lba,iov,n);
+}
+
+/*  now_ns
+ *  Returns the monotonic clock in ns.
+ */
+unsigned long now_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*  wb_enter
+ *  Takes the write-back lock, if write-back is on.  The flusher thread
+ *  shares the tree's buffers, so every call holds it.
+ *
+ *  @TREE is the B_Tree
+ */
+void wb_enter(B_Tree *TREE){
+    if(TREE->wb_max > 0) pthread_mutex_lock(&TREE->wb_lock);
+}
+
+/*  wb_leave
+ *  Lets go of what wb_enter() took.
+ *
+ *  @TREE is the B_Tree
+ */
+void wb_leave(B_Tree *TREE){
+    if(TREE->wb_max > 0) pthread_mutex_unlock(&TREE->wb_lock);
+}
+
+/*  wb_dirty
+ *  Returns how many sectors are waiting for the next checkpoint.
+ *
+ *  @TREE is the B_Tree
+ */
+long wb_dirty(B_Tree *TREE){
+    return TREE->ndirty + TREE->bloom_ndirty + TREE->map_ndirty + TREE->crc_ndirty + TREE->pack_dirty + TREE->wb_sectors;
+}
+
+/*  wb_put
+ *  Keeps a copy of a record write for the next checkpoint.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the first sector
+ *  @record is the data
+ *  @size is its length in bytes
+ *  @replace is 1 if an earlier write to lba may be waiting, which this one replaces
+ */
+void wb_put(B_Tree *TREE, unsigned int lba, void *record, int size, int replace){
+    Flush_Piece *p;
+    int n, i;
+
+    n = (size + JDISK_SECTOR_SIZE - 1) / JDISK_SECTOR_SIZE;
+    p = NULL;
+    if(replace){
+        for(i = 0; i < TREE->wb_nrecs; i++){
+            if(TREE->wb_recs[i].lba == lba && TREE->wb_recs[i].n == n) p = &TREE->wb_recs[i];
+        }
+    }
+    if(p == NULL){
+        if(TREE->wb_nrecs == TREE->wb_recs_cap){
+            TREE->wb_recs_cap = (TREE->wb_recs_cap == 0) ? 64 : TREE->wb_recs_cap * 2;
+            TREE->wb_recs = realloc(TREE->wb_recs,TREE->wb_recs_cap * sizeof(Flush_Piece));
+        }
+        p = &TREE->wb_recs[TREE->wb_nrecs++];
+        p->lba = lba;
+        p->n = n;
+        p->data = aligned_alloc(JDISK_ALIGN,(size_t) n * JDISK_SECTOR_SIZE);
+        TREE->wb_sectors += n;
+    }
+    memcpy(p->data,record,size);
+    memset((unsigned char *) p->data + size,0,(size_t) n * JDISK_SECTOR_SIZE - size);
+    crc_set(TREE,lba,p->data,n);
+}
+
+/*  wb_lookup
+ *  Returns the data of a record write to lba that hasn't landed yet,
+ *  the newest one if there are two, or NULL if the disk has it.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the first sector of the write
+ */
+void *wb_lookup(B_Tree *TREE, unsigned int lba){
+    Wb_Batch *b = TREE->wb_batch;
+    int i;
+
+    for(i = TREE->wb_nrecs - 1; i >= 0; i--){
+        if(TREE->wb_recs[i].lba == lba) return TREE->wb_recs[i].data;
+    }
+    if(b == NULL) return NULL;
+    for(i = 0; i < b->np; i++){
+        if(b->p[i].lba == lba) return b->p[i].data;
+    }
+    return NULL;
+}
+
+/*  wb_gather
+ *  Starts a checkpoint.  Copies everything dirty, and the superblock that
+ *  commits it, into a Wb_Batch for the flusher, and marks it all clean.
+ *  Sectors retired so far are reused once the batch lands.
+ *  Call it holding wb_lock, with no batch in flight.
+ *
+ *  @TREE is the B_Tree
+ */
+void wb_gather(B_Tree *TREE){
+    Wb_Batch *b;
+    void *data;
+    size_t len;
+    int i;
+
+    b = malloc(sizeof(Wb_Batch));
+    b->p = malloc((flush_room(TREE) + TREE->wb_nrecs) * sizeof(Flush_Piece));
+    b->np = flush_pieces(TREE,b->p,&b->ndata);
+
+    // those point into the cache, which changes while the flusher writes
+    for(i = 0; i < b->np; i++){
+        len = (size_t) b->p[i].n * JDISK_SECTOR_SIZE;
+        data = aligned_alloc(JDISK_ALIGN,len);
+        memcpy(data,b->p[i].data,len);
+        b->p[i].data = data;
+    }
+
+    // the waiting records go with the data, ahead of the table sectors
+    if(TREE->wb_nrecs > 0){
+        memmove(b->p + b->ndata + TREE->wb_nrecs,b->p + b->ndata,(b->np - b->ndata) * sizeof(Flush_Piece));
+        memcpy(b->p + b->ndata,TREE->wb_recs,TREE->wb_nrecs * sizeof(Flush_Piece));
+    }
+    b->np += TREE->wb_nrecs;
+    b->ndata += TREE->wb_nrecs;
+    qsort(b->p,b->ndata,sizeof(Flush_Piece),piece_cmp);
+    superblock_bytes(TREE,b->super);
+
+    clear_dirty(TREE);
+    TREE->wb_nrecs = 0;
+    TREE->wb_sectors = 0;
+    TREE->gen++;
+    TREE->wb_batch = b;
+    TREE->wb_gathered++;
+    TREE->wb_last = now_ns();
+    pthread_cond_signal(&TREE->wb_cond);
+}
+
+/*  wb_flusher
+ *  The write-back thread.  Writes each batch wb_gather() hands it, data
+ *  first, then checksum table sectors, then the superblock, without
+ *  holding wb_lock, and gathers one itself when something has been
+ *  dirty for wb_interval.  When told to quit, it writes whatever is
+ *  left first.
+ *
+ *  @arg is the B_Tree
+ */
+void *wb_flusher(void *arg){
+    B_Tree *TREE = arg;
+    Wb_Batch *b;
+    struct timespec ts;
+    unsigned long due;
+    int i, rv;
+
+    pthread_mutex_lock(&TREE->wb_lock);
+    while(1){
+        due = TREE->wb_last + TREE->wb_interval;
+        if(TREE->wb_batch == NULL && !TREE->failed && (wb_dirty(TREE) > 0 || TREE->flush)){
+            if(TREE->wb_quit || (TREE->wb_interval != 0 && now_ns() >= due)) wb_gather(TREE);
+        }
+
+        if(TREE->wb_batch != NULL){
+            b = TREE->wb_batch;
+            pthread_mutex_unlock(&TREE->wb_lock);
+            rv = write_pieces(TREE->disk,b->p,b->ndata);
+            if(rv == 0) rv = write_pieces(TREE->disk,b->p + b->ndata,b->np - b->ndata);
+            if(rv == 0) rv = jdisk_write(TREE->disk,0,b->super);
+            pthread_mutex_lock(&TREE->wb_lock);
+
+            // without the superblock the last checkpoint stays, and
+            // nothing more can go on top of it
+            if(rv != 0) TREE->failed = 1;
+
+            // lookups may be reading the batch until it's taken away
+            TREE->wb_batch = NULL;
+            for(i = 0; i < b->np; i++) free(b->p[i].data);
+            free(b->p);
+            free(b);
+            TREE->wb_done++;
+            if(TREE->nretired > 0) reclaim_lbas(TREE);
+            pthread_cond_broadcast(&TREE->wb_room);
+            continue;
+        }
+        if(TREE->wb_quit) break;
+
+        // sleep until the dirty data is due, or check back in an interval
+        if(TREE->wb_interval == 0){
+            pthread_cond_wait(&TREE->wb_cond,&TREE->wb_lock);
+        }else{
+            if(due <= now_ns()) due = now_ns() + TREE->wb_interval;
+            ts.tv_sec = due / 1000000000UL;
+            ts.tv_nsec = due % 1000000000UL;
+            pthread_cond_timedwait(&TREE->wb_cond,&TREE->wb_lock,&ts);
+        }
+    }
+    pthread_mutex_unlock(&TREE->wb_lock);
+    return NULL;
+}
+
+/*  wb_commit
+ *  commit() with write-back on: the changes stay in memory.  Once half
+ *  the dirty budget is used, a checkpoint starts.  The insert only waits
+ *  when all of it is used and the last checkpoint is still being written.
+ *
+ *  @TREE is the B_Tree (holding wb_lock)
+ */
+void wb_commit(B_Tree *TREE){
+    if(wb_dirty(TREE) >= TREE->wb_max){
+        while(TREE->wb_batch != NULL) pthread_cond_wait(&TREE->wb_room,&TREE->wb_lock);
+    }
+    if(TREE->wb_batch == NULL && wb_dirty(TREE) >= (TREE->wb_max + 1) / 2) wb_gather(TREE);
+}
+
+/*  put_record
+ *  Writes a record to the sectors starting at lba.  Unless inserts are
+ *  buffered, it waits for flush(), which writes it with the nodes.
+ *  With write-back on, a copy waits for the next checkpoint.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the first sector
+ *  @record is the data (it must stay put until flush())
+ *  @size is its length in bytes
+ */
+void put_record(B_Tree *TREE, unsigned int lba, void *record, int size){
+    if(TREE->wb_max > 0){
+        wb_put(TREE,lba,record,size,0);
+        return;
+    }
+    if(TREE->msg_cap > 0){
+        if(write_extent(TREE,lba,record,size) != 0) TREE->failed = 1;
+        return;
+    }
+    TREE->rec_data = record;
+    TREE->rec_lba = lba;
+    TREE->rec_size = size;
+}
+
+/*  record_sectors
+ *  Returns how many sectors the record at a tree address takes up.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the record's address
+ */
+int record_sectors(B_Tree *TREE, unsigned int lba){
+    if(TREE->flags & B_TREE_EXTENTS) return (lba & (EXT_MAX - 1)) + 1;
+    return 1;
+}
+
+/*  retire_record
+ *  Retires the sectors of a record the tree stopped using.  Packed
+ *  records share their sector, so they are left alone.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the record's address
+ */
+void retire_record(B_Tree *TREE, unsigned int lba){
+    int i, n;
+
+    if(TREE->flags & B_TREE_COMPRESS) return;
+    n = record_sectors(TREE,lba);
+    if(TREE->flags & B_TREE_EXTENTS) lba >>= EXT_BITS;
+    for(i = 0; i < n; i++) retire_lba(TREE,lba + i);
+}
+
+/*  write_record
+ *  Writes a record and returns the lba to store in the tree.
+ *  With B_TREE_COMPRESS the record is compressed and appended to the
+ *  current packed sector, and the return value is a packed address.
+ *  With copy-on-write, a packed sector that has been committed is never
+ *  added to again, so each commit starts a new one.
+ *  With B_TREE_EXTENTS it goes in a run of new sectors, and the return
+ *  value carries its length.
+ *
+ *  @TREE is the B_Tree
+ *  @record is the data
+ *  @size is its length: JDISK_SECTOR_SIZE, or up to B_TREE_MAX_RECORD
+ *   bytes with B_TREE_EXTENTS
+ *  @near is the leaf its key goes in, to put it near (0 = not known)
+ */
+unsigned int write_record(B_Tree *TREE, void *record, int size, unsigned int near){
+    unsigned char buf[JDISK_SECTOR_SIZE];
+    unsigned int lba;
+    int n, slot;
+
+    if(TREE->flags & B_TREE_EXTENTS){
+        n = (size + JDISK_SECTOR_SIZE - 1) / JDISK_SECTOR_SIZE;
+        if(n == 1){
+            lba = alloc_lba(TREE,B_TREE_REGION_RECORD,near);
+        }else{
+            // a run has to come off the end, the free list is single sectors
+            lba = TREE->first_free_block;
+            if(lba + n > TREE->num_lbas) TREE->failed = 1;
+            TREE->first_free_block += n;
+            TREE->flush = 1;
+        }
+        put_record(TREE,lba,record,size);
+        return (lba << EXT_BITS) | (n - 1);
+    }
+
+    if(!(TREE->flags & B_TREE_COMPRESS)){
+        lba = alloc_lba(TREE,B_TREE_REGION_RECORD,near);
+        put_record(TREE,lba,record,size);
+        return lba;
+    }
+
+    // doesn't compress enough to share a sector
+    n = lz_compress(record,JDISK_SECTOR_SIZE,buf,JDISK_SECTOR_SIZE - PACK_HDR);
+    if(n == 0){
+        lba = alloc_lba(TREE,B_TREE_REGION_RECORD,near);
+        put_record(TREE,lba,record,JDISK_SECTOR_SIZE);
+        return (lba << 4) | PACK_RAW;
+    }
+
+    // start a new packed sector if this one is full, or if copy-on-write
+    // is on and it's already on disk, since its records can't move
+    slot = TREE->pack_buf[0] | (TREE->pack_buf[1] << 8);
+    if(TREE->pack_lba == 0 || slot == PACK_SLOTS || TREE->pack_used + n > JDISK_SECTOR_SIZE
+       || (TREE->cow && !TREE->pack_dirty)){
+        if(TREE->pack_dirty && TREE->wb_max > 0){
+            wb_put(TREE,TREE->pack_lba,TREE->pack_buf,JDISK_SECTOR_SIZE,1);
+        }else if(TREE->pack_dirty){
+            crc_set(TREE,TREE->pack_lba,TREE->pack_buf,1);
+            if(jdisk_write(TREE->disk,TREE->pack_lba,TREE->pack_buf) != 0) TREE->failed = 1;
+        }
+        TREE->pack_dirty = 0;
+        TREE->pack_lba = alloc_lba(TREE,B_TREE_REGION_RECORD,near);
+        memset(TREE->pack_buf,0,JDISK_SECTOR_SIZE);
+        TREE->pack_used = PACK_HDR;
+        slot = 0;
+    }
+
+    // add it to the slot table; flush() writes the sector back, so
+    // buffered inserts share one write of it
+    TREE->pack_buf[2 + 4*slot] = TREE->pack_used & 0xff;
+    TREE->pack_buf[3 + 4*slot] = TREE->pack_used >> 8;
+    TREE->pack_buf[4 + 4*slot] = n & 0xff;
+    TREE->pack_buf[5 + 4*slot] = n >> 8;
+    memcpy(TREE->pack_buf + TREE->pack_used,buf,n);
+    TREE->pack_used += n;
+    TREE->pack_buf[0] = slot + 1;
+    TREE->pack_buf[1] = 0;
+    TREE->pack_dirty = 1;
+
+    // sector 0 remembers pack_lba
+    TREE->flush = 1;
+    return (TREE->pack_lba << 4) | slot;
+}
+
+/*  grow
+ *  Makes the jdisk grow_extent bytes bigger, in place.
+ *  Returns 0 on success and -1 on failure.
+ *
+ *  @TREE is the B_Tree
+ */
+int grow(B_Tree *TREE){
+    if((TREE->flags & B_TREE_COMPRESS) && (TREE->size + TREE->grow_extent) / JDISK_SECTOR_SIZE > PACK_MAX_LBAS){
+        return -1;
+    }
+    if((TREE->flags & B_TREE_EXTENTS) && (TREE->size + TREE->grow_extent) / JDISK_SECTOR_SIZE > EXT_MAX_LBAS){
+        return -1;
+    }
+    if((TREE->flags & B_TREE_CHECKSUM) && (TREE->size + TREE->grow_extent) / JDISK_SECTOR_SIZE > (unsigned long) TREE->crc_sectors * CRC_PER_SECTOR){
+        return -1;
+    }
+    if((TREE->flags & B_TREE_LOCALITY)
+       && (TREE->size + TREE->grow_extent) / JDISK_SECTOR_SIZE > (unsigned long) TREE->map_sectors * MAP_PER_SECTOR * B_TREE_REGION_SECTORS){
+        return -1;
+    }
+    if(jdisk_grow(TREE->disk,TREE->size + TREE->grow_extent) != 0) return -1;
+    TREE->size = jdisk_size(TREE->disk);
+    if(TREE->map != NULL) TREE->map_left += TREE->size/JDISK_SECTOR_SIZE - TREE->num_lbas;
+    TREE->num_lbas = TREE->size/JDISK_SECTOR_SIZE;
+    return 0;
+}
+
+/*  relocate
+ *  Moves a committed node that is about to change to a new sector
+ *  (copy-on-write).  Its parent then points somewhere new, so the
+ *  parent moves as well, all the way up to the root.
+ *
+ *  @TREE is the B_Tree
+ *  @t is the node
+ */
+void relocate(B_Tree *TREE, Tree_Node *t){
+    Tree_Node *p;
+    unsigned int old;
+    int i;
+
+    // already written nowhere but this commit
+    if(t->fresh == 1) return;
+
+    old = t->lba;
+    node_hash_remove(TREE,t);
+    t->lba = alloc_lba(TREE,t->internal ? B_TREE_REGION_INTERNAL : B_TREE_REGION_LEAF,old);
+    node_hash_add(TREE,t);
+    t->fresh = 1;
+    mark_dirty(TREE,t);
+    retire_lba(TREE,old);
+
+    p = t->parent;
+    if(p == NULL){
+        TREE->root_lba = t->lba;
+        return;
+    }
+
+    // point the parent at the copy
+    for(i = 0; i <= p->nkeys; i++){
+        if(p->lbas[i] == old){
+            p->lbas[i] = t->lba;
+            break;
+        }
+    }
+    mark_dirty(TREE,p);
+    relocate(TREE,p);
+}
+
+/*  commit
+ *  Writes out everything b_tree_insert() changed.
+ *  With copy-on-write, changed nodes move to new sectors first, and
+ *  the superblock write at the end of flush() switches to the new root.
+ *  Nothing is written once the tree has failed.
+ *
+ *  @TREE is the B_Tree
+ */
+void commit(B_Tree *TREE){
+    int i;
+
+    // relocate() puts parents on the dirty list as it goes
+    if(TREE->cow){
+        for(i = 0; i < TREE->ndirty; i++) relocate(TREE,TREE->dirty[i]);
+        TREE->flush = 1;
+    }
+
+    // a sector past the end went into it, so the old root stays
+    if(TREE->failed) return;
+
+    // with write-back it waits for a checkpoint
+    if(TREE->wb_max > 0){
+        wb_commit(TREE);
+        return;
+    }
+
+    flush(TREE);
+
+    // buffered inserts retire records too, copy-on-write or not
+    TREE->gen++;
+    if(TREE->nretired > 0) reclaim_lbas(TREE);
+}
+
+/*  tail_leaf
+ *  Returns the rightmost leaf.  It holds the largest key in the tree.
+ *  It is found once, then split() keeps it current.
+ *
+ *  @TREE is the B_Tree
+ */
+Tree_Node *tail_leaf(B_Tree *TREE){
+    Tree_Node *t;
+
+    if(TREE->tail != NULL) return TREE->tail;
+    t = TREE->root;
+    while(t->internal) t = t_node_setup(TREE,t->lbas[t->nkeys],t,t->nkeys);
+    TREE->tail = t;
+    return t;
+}
+
+/*  locate
+ *  Looks for a key the way b_tree_insert() needs to.
+ *  Returns its record lba, setting hit and hit_index, or 0, setting
+ *  tmp_e and tmp_e_index to where it goes.
+ *  A key past the end of the tail goes on the end without a descent.
+ *
+ *  @TREE is the B_Tree
+ *  @key is the key
+ */
+unsigned int locate(B_Tree *TREE, void *key){
+    Tree_Node *t;
+
+    t = tail_leaf(TREE);
+    TREE->appending = (t->nkeys > 0 && key_cmp(TREE,key,KEY(TREE,t,t->nkeys-1)) > 0);
+    if(TREE->appending){
+        TREE->tmp_e = t;
+        TREE->tmp_e_index = t->nkeys;
+        return 0;
+    }
+
+    // find where the thing should go
+    return recursive_find(TREE,TREE->root,key);
+}
+
+/*  add_key
+ *  Puts a new key and its record lba where locate() said it goes,
+ *  splitting whatever overflows.  Nothing is written until commit().
+ *
+ *  @TREE is the B_Tree
+ *  @key is the key
+ *  @lba is its record's lba
+ */
+void add_key(B_Tree *TREE, void *key, unsigned int lba){
+    Tree_Node *t, *c, *p;
+    int i, index;
+
+    // get where it should go
+    t = TREE->tmp_e;
+    index = TREE->tmp_e_index;
+
+    if(t == NULL){
+        t = TREE->root;
+        index = 0;
+    }
+
+    // move all the keys over and set the correct one
+    memmove(KEY(TREE,t,index+1),KEY(TREE,t,index),(t->nkeys - index) * TREE->key_size);
+    memcpy(KEY(TREE,t,index),key,TREE->key_size);
+    t->nkeys += 1;
+    mark_dirty(TREE,t);
+
+    TREE->flush = 1;
+    if(TREE->bloom != NULL) bloom_probe(TREE,key,1);
+
+    // set all the lbas
+    for(i = t->nkeys; i > index; i--) t->lbas[i] = t->lbas[i-1];
+    t->lbas[index] = lba;
+
+    // every subtree on the way down has one more key
+    if(t->counts != NULL){
+        for(c = t; c->parent != NULL; c = c->parent){
+            p = c->parent;
+            for(i = 0; p->lbas[i] != c->lba; i++) ;
+            p->counts[i]++;
+            mark_dirty(TREE,p);
+        }
+    }
+    
+    // split if necessary
+    if(t->nkeys > TREE->keys_per_block){
+        split(TREE,t);
+    }
+}
+
+/*  msg_reserve
+ *  Returns how many sectors applying the buffered inserts could take:
+ *  a new node for every half node's worth of keys, plus a split all the
+ *  way up, and with copy-on-write, a copy of each node on every
+ *  insert's path.
+ *
+ *  @TREE is the B_Tree
+ *  @height is how many levels of nodes the tree has
+ */
+unsigned long msg_reserve(B_Tree *TREE, int height){
+    unsigned long n;
+
+    if(TREE->msg_cap == 0) return 0;
+    n = TREE->nmsgs / (TREE->keys_per_block / 2) + 8;
+    if(TREE->cow) n += (unsigned long) TREE->nmsgs * height;
+    return n;
+}
+
+/*  insert_reserve
+ *  Returns how many sectors an insert could take, so that it is refused
+ *  before it changes anything: its record, a new node at every level a
+ *  split goes up through and a new root, and with copy-on-write a copy
+ *  of every node on its path.  With a buffer, the buffered inserts, this
+ *  one among them, need msg_reserve() for when they are applied.
+ *
+ *  @TREE is the B_Tree
+ *  @sectors is the record's length in sectors
+ */
+unsigned long insert_reserve(B_Tree *TREE, int sectors){
+    Tree_Node *t;
+    int height;
+    unsigned long n;
+
+    height = 0;
+    for(t = tail_leaf(TREE); t != NULL; t = t->parent) height++;
+
+    n = sectors + height + 1;
+    if(TREE->cow) n += height;
+    if(TREE->msg_cap > 0){
+        TREE->nmsgs++;
+        n += msg_reserve(TREE,height);
+        TREE->nmsgs--;
+    }
+    return n;
+}
+
+/*  msg_search
+ *  Returns the index of a key in the buffer, or where it would go.
+ *
+ *  @TREE is the B_Tree
+ *  @key is the key
+ *  @found is set to whether it is there
+ */
+int msg_search(B_Tree *TREE, void *key, int *found){
+    int lo, hi, mid, comp;
+
+    lo = 0;
+    hi = TREE->nmsgs;
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        comp = key_cmp(TREE,key,TREE->msg_keys + (size_t) mid * TREE->key_size);
+        if(comp == 0){
+            *found = 1;
+            return mid;
+        }
+        if(comp < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    *found = 0;
+    return lo;
+}
+
+/*  msg_put
+ *  Buffers an insert.  A later insert of the same key replaces the
+ *  earlier one, whose record no version of the tree ever used.
+ *
+ *  @TREE is the B_Tree
+ *  @key is the key
+ *  @lba is its record's lba
+ */
+void msg_put(B_Tree *TREE, void *key, unsigned int lba){
+    unsigned char *k;
+    int i, found;
+
+    i = msg_search(TREE,key,&found);
+    if(found){
+        retire_record(TREE,TREE->msg_lbas[i]);
+        TREE->msg_lbas[i] = lba;
+        return;
+    }
+
+    k = TREE->msg_keys + (size_t) i * TREE->key_size;
+    memmove(k + TREE->key_size,k,(size_t) (TREE->nmsgs - i) * TREE->key_size);
+    memmove(TREE->msg_lbas + i + 1,TREE->msg_lbas + i,(TREE->nmsgs - i) * sizeof(unsigned int));
+    memcpy(k,key,TREE->key_size);
+    TREE->msg_lbas[i] = lba;
+    TREE->nmsgs++;
+}
+
+/*  msg_leaf
+ *  Returns the lba of the leaf a key belongs in, going through
+ *  internal nodes only, so no leaf is read.
+ *
+ *  @TREE is the B_Tree
+ *  @key is the key
+ *  @height is how many levels of internal nodes there are
+ */
+unsigned int msg_leaf(B_Tree *TREE, void *key, int height){
+    Tree_Node *t = TREE->root;
+    int i, level, comp;
+
+    if(height == 0) return t->lba;
+    for(level = 1; ; level++){
+        i = node_search(TREE,t,key,&comp);
+        if(level == height) return t->lbas[i];
+        t = t_node_setup(TREE,t->lbas[i],t,i);
+    }
+}
+
+/*  apply_msg
+ *  Puts one buffered insert into the tree.  A key the tree already has
+ *  gets the new record, and the old one is retired.
+ *
+ *  @TREE is the B_Tree
+ *  @key is the key
+ *  @lba is its record's lba
+ */
+void apply_msg(B_Tree *TREE, void *key, unsigned int lba){
+    unsigned int old;
+
+    old = locate(TREE,key);
+    if(TREE->nbad > 0) return;
+    if(old == 0){
+        add_key(TREE,key,lba);
+        return;
+    }
+
+    retire_record(TREE,old);
+    TREE->hit->lbas[TREE->hit_index] = lba;
+    mark_dirty(TREE,TREE->hit);
+    if(TREE->hot != NULL) hot_update(TREE,key,lba);
+}
+
+typedef struct {
+  int start;                    /* First buffered insert bound for one leaf */
+  int n;                        /* and how many there are */
+} Msg_Run;
+
+/*  msg_run_cmp
+ *  qsort() comparison that puts the biggest Msg_Runs first.
+ */
+int msg_run_cmp(const void *a, const void *b){
+    return ((const Msg_Run *) b)->n - ((const Msg_Run *) a)->n;
+}
+
+/*  msg_flush
+ *  Moves buffered inserts into the tree and commits them together.
+ *  The buffer is sorted, so the inserts bound for each leaf sit next to
+ *  each other.  Unless all is set, only the leaves with the most
+ *  waiting are done, until half the buffer is empty, so each leaf
+ *  write carries as many keys as it can.
+ *
+ *  @TREE is the B_Tree
+ *  @all is 1 to empty the buffer
+ */
+void msg_flush(B_Tree *TREE, int all){
+    unsigned char *sel, *k;
+    unsigned int leaf, prev;
+    Msg_Run *runs;
+    Tree_Node *t;
+    int height, nruns, drained, i, j;
+
+    if(TREE->nmsgs == 0) return;
+    reset_flush(TREE);
+
+    // pick what to apply
+    sel = malloc(TREE->nmsgs);
+    memset(sel,all,TREE->nmsgs);
+    if(!all){
+        for(height = 0, t = TREE->root; t->internal; height++){
+            t = t_node_setup(TREE,t->lbas[t->nkeys],t,t->nkeys);
+        }
+
+        runs = malloc(TREE->nmsgs * sizeof(Msg_Run));
+        nruns = 0;
+        prev = 0;
+        for(i = 0; i < TREE->nmsgs; i++){
+            leaf = msg_leaf(TREE,TREE->msg_keys + (size_t) i * TREE->key_size,height);
+            if(nruns == 0 || leaf != prev){
+                runs[nruns].start = i;
+                runs[nruns].n = 0;
+                nruns++;
+                prev = leaf;
+            }
+            runs[nruns-1].n++;
+        }
+
+        qsort(runs,nruns,sizeof(Msg_Run),msg_run_cmp);
+        for(drained = 0, i = 0; i < nruns && drained < TREE->nmsgs / 2; i++){
+            memset(sel + runs[i].start,1,runs[i].n);
+            drained += runs[i].n;
+        }
+        free(runs);
+    }
+
+    // apply them in key order and keep the rest
+    j = 0;
+    for(i = 0; i < TREE->nmsgs; i++){
+        k = TREE->msg_keys + (size_t) i * TREE->key_size;
+        if(sel[i]){
+            apply_msg(TREE,k,TREE->msg_lbas[i]);
+        }else{
+            if(j != i){
+                memcpy(TREE->msg_keys + (size_t) j * TREE->key_size,k,TREE->key_size);
+                TREE->msg_lbas[j] = TREE->msg_lbas[i];
+            }
+            j++;
+        }
+    }
+    TREE->nmsgs = j;
+    free(sel);
+
+    commit(TREE);
+}
+
+/*  trace_op
+ *  Logs one call to the trace file, counting it in trace_errors if the
+ *  write fails.
+ *
+ *  @TREE is the B_Tree
+ *  @op is 'F' or 'I'
+ *  @start is when the call started (now_ns())
+ *  @key is its key
+ *  @result is the lba it returned
+ *  @size is the record size for an insert
+ */
+void trace_op(B_Tree *TREE, int op, unsigned long start, void *key, unsigned int result, int size){
+    B_Tree_Trace_Op r;
+    unsigned long took;
+
+    took = now_ns() - start;
+    memset(&r,0,sizeof(r));
+    r.op = op;
+    r.result = result;
+    r.size = size;
+    r.latency = (took > 0xffffffffUL) ? 0xffffffffU : took;
+    r.time = start - TREE->trace_start;
+    if(fwrite(&r,sizeof(r),1,TREE->trace) != 1 || fwrite(key,1,TREE->key_size,TREE->trace) != (size_t) TREE->key_size){
+        TREE->trace_errors++;
+    }
+}
+
+unsigned int tree_insert(B_Tree *TREE, void *key, void *record, int size);
+unsigned int tree_find(B_Tree *b, void *key);
+
+/*  b_tree_insert
+ *  Inserts a key and record into a B_Tree.
+ *  With a buffer (b_tree_set_buffer()), only the record is written and
+ *  the key waits in the buffer.
+ *
+ *  @b_tree is the B_Tree
+ *  @key is the insertion key
+ *  @record is the data to insert (JDISK_SECTOR_SIZE bytes)
+ */
+unsigned int b_tree_insert(void *b_tree, void *key, void *record){
+    return b_tree_insert_size(b_tree,key,record,JDISK_SECTOR_SIZE);
+}
+
+/*  b_tree_insert_size
+ *  Inserts a key and a record of size bytes.  Records shorter than a
+ *  sector are padded with zeros.  Longer ones, up to B_TREE_MAX_RECORD,
+ *  need B_TREE_EXTENTS; they take a run of sectors that is written in
+ *  one I/O, and the returned lba carries the length.
+ *  Returns the record's lba, or 0 on failure.  An insert is refused
+ *  unless there is room for the most it could take.  If one is dropped
+ *  anyway, or a write fails, the tree on disk stays as it was at the
+ *  last commit (sector 0 is only written once the rest has landed), and
+ *  the handle refuses inserts from then on; attach again to go on.
+ *
+ *  @b_tree is the B_Tree
+ *  @key is the insertion key
+ *  @record is the data to insert
+ *  @size is its length in bytes
+ */
+unsigned int b_tree_insert_size(void *b_tree, void *key, void *record, int size){
+    B_Tree *TREE = b_tree;
+    unsigned long start;
+    unsigned int lba;
+
+    wb_enter(TREE);
+    if(TREE->trace == NULL){
+        lba = tree_insert(TREE,key,record,size);
+    }else{
+        start = now_ns();
+        lba = tree_insert(TREE,key,record,size);
+        trace_op(TREE,'I',start,key,lba,size);
+    }
+    wb_leave(TREE);
+    return lba;
+}
+
+/*  tree_insert
+ *  Does the work of b_tree_insert_size().
+ *
+ *  @TREE is the B_Tree
+ *  @key is the insertion key
+ *  @record is the data to insert
+ *  @size is its length in bytes
+ */
+unsigned int tree_insert(B_Tree *TREE, void *key, void *record, int size){
+    // insert to the tree
+    unsigned char pad[JDISK_SECTOR_SIZE];
+    unsigned int lba;
+    unsigned long need;
+    int sectors, rv;
+    
+    // snapshots are read only, custom keys need their order, and a tree
+    // with a bad sector could lose what hangs off it, or that failed may
+    // have retired sectors the committed tree still uses
+    if(TREE->snap_of != NULL || TREE->nbad > 0 || TREE->failed) return 0;
+    if((TREE->flags & B_TREE_KEY_TYPE) == B_TREE_KEY_CUSTOM && TREE->compare == NULL) return 0;
+
+    if(size <= 0 || size > ((TREE->flags & B_TREE_EXTENTS) ? B_TREE_MAX_RECORD : JDISK_SECTOR_SIZE)) return 0;
+    if(size < JDISK_SECTOR_SIZE && !(TREE->flags & B_TREE_EXTENTS)){
+        memcpy(pad,record,size);
+        memset(pad + size,0,JDISK_SECTOR_SIZE - size);
+        record = pad;
+        size = JDISK_SECTOR_SIZE;
+    }
+    sectors = (size + JDISK_SECTOR_SIZE - 1) / JDISK_SECTOR_SIZE;
+
+    // not enough room for the worst case (a multi-sector record needs a
+    // run off the end); once growth is refused, the last GROW_SLACK
+    // sectors are kept back rather than filled
+    need = insert_reserve(TREE,sectors);
+    while(TREE->grow_extent != 0 && sectors_left(TREE) < GROW_SLACK + need){
+        if(grow(TREE) == 0) continue;
+        if(sectors_left(TREE) + TREE->nfree < GROW_SLACK + need) return 0;
+        break;
+    }
+    if(sectors > 1 && sectors_left(TREE) < need) return 0;
+    if(sectors_left(TREE) + TREE->nfree < need) return 0;
+
+    if(TREE->msg_cap > 0){
+        lba = write_record(TREE,record,size,0);
+        msg_put(TREE,key,lba);
+        if(TREE->nmsgs == TREE->msg_cap) msg_flush(TREE,0);
+        return TREE->failed ? 0 : lba;
+    }
+
+    reset_flush(TREE);
+    lba = locate(TREE,key);
+    if(TREE->nbad > 0) return 0;
+
+    // if its already there then just replace the value
+    if(lba != 0){
+        if(!TREE->cow && !(TREE->flags & B_TREE_COMPRESS) && record_sectors(TREE,lba) == sectors){
+            if(TREE->wb_max > 0){
+                wb_put(TREE,(TREE->flags & B_TREE_EXTENTS) ? lba >> EXT_BITS : lba,record,size,1);
+                commit(TREE);
+            }else{
+                if(TREE->flags & B_TREE_EXTENTS){
+                    rv = write_extent(TREE,lba >> EXT_BITS,record,size);
+                }else{
+                    crc_set(TREE,lba,record,1);
+                    rv = jdisk_write(TREE->disk,lba,record);
+                }
+
+                // the new checksums go out after the record, if it landed
+                if(rv != 0) TREE->failed = 1;
+                if(TREE->crc_ndirty > 0) commit(TREE);
+            }
+            return TREE->failed ? 0 : lba;
+        }
+
+        // snapshots may still read the old value, and a packed record
+        // or a longer one can't go in place, so write a new one
+        retire_record(TREE,lba);
+        lba = write_record(TREE,record,size,TREE->hit->lba);
+        TREE->hit->lbas[TREE->hit_index] = lba;
+        if(TREE->hot != NULL) hot_update(TREE,key,lba);
+        mark_dirty(TREE,TREE->hit);
+        commit(TREE);
+        return TREE->failed ? 0 : lba;
+    }
+
+    // read in the data, next to its leaf, then put the key in
+    lba = write_record(TREE,record,size,(TREE->tmp_e != NULL) ? TREE->tmp_e->lba : TREE->root_lba);
+    add_key(TREE,key,lba);
+
+    // flush everything to disk that needs it
+    commit(TREE);
+    return TREE->failed ? 0 : lba;
+}
+
+/*  last_leaf
+ *  Returns the rightmost leaf under a node.
+ *  Its last lba is the record of the key just above it.
+ *
+ *  @t is the node
+ *  @TREE is the B_Tree
+ */
+Tree_Node *last_leaf(Tree_Node *t,B_Tree *TREE){
+    while(t->internal == 1){
+        t = t_node_setup(TREE,t->lbas[t->nkeys],t,t->nkeys);
+    }
+    return t;
+}
+
+// returns the last lba in the node (used to get data lba of upper node)
+/*  get_last_lba
+ *  Returns the last lba in a node.
+ *  Goes down to the rightmost leaf if you give it an internal node.
+ *
+ *  @t is the node to find the lba of
+ *  @TREE is the B_Tree
+ */
+unsigned int get_last_lba(Tree_Node *t,B_Tree *TREE){
+    t = last_leaf(t,TREE);
+    return t->lbas[t->nkeys];
+}
+
+/*  recusive_find
+ *  Returns the lba associated with a key.
+ *
+ *  @TREE is the B_Tree
+ *  @t is the current Tree_Node
+ *  @key is the key
+ */
+unsigned int recursive_find(B_Tree *TREE,Tree_Node *t, void *key){
+    Tree_Node *leaf;
+    int i, comp;
+
+    // find the first key that isn't less than this one
+    i = node_search(TREE,t,key,&comp);
+
+    if(t->internal == 1){
+        if(comp == 0){
+            // we found the key so get its lba
+            leaf = last_leaf(t_node_setup(TREE,t->lbas[i],t,i),TREE);
+            TREE->hit = leaf;
+            TREE->hit_index = leaf->nkeys;
+            return leaf->lbas[leaf->nkeys];
+        }
+
+        // the key is to the left of key i (or right of the last one)
+        return recursive_find(TREE,t_node_setup(TREE,t->lbas[i],t,i),key);
+    }
+
+    if(comp == 0){
+        // this is the key so return its lba
+        TREE->hit = t;
+        TREE->hit_index = i;
+        return t->lbas[i];
+    }
+
+    // it should go where key i is (or on the end)
+    TREE->tmp_e = t;
+    TREE->tmp_e_index = i;
+    return 0;
+}
+
+/*  b_tree_find
+ *  Returns the lba associated with key.
+ *  Calls recursive_find.
+ * 
+ *  @b_tree is the B_Tree
+ *  @key is the key
+ */
+unsigned int b_tree_find(void *b_tree, void *key){
+    B_Tree *b = b_tree;
+    unsigned long start;
+    unsigned int lba;
+
+    wb_enter(b);
+    if(b->trace == NULL){
+        lba = tree_find(b,key);
+    }else{
+        start = now_ns();
+        lba = tree_find(b,key);
+        trace_op(b,'F',start,key,lba,0);
+    }
+    wb_leave(b);
+    return lba;
+}
+
+/*  tree_find
+ *  Does the work of b_tree_find().
+ *
+ *  @b is the B_Tree
+ *  @key is the key
+ */
+unsigned int tree_find(B_Tree *b, void *key){
+    unsigned long h = 0;
+    unsigned int lba;
+    long set;
+    int w, found;
+
+    if((b->flags & B_TREE_KEY_TYPE) == B_TREE_KEY_CUSTOM && b->compare == NULL) return 0;
+
+    // buffered inserts are newer than anything in the tree
+    if(b->nmsgs > 0){
+        w = msg_search(b,key,&found);
+        if(found) return b->msg_lbas[w];
+    }
+
+    // popular keys are answered by one probe of the hot cache
+    if(b->hot != NULL){
+        h = key_hash(b,key);
+        hot_count(b->hot,h,1);
+        set = h & (b->hot->nsets - 1);
+        w = hot_way(b,key,set);
+        if(w >= 0) return b->hot->lbas[set * HOT_WAYS + w];
+    }
+
+    // most misses stop here without reading anything
+    if(b->bloom != NULL && !bloom_probe(b,key,0)) return 0;
+
+    lba = recursive_find(b,b->root,key);
+    if(lba != 0 && b->hot != NULL) hot_admit(b,key,h,lba);
+    return lba;
+}
+
+/*  recursive_traverse
+ *  Calls fn on every key under t that isn't less than lo, in key order.
+ *  Returns whatever non-zero value fn returned to stop early, 0, or
+ *  B_TREE_BAD_CHECKSUM if it reaches a damaged node.  The key above a
+ *  damaged subtree isn't passed to fn either, since its record lba is
+ *  in that subtree.
+ *
+ *  @TREE is the B_Tree
+ *  @t is the current Tree_Node
+ *  @lo is the first key to visit (NULL = all of them)
+ *  @fn is called with each key, its record lba and arg
+ *  @arg is passed through to fn
+ */
+int recursive_traverse(B_Tree *TREE, Tree_Node *t, void *lo, B_Tree_Traverse_Fn fn, void *arg){
+    Tree_Node *child;
+    unsigned int lba;
+    int i, rv, comp;
+
+    if(t->bad) return B_TREE_BAD_CHECKSUM;
+
+    // skip the keys below lo; only the first subtree we go into can have any
+    i = 0;
+    comp = -1;
+    if(lo != NULL) i = node_search(TREE,t,lo,&comp);
+
+    for(; i < t->nkeys; i++){
+        if(t->internal == 1){
+            // everything to the left of the key, then the key itself
+            child = t_node_setup(TREE,t->lbas[i],t,i);
+            if(comp != 0){
+                rv = recursive_traverse(TREE,child,lo,fn,arg);
+                if(rv != 0) return rv;
+            }
+            // a damaged node on the way to the last leaf reads as an empty leaf
+            lba = get_last_lba(child,TREE);
+            if(lba == 0) return B_TREE_BAD_CHECKSUM;
+            rv = fn(KEY(TREE,t,i),lba,arg);
+        }else{
+            rv = fn(KEY(TREE,t,i),t->lbas[i],arg);
+        }
+        if(rv != 0) return rv;
+        lo = NULL;
+        comp = -1;
+    }
+
+    // the rightmost subtree
+    if(t->internal == 1){
+        return recursive_traverse(TREE,t_node_setup(TREE,t->lbas[t->nkeys],t,t->nkeys),lo,fn,arg);
+    }
+    return 0;
+}
+
+/*  b_tree_traverse
+ *  Calls fn on every key in the B_Tree in key order.
+ *  fn returns 0 to keep going; anything else stops the traversal
+ *  and is returned.  Returns B_TREE_BAD_CHECKSUM, after the keys before
+ *  it, if a node fails its checksum or can't be read.
+ *
+ *  @b_tree is the B_Tree
+ *  @fn is called with each key, its record lba and arg
+ *  @arg is passed through to fn
+ */
+int b_tree_traverse(void *b_tree, B_Tree_Traverse_Fn fn, void *arg){
+    return b_tree_scan(b_tree,NULL,fn,arg);
+}
+
+/*  b_tree_scan
+ *  Like b_tree_traverse(), but starts at the first key that isn't
+ *  less than lo, reading only the nodes on the way down to it.
+ *  Returns -1 if lo can't be compared yet (B_TREE_KEY_CUSTOM with no
+ *  order set), and B_TREE_BAD_CHECKSUM like b_tree_traverse().
+ *
+ *  @b_tree is the B_Tree
+ *  @lo is the first key to visit (NULL = from the first)
+ *  @fn is called with each key, its record lba and arg
+ *  @arg is passed through to fn
+ */
+int b_tree_scan(void *b_tree, void *lo, B_Tree_Traverse_Fn fn, void *arg){
+    B_Tree *b = b_tree;
+    int rv;
+
+    if(lo != NULL && (b->flags & B_TREE_KEY_TYPE) == B_TREE_KEY_CUSTOM && b->compare == NULL) return -1;
+
+    // buffered inserts go into the tree first, so they come out in order
+    wb_enter(b);
+    msg_flush(b,1);
+    rv = recursive_traverse(b,b->root,lo,fn,arg);
+    wb_leave(b);
+    return rv;
+}
+
+/* A parallel scan cuts the tree into at most nthreads * B_TREE_SCAN_PARTS
+   runs of sibling subtrees, each followed by the separator key above its
+   last one, and the workers take them in key order.  SCAN_DEPTH bounds
+   the height a worker walks. */
+#define SCAN_DEPTH (64)
+
+typedef struct {
+    Tree_Node *node;              /* The held node whose children these are (NULL = the root is a leaf) */
+    int first;                    /* First child in the run */
+    int last;                     /* and last */
+    Tree_Node *sep;               /* The held node whose key follows the run (NULL = none) */
+    int sep_index;                /* and which key */
+} Scan_Part;
+
+typedef struct {
+    B_Tree *tree;
+    Scan_Part *parts;
+    int nparts;
+    int next;                     /* Next partition to hand out */
+    int stop;                     /* Set when fn asks to stop */
+    int *rvs;                     /* What fn returned to stop each partition */
+    B_Tree_Partition_Fn fn;
+    void *arg;
+} Scan_Job;
+
+typedef struct {
+    Scan_Job *job;
+    void *disk;                   /* This worker's own jdisk handle */
+    Tree_Node *frames[SCAN_DEPTH];   /* A private frame per level, for nodes that aren't held */
+    int part;                     /* Partition being walked */
+    long nbad;                    /* Nodes that failed their checksum or couldn't be read */
+    pthread_t thread;
+} Scan_Worker;
+
+/*  scan_node
+ *  Returns node lba for a scan worker: the held copy if there is one
+ *  (it may be newer than the disk), else the sector read into the
+ *  worker's own frame for this level.  Nothing shared is changed.
+ *
+ *  @W is the worker
+ *  @lba is the node's sector
+ *  @depth is how far below the partition root it is
+ */
+Tree_Node *scan_node(Scan_Worker *W, unsigned int lba, int depth){
+    B_Tree *TREE = W->job->tree;
+    Tree_Node *t;
+    unsigned char *frame;
+
+    t = node_lookup(TREE,lba);
+    if(t != NULL) return t;
+
+    // bytes starts on a JDISK_ALIGN boundary, so O_DIRECT reads land in place
+    if(W->frames[depth] == NULL){
+        frame = aligned_alloc(JDISK_ALIGN,(JDISK_ALIGN + sizeof(Tree_Node) + JDISK_ALIGN - 1) / JDISK_ALIGN * JDISK_ALIGN);
+        W->frames[depth] = (Tree_Node *) (frame + JDISK_ALIGN - offsetof(Tree_Node,bytes));
+    }
+    t = W->frames[depth];
+    t->bad = 0;
+    if(jdisk_read(W->disk,lba,t->bytes) != 0 || crc_check(TREE,lba,t->bytes,1) != 0){
+        W->nbad++;
+        memset(t->bytes,0,JDISK_SECTOR_SIZE);
+        t->bad = 1;
+    }
+    t->internal = t->bytes[0];
+    t->nkeys = t->bytes[1];
+    t->lba = lba;
+    t->lbas = (unsigned int *) (t->bytes + JDISK_SECTOR_SIZE - TREE->lbas_per_block * 4);
+    return t;
+}
+
+/*  scan_walk
+ *  Calls the job's fn on every key under a node, in key order, until
+ *  the scan is told to stop.  Returns the subtree's last lba (the
+ *  record of the separator key above it).  A damaged node stops the
+ *  scan with B_TREE_BAD_CHECKSUM for this partition.
+ *
+ *  @W is the worker
+ *  @lba is the node's sector
+ *  @depth is how far below the partition root it is
+ */
+unsigned int scan_walk(Scan_Worker *W, unsigned int lba, int depth){
+    Scan_Job *J = W->job;
+    Tree_Node *t;
+    unsigned int last;
+    int i, rv;
+
+    if(depth == SCAN_DEPTH) return 0;
+    t = scan_node(W,lba,depth);
+    if(t->bad){
+        J->rvs[W->part] = B_TREE_BAD_CHECKSUM;
+        __atomic_store_n(&J->stop,1,__ATOMIC_RELAXED);
+        return 0;
+    }
+    for(i = 0; i < t->nkeys; i++){
+        if(__atomic_load_n(&J->stop,__ATOMIC_RELAXED)) return 0;
+        if(t->internal == 1){
+            last = scan_walk(W,t->lbas[i],depth+1);
+            if(__atomic_load_n(&J->stop,__ATOMIC_RELAXED)) return 0;
+        }else{
+            last = t->lbas[i];
+        }
+        rv = J->fn(W->part,KEY(J->tree,t,i),last,J->arg);
+        if(rv != 0){
+            J->rvs[W->part] = rv;
+            __atomic_store_n(&J->stop,1,__ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    if(t->internal == 1) return scan_walk(W,t->lbas[t->nkeys],depth+1);
+    return t->lbas[t->nkeys];
+}
+
+/*  scan_worker
+ *  Thread body: walks partitions, lowest first, until none are left.
+ *
+ *  @arg is the Scan_Worker
+ */
+void *scan_worker(void *arg){
+    Scan_Worker *W = arg;
+    Scan_Job *J = W->job;
+    Scan_Part *p;
+    unsigned int last;
+    int c, rv;
+
+    while(!__atomic_load_n(&J->stop,__ATOMIC_RELAXED)){
+        W->part = __atomic_fetch_add(&J->next,1,__ATOMIC_RELAXED);
+        if(W->part >= J->nparts) break;
+        p = &J->parts[W->part];
+        if(p->node == NULL){
+            scan_walk(W,J->tree->root_lba,0);
+            continue;
+        }
+
+        // each subtree, then the key after it
+        for(c = p->first; ; c++){
+            last = scan_walk(W,p->node->lbas[c],0);
+            if(__atomic_load_n(&J->stop,__ATOMIC_RELAXED)) break;
+            if(c == p->last){
+                rv = (p->sep == NULL) ? 0 : J->fn(W->part,KEY(J->tree,p->sep,p->sep_index),last,J->arg);
+            }else{
+                rv = J->fn(W->part,KEY(J->tree,p->node,c),last,J->arg);
+            }
+            if(rv != 0){
+                J->rvs[W->part] = rv;
+                __atomic_store_n(&J->stop,1,__ATOMIC_RELAXED);
+            }
+            if(rv != 0 || c == p->last) break;
+        }
+    }
+    return NULL;
+}
+
+/*  scan_children
+ *  Adds a one-child run for each child of a held node.
+ *  Returns how many it added.
+ *
+ *  @t is the node
+ *  @sep and @sep_index are the key that follows the node's last child
+ *  @parts gets the runs
+ */
+int scan_children(Tree_Node *t, Tree_Node *sep, int sep_index, Scan_Part *parts){
+    int j;
+
+    for(j = 0; j <= t->nkeys; j++){
+        parts[j].node = t;
+        parts[j].first = j;
+        parts[j].last = j;
+        parts[j].sep = (j < t->nkeys) ? t : sep;
+        parts[j].sep_index = (j < t->nkeys) ? j : sep_index;
+    }
+    return t->nkeys + 1;
+}
+
+/*  scan_split
+ *  Cuts the tree into partitions along the separator keys of its upper
+ *  levels.  It goes down a level while there are fewer subtrees than
+ *  max, then groups the subtrees of the last level into runs of
+ *  siblings so there are at most max.  The nodes it goes through are
+ *  held, so workers find them in the cache.  Returns the number of
+ *  partitions.
+ *
+ *  @TREE is the B_Tree
+ *  @parts gets the partitions, in key order (room for max)
+ *  @max is the most partitions
+ */
+int scan_split(B_Tree *TREE, Scan_Part *parts, int max){
+    Scan_Part *units, *next;
+    Tree_Node *t, **kids;
+    int n, nn, np, nparents, i, k, g, deeper;
+
+    t = TREE->root;
+    if(t->internal != 1){
+        memset(parts,0,sizeof(Scan_Part));
+        return 1;
+    }
+    units = malloc((t->nkeys + 1) * sizeof(Scan_Part));
+    n = scan_children(t,NULL,0,units);
+    nparents = 1;
+
+    // a level down, while every subtree still gets a partition of its own
+    while(n < max){
+        kids = malloc(n * sizeof(Tree_Node *));
+        nn = 0;
+        deeper = 1;
+        for(i = 0; i < n; i++){
+            kids[i] = t_node_setup(TREE,units[i].node->lbas[units[i].first],units[i].node,units[i].first);
+            nn += kids[i]->nkeys + 1;
+
+            // a damaged node stays a partition of its own, for a worker to report
+            if(kids[i]->bad) deeper = 0;
+        }
+        if(kids[0]->internal != 1 || !deeper){
+            free(kids);
+            break;
+        }
+        next = malloc(nn * sizeof(Scan_Part));
+        nn = 0;
+        for(i = 0; i < n; i++) nn += scan_children(kids[i],units[i].sep,units[i].sep_index,next + nn);
+        free(kids);
+        free(units);
+        units = next;
+        nparents = n;
+        n = nn;
+    }
+
+    // runs of at most g siblings: n / g plus one short run per parent fits in max
+    g = (n <= max) ? 1 : (n + max - nparents - 1) / (max - nparents);
+    np = 0;
+    for(i = 0; i < n; i += k){
+        for(k = 1; k < g && i + k < n && units[i+k].node == units[i].node; k++);
+        parts[np] = units[i + k - 1];
+        parts[np].first = units[i].first;
+        np++;
+    }
+    free(units);
+    return np;
+}
+
+/*  b_tree_parallel_scan
+ *  Calls fn on every key in the B_Tree from nthreads threads.  The key
+ *  space is cut into partitions at the separator keys of the root and
+ *  the levels under it; they are numbered in key order, fn gets the
+ *  number, and within a partition the keys come in order.  Different
+ *  partitions go to different threads at once, so fn must be safe to
+ *  call that way, and it must not call back into the tree.  Like every
+ *  other call, it must not run alongside inserts from other threads;
+ *  with write-back on it holds the write-back lock, so the flusher
+ *  waits until the scan is done.  Each thread reads through its own
+ *  jdisk handle.
+ *  fn returns 0 to keep going; anything else stops every thread, and the
+ *  value from the lowest partition that stopped is returned.  A node that
+ *  fails its checksum or can't be read stops them the same way, with
+ *  B_TREE_BAD_CHECKSUM.  Returns -1 if the workers' handles can't be
+ *  opened.  Threads that can't be
+ *  started leave their partitions to the others.
+ *
+ *  @b_tree is the B_Tree
+ *  @nthreads is the number of threads (at most B_TREE_SCAN_THREADS)
+ *  @fn is called with the partition, each key, its record lba and arg
+ *  @arg is passed through to fn
+ */
+int b_tree_parallel_scan(void *b_tree, int nthreads, B_Tree_Partition_Fn fn, void *arg){
+    B_Tree *TREE = b_tree;
+    B_Tree *owner;
+    Scan_Job J;
+    Scan_Worker *W;
+    int i, j, rv, started;
+
+    if(nthreads < 1) nthreads = 1;
+    if(nthreads > B_TREE_SCAN_THREADS) nthreads = B_TREE_SCAN_THREADS;
+    owner = (TREE->snap_of != NULL) ? TREE->snap_of : TREE;
+
+    // buffered inserts go into the tree first, and the flusher waits until the workers are done
+    wb_enter(TREE);
+    msg_flush(TREE,1);
+
+    memset(&J,0,sizeof(J));
+    J.tree = TREE;
+    J.fn = fn;
+    J.arg = arg;
+    J.parts = malloc(nthreads * B_TREE_SCAN_PARTS * sizeof(Scan_Part));
+    J.nparts = scan_split(TREE,J.parts,nthreads * B_TREE_SCAN_PARTS);
+    J.rvs = calloc(J.nparts,sizeof(int));
+    if(nthreads > J.nparts) nthreads = J.nparts;
+
+    W = calloc(nthreads,sizeof(Scan_Worker));
+    rv = 0;
+    for(i = 0; i < nthreads; i++){
+        W[i].job = &J;
+        W[i].disk = jdisk_attach(owner->filename);
+        if(W[i].disk == NULL){
+            rv = -1;
+            break;
+        }
+        if(TREE->direct) jdisk_set_direct(W[i].disk,1);
+        jdisk_set_readahead(W[i].disk,JDISK_READAHEAD);
+    }
+
+    // the workers take partitions until there are none left, so a
+    // thread that won't start only leaves fewer of them
+    if(rv == 0){
+        for(started = 1; started < nthreads; started++){
+            if(pthread_create(&W[started].thread,NULL,scan_worker,&W[started]) != 0) break;
+        }
+        scan_worker(&W[0]);
+        for(i = 1; i < started; i++) pthread_join(W[i].thread,NULL);
+        for(i = 0; i < J.nparts && rv == 0; i++) rv = J.rvs[i];
+    }
+
+    for(i = 0; i < nthreads; i++){
+        if(W[i].disk != NULL) jdisk_unattach(W[i].disk);
+        TREE->nbad += W[i].nbad;
+        for(j = 0; j < SCAN_DEPTH; j++){
+            if(W[i].frames[j] != NULL) free((unsigned char *) W[i].frames[j] + offsetof(Tree_Node,bytes) - JDISK_ALIGN);
+        }
+    }
+    wb_leave(TREE);
+
+    free(W);
+    free(J.parts);
+    free(J.rvs);
+    return rv;
+}
+
+/*  rank
+ *  Returns how many keys in the tree are less than key, reading one
+ *  node per level, or B_TREE_BAD_CHECKSUM if one of them is damaged.
+ *
+ *  @TREE is the B_Tree (with B_TREE_COUNTS)
+ *  @key is the key
+ */
+long rank(B_Tree *TREE, void *key){
+    Tree_Node *t = TREE->root;
+    long n = 0;
+    int i, j, comp;
+
+    while(1){
+        if(t->bad) return B_TREE_BAD_CHECKSUM;
+        i = node_search(TREE,t,key,&comp);
+        n += i;
+        if(t->internal) for(j = 0; j < i; j++) n += t->counts[j];
+
+        // everything left of a matching key is smaller, and nothing in
+        // a leaf goes below it
+        if(t->internal == 0) return n;
+        if(i < t->nkeys && comp == 0) return n + t->counts[i];
+        t = t_node_setup(TREE,t->lbas[i],t,i);
+    }
+}
+
+/*  b_tree_rank
+ *  Returns how many keys in the tree are less than key, -1 if the
+ *  tree wasn't created with B_TREE_COUNTS, or B_TREE_BAD_CHECKSUM if
+ *  a node on the way fails its checksum or can't be read.
+ *
+ *  @b_tree is the B_Tree
+ *  @key is the key
+ */
+long b_tree_rank(void *b_tree, void *key){
+    B_Tree *TREE = b_tree;
+    long n;
+
+    if(!(TREE->flags & B_TREE_COUNTS)) return -1;
+    if((TREE->flags & B_TREE_KEY_TYPE) == B_TREE_KEY_CUSTOM && TREE->compare == NULL) return -1;
+    wb_enter(TREE);
+    msg_flush(TREE,1);
+    n = rank(TREE,key);
+    wb_leave(TREE);
+    return n;
+}
+
+/*  b_tree_count_range
+ *  Returns how many keys k there are with lo <= k < hi, -1 if the
+ *  tree wasn't created with B_TREE_COUNTS, or B_TREE_BAD_CHECKSUM like
+ *  b_tree_rank().  A NULL bound is open.
+ *
+ *  @b_tree is the B_Tree
+ *  @lo is the smallest key to count (NULL = from the first)
+ *  @hi is the key to stop before (NULL = through the last)
+ */
+long b_tree_count_range(void *b_tree, void *lo, void *hi){
+    B_Tree *TREE = b_tree;
+    long a, b;
+
+    if(!(TREE->flags & B_TREE_COUNTS)) return -1;
+    if((TREE->flags & B_TREE_KEY_TYPE) == B_TREE_KEY_CUSTOM && TREE->compare == NULL) return -1;
+    wb_enter(TREE);
+    msg_flush(TREE,1);
+    a = (lo == NULL) ? 0 : rank(TREE,lo);
+    if(hi != NULL) b = rank(TREE,hi);
+    else b = ((Tree_Node *) TREE->root)->bad ? B_TREE_BAD_CHECKSUM : (long) subtree_keys(TREE->root);
+    wb_leave(TREE);
+    if(a < 0 || b < 0) return B_TREE_BAD_CHECKSUM;
+    return (b > a) ? b - a : 0;
+}
+
+unsigned int tree_select(B_Tree *TREE, unsigned long i, void *key);
+
+/*  b_tree_select
+ *  Finds the key with i keys before it (0 is the smallest), reading one
+ *  node per level, plus the path to its record for an internal key.
+ *  Returns its record lba and copies the key into key, or returns 0 if
+ *  i is past the end, the tree wasn't created with B_TREE_COUNTS, or a
+ *  node on the way fails its checksum or can't be read.  An lba has no
+ *  room for B_TREE_BAD_CHECKSUM, so b_tree_bad_sectors() tells the last
+ *  case apart.
+ *
+ *  @b_tree is the B_Tree
+ *  @i is the key's rank
+ *  @key gets the key (key_size bytes)
+ */
+unsigned int b_tree_select(void *b_tree, unsigned long i, void *key){
+    B_Tree *TREE = b_tree;
+    unsigned int lba;
+
+    if(!(TREE->flags & B_TREE_COUNTS)) return 0;
+    wb_enter(TREE);
+    msg_flush(TREE,1);
+    lba = tree_select(TREE,i,key);
+    wb_leave(TREE);
+    return lba;
+}
+
+/*  tree_select
+ *  Does the work of b_tree_select().
+ *
+ *  @TREE is the B_Tree
+ *  @i is the key's rank
+ *  @key gets the key
+ */
+unsigned int tree_select(B_Tree *TREE, unsigned long i, void *key){
+    Tree_Node *t;
+    int j;
+
+
+    t = TREE->root;
+    if(i >= subtree_keys(t)) return 0;
+    while(t->internal == 1){
+        for(j = 0; j < t->nkeys && i > t->counts[j]; j++) i -= t->counts[j] + 1;
+        if(j < t->nkeys && i == t->counts[j]){
+            // 0 if a node on the way to the last leaf is damaged
+            memcpy(key,KEY(TREE,t,j),TREE->key_size);
+            return get_last_lba(t_node_setup(TREE,t->lbas[j],t,j),TREE);
+        }
+        t = t_node_setup(TREE,t->lbas[j],t,j);
+    }
+    if(i >= t->nkeys) return 0;
+    memcpy(key,KEY(TREE,t,i),TREE->key_size);
+    return t->lbas[i];
+}
+
+int read_record(B_Tree *TREE, unsigned int lba, void *record);
+
+/*  b_tree_read_record
+ *  Reads the record at an lba returned by b_tree_insert() or b_tree_find().
+ *  Decompresses it if the tree uses B_TREE_COMPRESS, and reads all of
+ *  a multi-sector record in one I/O.
+ *  Returns 0 on success, B_TREE_BAD_CHECKSUM if the tree has checksums
+ *  and a sector of the record doesn't match, and -1 if it can't be read.
+ *
+ *  @b_tree is the B_Tree
+ *  @lba is the record's lba
+ *  @record gets b_tree_record_size() bytes
+ */
+int b_tree_read_record(void *b_tree, unsigned int lba, void *record){
+    B_Tree *TREE = b_tree;
+    int rv;
+
+    wb_enter(TREE);
+    rv = read_record(TREE,lba,record);
+    wb_leave(TREE);
+    return rv;
+}
+
+/*  read_sectors
+ *  Reads n sectors starting at lba in one I/O, or copies them from a
+ *  write-back record write that hasn't landed yet.
+ *  Returns 0 on success, B_TREE_BAD_CHECKSUM if a sector doesn't match
+ *  its checksum, and -1 if they can't be read.
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the first sector
+ *  @n is how many
+ *  @buf gets them
+ */
+int read_sectors(B_Tree *TREE, unsigned int lba, int n, void *buf){
+    struct iovec iov;
+    void *data;
+
+    if(TREE->wb_max > 0 && (data = wb_lookup(TREE,lba)) != NULL){
+        memcpy(buf,data,(size_t) n * JDISK_SECTOR_SIZE);
+        return 0;
+    }
+    iov.iov_base = buf;
+    iov.iov_len = (size_t) n * JDISK_SECTOR_SIZE;
+    if(jdisk_readv(TREE->disk,lba,&iov,1) != 0) return -1;
+    if(crc_check(TREE,lba,buf,n) != 0){
+        TREE->nbad++;
+        return B_TREE_BAD_CHECKSUM;
+    }
+    return 0;
+}
+
+/*  read_record
+ *  Does the work of b_tree_read_record().
+ *
+ *  @TREE is the B_Tree
+ *  @lba is the record's lba
+ *  @record gets the record
+ */
+int read_record(B_Tree *TREE, unsigned int lba, void *record){
+    unsigned char sector[JDISK_SECTOR_SIZE];
+    unsigned char *buf;
+    int slot, off, len, rv;
+
+    if(TREE->flags & B_TREE_EXTENTS){
+        return read_sectors(TREE,lba >> EXT_BITS,record_sectors(TREE,lba),record);
+    }
+
+    if(!(TREE->flags & B_TREE_COMPRESS)){
+        return read_sectors(TREE,lba,1,record);
+    }
+
+    slot = lba & 15;
+    lba >>= 4;
+    if(slot == PACK_RAW){
+        return read_sectors(TREE,lba,1,record);
+    }
+
+    // the sector being filled is already in memory
+    if(lba == TREE->pack_lba){
+        buf = TREE->pack_buf;
+    }else{
+        rv = read_sectors(TREE,lba,1,sector);
+        if(rv != 0) return rv;
+        buf = sector;
+    }
+
+    if(pack_slot(buf,slot,&off,&len) != 0) return -1;
+    if(lz_decompress(buf + off,len,record,JDISK_SECTOR_SIZE) != JDISK_SECTOR_SIZE) return -1;
+    return 0;
+}
+
+/*  b_tree_record_size
+ *  Returns how many bytes b_tree_read_record() puts in its buffer for
+ *  the record at an lba: a whole number of sectors.
+ *
+ *  @b_tree is the B_Tree
+ *  @lba is the record's lba
+ */
+int b_tree_record_size(void *b_tree, unsigned int lba){
+    return record_sectors(b_tree,lba) * JDISK_SECTOR_SIZE;
+}
+
+/* Merging walks each source tree MERGE_CHUNK keys at a time and feeds
+   the keys, in order, through the destination's insert buffer, which is
+   made at least MERGE_BATCH long for the merge.  Each batch is applied
+   leaf by leaf and committed once, so a leaf is written once per batch
+   instead of once per key.  A new tree is written with write-back on,
+   so its records go out in long runs too. */
+#define MERGE_CHUNK (256)
+#define MERGE_BATCH (4096)
+#define MERGE_WRITEBACK (8192)
+
+typedef struct {
+  B_Tree *tree;                 /* The tree being walked */
+  unsigned char *keys;          /* The keys fetched, in order */
+  unsigned int lbas[MERGE_CHUNK];   /* and their record lbas */
+  unsigned char *last;          /* The last key of the chunk before */
+  int n;                        /* How many were fetched */
+  int pos;                      /* and the next one to use */
+  int done;                     /* The tree has no more */
+} Merge_Cursor;
+
+/*  merge_fetch
+ *  recursive_traverse() function that fills a Merge_Cursor, skipping
+ *  the key the chunk before ended with.  Returns 1 once it is full.
+ */
+int merge_fetch(void *key, unsigned int lba, void *arg){
+    Merge_Cursor *C = arg;
+    B_Tree *TREE = C->tree;
+
+    if(C->last != NULL && key_cmp(TREE,key,C->last) == 0) return 0;
+    memcpy(C->keys + (size_t) C->n * TREE->key_size,key,TREE->key_size);
+    C->lbas[C->n++] = lba;
+    return (C->n == MERGE_CHUNK);
+}
+
+/*  merge_key
+ *  Returns the cursor's next key, fetching another chunk when this one
+ *  is used up, or NULL at the end of the tree.
+ *
+ *  @C is the Merge_Cursor
+ */
+void *merge_key(Merge_Cursor *C){
+    B_Tree *TREE = C->tree;
+
+    if(C->pos == C->n && !C->done){
+        if(C->n > 0){
+            if(C->last == NULL) C->last = malloc(TREE->key_size);
+            memcpy(C->last,C->keys + (size_t) (C->n - 1) * TREE->key_size,TREE->key_size);
+        }
+        C->n = 0;
+        C->pos = 0;
+        if(recursive_traverse(TREE,TREE->root,C->last,merge_fetch,C) == 0) C->done = 1;
+    }
+    if(C->pos == C->n) return NULL;
+    return C->keys + (size_t) C->pos * TREE->key_size;
+}
+
+/*  merge_start
+ *  Sets up a cursor on a source tree and locks it.  Its buffered
+ *  inserts go in first, so they come out in order.
+ *
+ *  @C is the Merge_Cursor
+ *  @TREE is the tree to walk (NULL = nothing)
+ */
+void merge_start(Merge_Cursor *C, B_Tree *TREE){
+    C->tree = TREE;
+    C->keys = NULL;
+    C->last = NULL;
+    C->n = 0;
+    C->pos = 0;
+    C->done = (TREE == NULL);
+    if(TREE == NULL) return;
+    wb_enter(TREE);
+    msg_flush(TREE,1);
+    C->keys = malloc((size_t) MERGE_CHUNK * TREE->key_size);
+}
+
+/*  merge_end
+ *  Frees a cursor and unlocks its tree.
+ *
+ *  @C is the Merge_Cursor
+ */
+void merge_end(Merge_Cursor *C){
+    free(C->keys);
+    free(C->last);
+    if(C->tree != NULL) wb_leave(C->tree);
+}
+
+/*  merge_trees
+ *  Inserts every key of a and b into TREE in key order, with its record.
+ *  Where both have a key, b's record is the one that goes in.
+ *  Returns 0, or -1 if a record can't be read or an insert fails.
+ *
+ *  @TREE is the destination
+ *  @a and @b are the sources (a may be NULL)
+ */
+int merge_trees(B_Tree *TREE, B_Tree *a, B_Tree *b){
+    Merge_Cursor A, B, *C;
+    unsigned char *rec, *ka, *kb;
+    int old_cap, size, comp, rv;
+
+    merge_start(&A,a);
+    merge_start(&B,b);
+    wb_enter(TREE);
+    old_cap = TREE->msg_cap;
+    if(old_cap < MERGE_BATCH) b_tree_set_buffer(TREE,MERGE_BATCH);
+    rec = malloc(B_TREE_MAX_RECORD);
+
+    rv = 0;
+    for(;;){
+        ka = merge_key(&A);
+        kb = merge_key(&B);
+        if(ka == NULL && kb == NULL) break;
+        comp = (ka == NULL) ? 1 : (kb == NULL) ? -1 : key_cmp(TREE,ka,kb);
+        if(comp == 0) A.pos++;
+        C = (comp < 0) ? &A : &B;
+
+        size = record_sectors(C->tree,C->lbas[C->pos]) * JDISK_SECTOR_SIZE;
+        if(read_record(C->tree,C->lbas[C->pos],rec) != 0){
+            rv = -1;
+            break;
+        }
+
+        // a full buffer goes in whole; the keys are sorted, so there is
+        // nothing to gain from keeping the small runs back
+        if(TREE->nmsgs + 1 == TREE->msg_cap) msg_flush(TREE,1);
+        if(tree_insert(TREE,C->keys + (size_t) C->pos * C->tree->key_size,rec,size) == 0){
+            rv = -1;
+            break;
+        }
+        C->pos++;
+    }
+
+    free(rec);
+    msg_flush(TREE,1);
+    if(old_cap < MERGE_BATCH) b_tree_set_buffer(TREE,old_cap);
+    wb_leave(TREE);
+    merge_end(&B);
+    merge_end(&A);
+    return rv;
+}
+
+/*  merge_check
+ *  Returns 0 if src's keys can go into dst: same size, same type, and
+ *  neither is missing the order of B_TREE_KEY_CUSTOM keys.  Otherwise -1.
+ *
+ *  @dst and @src are the trees
+ */
+int merge_check(B_Tree *dst, B_Tree *src){
+    if(dst == src || dst->key_size != src->key_size) return -1;
+    if((dst->flags & B_TREE_KEY_TYPE) != (src->flags & B_TREE_KEY_TYPE)) return -1;
+    if((dst->flags & B_TREE_KEY_TYPE) == B_TREE_KEY_CUSTOM && (dst->compare == NULL || src->compare == NULL)) return -1;
+    return 0;
+}
+
+/*  b_tree_merge
+ *  Writes a new tree holding every key of a and b, walking both in key
+ *  order.  Where both have a key, b's record wins, so b is the newer of
+ *  the two.  The new tree has a's flags (and a's order for custom keys),
+ *  and its nodes are nearly full, as after a sequential load with
+ *  b_tree_set_append().  Each node and record of a and b is read once,
+ *  and each of the new tree's nodes is written about once.  Records must
+ *  fit the new tree: more than a sector needs B_TREE_EXTENTS.
+ *  Returns the new tree, attached, or NULL if the keys don't match, the
+ *  file can't be created, or it fills up (the file is then removed).
+ *
+ *  @a and @b are the trees to merge (they aren't changed)
+ *  @filename is the new tree's file, which must not exist
+ *  @size is its size in bytes, a multiple of JDISK_SECTOR_SIZE
+ */
+void *b_tree_merge(void *a, void *b, char *filename, long size){
+    B_Tree *A = a, *B = b, *TREE;
+
+    if(merge_check(A,B) != 0) return NULL;
+    TREE = b_tree_create_flags(filename,size,A->key_size,A->flags & B_TREE_FLAGS);
+    if(TREE == NULL) return NULL;
+    TREE->compare = A->compare;
+
+    // nothing reads the new tree until it is done, so its records and
+    // nodes can wait in memory and go out in long sorted runs
+    TREE->append = 1;
+    b_tree_set_writeback(TREE,MERGE_WRITEBACK,0);
+    if(merge_trees(TREE,A,B) != 0){
+        b_tree_detach(TREE);
+        remove(filename);
+        return NULL;
+    }
+    b_tree_set_writeback(TREE,0,0);
+    TREE->append = 0;
+    return TREE;
+}
+
+/*  b_tree_merge_into
+ *  Inserts every key of delta into b_tree, with its record, replacing
+ *  the records of keys b_tree already has.  delta is walked in key order
+ *  and its keys go in in sorted batches, each applied leaf by leaf and
+ *  committed with one superblock write, so a leaf is written once per
+ *  batch however many of its keys change.  Records must fit b_tree:
+ *  more than a sector needs B_TREE_EXTENTS.
+ *  Returns 0, or -1 if the keys don't match, b_tree is a snapshot, or an
+ *  insert fails; the keys before the failure are in.
+ *
+ *  @b_tree is the tree to merge into
+ *  @delta is the tree to merge from (it isn't changed)
+ */
+int b_tree_merge_into(void *b_tree, void *delta){
+    B_Tree *TREE = b_tree;
+
+    if(TREE->snap_of != NULL || merge_check(TREE,delta) != 0) return -1;
+    return merge_trees(TREE,NULL,delta);
+}
+
+/*  b_tree_set_compare
+ *  Sets the function that orders the keys of a B_TREE_KEY_CUSTOM tree.
+ *  It isn't kept on disk, so set it after every create and attach,
+ *  always to the same order.  Until it is set, inserts and finds return
+ *  0 and b_tree_rank() and b_tree_count_range() return -1.
+ *  Returns 0, or -1 if the tree's keys aren't B_TREE_KEY_CUSTOM.
+ *
+ *  @b_tree is the B_Tree
+ *  @fn returns <0, 0 or >0 like memcmp()
+ */
+int b_tree_set_compare(void *b_tree, B_Tree_Compare_Fn fn){
+    B_Tree *TREE = b_tree;
+
+    if((TREE->flags & B_TREE_KEY_TYPE) != B_TREE_KEY_CUSTOM) return -1;
+    TREE->compare = fn;
+    return 0;
+}
+
+/*  b_tree_set_grow
+ *  Lets b_tree_insert() grow the jdisk instead of failing when it fills up.
+ *  A tree whose tables can't cover any more (or a jdisk that can't
+ *  grow) fails inserts while a few sectors are still free.
+ *  Returns 0, or -1 if extent isn't a multiple of JDISK_SECTOR_SIZE.
+ *
+ *  @b_tree is the B_Tree
+ *  @extent is how many bytes to grow by each time (0 turns growing off)
+ */
+int b_tree_set_grow(void *b_tree, unsigned long extent){
+    B_Tree *TREE = b_tree;
+
+    if(extent % JDISK_SECTOR_SIZE != 0) return -1;
+    TREE->grow_extent = extent;
+    return 0;
+}
+
+/*  b_tree_set_hot_cache
+ *  Puts a cache of about entries keys in front of b_tree_find(), or
+ *  takes it away when entries is 0.  Returns 0, or -1 on a snapshot.
+ *
+ *  @b_tree is the B_Tree
+ *  @entries is the number of keys to cache
+ */
+int b_tree_set_hot_cache(void *b_tree, int entries){
+    B_Tree *TREE = b_tree;
+    Hot_Cache *H = TREE->hot;
+    int bits;
+
+    if(H != NULL){
+        free(H->keys);
+        free(H->lbas);
+        free(H->sketch);
+        free(H);
+        TREE->hot = NULL;
+    }
+    if(entries <= 0) return 0;
+    if(TREE->snap_of != NULL) return -1;
+
+    H = malloc(sizeof(Hot_Cache));
+    H->nsets = 1;
+    while(H->nsets * HOT_WAYS < entries) H->nsets *= 2;
+    H->keys = malloc((long) H->nsets * HOT_WAYS * TREE->key_size);
+    H->lbas = calloc((long) H->nsets * HOT_WAYS,sizeof(unsigned int));
+
+    // a counter per cached key in each row; age every 10 keys' worth of lookups
+    for(bits = 6; (1L << bits) < (long) H->nsets * HOT_WAYS; bits++) ;
+    H->width_bits = bits;
+    H->sketch = calloc(HOT_DEPTH,1L << bits);
+    H->additions = 0;
+    H->sample = 10L * H->nsets * HOT_WAYS;
+
+    TREE->hot = H;
+    return 0;
+}
+
+/*  b_tree_set_cow
+ *  Turns copy-on-write on or off.
+ *  With it on, b_tree_insert() never overwrites a committed sector, so
+ *  a crash leaves the old tree intact and snapshots stay consistent.
+ *  Replacing a record's value gives it a new lba, and with B_TREE_COMPRESS
+ *  each commit starts a new packed sector, so only the records of one
+ *  buffered batch or checkpoint share a sector.
+ *  Returns 0, or -1 if it can't be turned off while snapshots are live.
+ *
+ *  @b_tree is the B_Tree
+ *  @on is 1 to turn copy-on-write on and 0 to turn it off
+ */
+int b_tree_set_cow(void *b_tree, int on){
+    B_Tree *TREE = b_tree;
+
+    if(TREE->snap_of != NULL) return -1;
+    if(!on && TREE->snapshots != NULL) return -1;
+    TREE->cow = on;
+    return 0;
+}
+
+int b_tree_checkpoint(void *b_tree);
+
+/*  b_tree_snapshot
+ *  Returns a read-only handle on the tree as of the last insert,
+ *  or NULL if copy-on-write is off.  With write-back on, it waits for
+ *  a checkpoint first.
+ *  Take it on the thread that inserts.  The snapshot has its own node
+ *  cache and only reads sectors the writer won't touch while it lives,
+ *  so b_tree_find() and b_tree_traverse() on it need no locks.  That
+ *  includes packed records, since each commit starts a new packed sector,
+ *  and it's what lets the snapshot share the writer's checksum table.
+ *
+ *  @b_tree is the B_Tree
+ */
+void *b_tree_snapshot(void *b_tree){
+    B_Tree *TREE = b_tree;
+    B_Tree *snap;
+
+    if(!TREE->cow || TREE->snap_of != NULL) return NULL;
+
+    // it reads the tree from disk, so write-back has to catch up first
+    b_tree_checkpoint(TREE);
+    wb_enter(TREE);
+    snap = malloc(sizeof(B_Tree));
+    snap->key_size = TREE->key_size;
+    snap->root_lba = TREE->root_lba;
+    snap->first_free_block = TREE->first_free_block;
+    snap->flags = TREE->flags;
+    snap->pack_lba = 0;
+    snap->disk = TREE->disk;
+    snap->flush = 0;
+    tree_setup(snap);
+    snap->compare = TREE->compare;
+    // shared with the writer: the entries this snapshot reads are for
+    // committed sectors, which copy-on-write never rewrites or frees
+    // while the snapshot lives, so they don't change under it
+    snap->crc = TREE->crc;
+    snap->direct = TREE->direct;
+    snap->crc_sectors = TREE->crc_sectors;
+    snap->snap_of = TREE;
+    snap->snap_gen = TREE->gen;
+    snap->root = t_node_setup(snap,snap->root_lba,NULL,-1);
+
+    pthread_mutex_lock(&TREE->snap_lock);
+    snap->snap_next = TREE->snapshots;
+    TREE->snapshots = snap;
+    pthread_mutex_unlock(&TREE->snap_lock);
+    wb_leave(TREE);
+
+    return snap;
 }
 
-/*  b_tree_attach
- *  Returns a handle to an existing B_Tree.
- *  Reads values from jdisk and sets up the B_Tree. 
- * 
- *  @filename is the name of the jdisk file
+/*  b_tree_snapshot_release
+ *  Lets go of a snapshot.  Any thread may call this.
+ *  Sectors only it could see are reused by later inserts.
+ *  Returns 0, or -1 if this isn't a snapshot.
+ *
+ *  @snapshot is the handle from b_tree_snapshot()
  */
-void *b_tree_attach(char *filename){
-    unsigned char buf[JDISK_SECTOR_SIZE];
-    B_Tree *TREE = malloc(sizeof(B_Tree));
+int b_tree_snapshot_release(void *snapshot){
+    B_Tree *snap = snapshot;
+    B_Tree *TREE = snap->snap_of;
+    B_Tree **p;
 
-    TREE->disk = jdisk_attach(filename);
+    if(TREE == NULL) return -1;
 
-    jdisk_read(TREE->disk,0,buf);
+    pthread_mutex_lock(&TREE->snap_lock);
+    for(p = &TREE->snapshots; *p != snap; p = &(*p)->snap_next) ;
+    *p = snap->snap_next;
+    pthread_mutex_unlock(&TREE->snap_lock);
 
-    // read in BTREE info
-    memcpy(&TREE->key_size,buf,4);
-    memcpy(&TREE->root_lba,buf+4,4);
-    memcpy(&TREE->first_free_block,buf+8,8);
+    arena_free(snap);
+    free(snap->pack_buf);
+    pthread_mutex_destroy(&snap->snap_lock);
+    free(snap);
+    return 0;
+}
 
-    // set up some values
-    TREE->size = jdisk_size(TREE->disk);
-    TREE->num_lbas = TREE->size/JDISK_SECTOR_SIZE;
-    TREE->keys_per_block = (JDISK_SECTOR_SIZE - 6) / (TREE->key_size + 4);
-    TREE->lbas_per_block = TREE->keys_per_block + 1;
-    TREE->tmp_e = NULL;
-    TREE->tmp_e_index = -1;
+/*  lba_cmp
+ *  qsort()/bsearch() comparison for unsigned int lbas.
+ */
+int lba_cmp(const void *a, const void *b){
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
 
-    // go ahead and read the root node
-    TREE->root = t_node_setup(TREE,TREE->root_lba,NULL,-1);
+    return (x > y) - (x < y);
+}
 
-    return TREE;
+/*  warm_ref_cmp
+ *  qsort() comparison that puts Warm_Refs in lba order.
+ */
+int warm_ref_cmp(const void *a, const void *b){
+    return lba_cmp(&((const Warm_Ref *) a)->lba,&((const Warm_Ref *) b)->lba);
 }
 
-/*  flush
- *  Flushes data to disk.
- *  Goes through entire B_Tree and writes anything that has changed.
- *  
+/*  read_sorted
+ *  Reads sectors with ascending lbas into consecutive sector buffers,
+ *  one jdisk_readv() for each run of consecutive lbas.
+ *
  *  @TREE is the B_Tree
+ *  @lbas are the sectors
+ *  @n is how many there are
+ *  @bufs gets n sectors
+ *  @rvs gets, for each sector, what the read of its run returned
  */
-void flush(B_Tree *TREE){
-    Tree_Node *t = TREE->free_list;
+void read_sorted(B_Tree *TREE, unsigned int *lbas, int n, unsigned char *bufs, int *rvs){
+    struct iovec iov;
+    int i, j, k, rv;
 
-    // go through all the nodes
-    while(t != NULL){
-        if(t->flush == 1){
+    for(i = 0; i < n; i = j){
+        for(j = i + 1; j < n && lbas[j] == lbas[j-1] + 1; j++) ;
+        iov.iov_base = bufs + (size_t) i * JDISK_SECTOR_SIZE;
+        iov.iov_len = (size_t) (j - i) * JDISK_SECTOR_SIZE;
+        rv = jdisk_readv(TREE->disk,lbas[i],&iov,1);
+        for(k = i; k < j; k++) rvs[k] = rv;
+    }
+}
+
+/*  warm_name
+ *  Returns the malloc()'d name of the tree's warm start manifest.
+ *
+ *  @TREE is the B_Tree
+ */
+char *warm_name(B_Tree *TREE){
+    char *name = malloc(strlen(TREE->filename) + strlen(WARM_SUFFIX) + 1);
 
-            // move the data to the bytes segment
-            t->bytes[0] = t->internal;
-            t->bytes[1] = t->nkeys;
-            memcpy((void *) t->bytes + (JDISK_SECTOR_SIZE - TREE->lbas_per_block * 4),t->lbas, TREE->lbas_per_block * 4);
+    strcpy(name,TREE->filename);
+    strcat(name,WARM_SUFFIX);
+    return name;
+}
 
-            // write the bytes to disk
-            jdisk_write(TREE->disk,t->lba,t->bytes);
-        }
-        t = t->ptr;
-    }
+/*  warm_save
+ *  Writes the lbas of every held node to the warm start manifest.
+ *  The cache never evicts, so that is every node this handle touched.
+ *
+ *  @TREE is the B_Tree
+ */
+void warm_save(B_Tree *TREE){
+    unsigned int *lbas, n;
+    Tree_Node *t;
+    char *name;
+    FILE *f;
+
+    n = 0;
+    lbas = malloc((size_t) TREE->nnodes * sizeof(unsigned int));
+    for(t = TREE->free_list; t != NULL; t = t->ptr) lbas[n++] = t->lba;
+    qsort(lbas,n,sizeof(unsigned int),lba_cmp);
 
-    // write the B_Tree info if needed
-    if(TREE->flush == 1){
-        jdisk_write(TREE->disk,0,TREE);
+    name = warm_name(TREE);
+    f = fopen(name,"w");
+    free(name);
+    if(f != NULL){
+        fwrite(WARM_MAGIC,1,8,f);
+        fwrite(&n,sizeof(unsigned int),1,f);
+        fwrite(lbas,sizeof(unsigned int),n,f);
+        fclose(f);
     }
+    free(lbas);
 }
 
-/*  split
- *  Splits a node into two.
- *  Will create a new node when necessary.
- *  Recurses up the tree and checks to see if 
- *  any other nodes need to be split.
+/*  warm_load
+ *  Reads the sectors listed in the warm start manifest, if there is one,
+ *  in ascending order, then holds the ones that are still reachable from
+ *  the root.  Anything the tree stopped using since the manifest was
+ *  written is ignored, so a stale manifest only costs the reads.
  *
  *  @TREE is the B_Tree
- *  @t is the node to split
  */
-void split(B_Tree *TREE,Tree_Node *t){
-    Tree_Node *parent, *sibling;
-    int middle, pindex, i, comp;
-    
-    // base case
-    if(t == NULL) return;
+void warm_load(B_Tree *TREE){
+    char magic[8];
+    unsigned int *lbas, *slot, n, i;
+    unsigned char *bufs;
+    Tree_Node **queue, *t;
+    int head, tail, j, bad, *rvs;
+    char *name;
+    FILE *f;
 
-    // don't need to split so go up
-    if(t->nkeys <= TREE->keys_per_block){
-        split(TREE,t->parent);
+    name = warm_name(TREE);
+    f = fopen(name,"r");
+    free(name);
+    if(f == NULL) return;
+
+    // check the header, then that the lbas are sorted and in the tree's range
+    if(fread(magic,1,8,f) != 8 || memcmp(magic,WARM_MAGIC,8) != 0
+       || fread(&n,sizeof(unsigned int),1,f) != 1 || n > TREE->first_free_block){
+        fclose(f);
+        return;
+    }
+    lbas = malloc((size_t) n * sizeof(unsigned int) + 1);
+    if(fread(lbas,sizeof(unsigned int),n,f) != n){
+        fclose(f);
+        free(lbas);
         return;
     }
+    fclose(f);
+    for(i = 0; i < n; i++){
+        if(lbas[i] >= TREE->first_free_block || (i > 0 && lbas[i] <= lbas[i-1])){
+            free(lbas);
+            return;
+        }
+    }
 
-    // we have no parent so have to create one
-    if(t->parent == NULL){
-        parent = t_node_setup(TREE,TREE->first_free_block,NULL,-1);
+    // one pass over the disk in lba order
+    bufs = aligned_alloc(JDISK_ALIGN,(size_t) n * JDISK_SECTOR_SIZE + JDISK_ALIGN);
+    rvs = malloc((size_t) n * sizeof(int) + 1);
+    read_sorted(TREE,lbas,n,bufs,rvs);
 
-        // set all lbas to 0
-        for(int i = 0; i < TREE->keys_per_block; i++) parent->lbas[i] = 0;
+    // hold whatever hangs off the root, breadth first
+    queue = malloc((size_t) (n + 1) * sizeof(Tree_Node *));
+    queue[0] = TREE->root;
+    head = 0;
+    tail = 1;
+    while(head < tail){
+        t = queue[head++];
+        if(!t->internal) continue;
+        for(j = 0; j <= t->nkeys; j++){
+            slot = bsearch(&t->lbas[j],lbas,n,sizeof(unsigned int),lba_cmp);
+            if(slot == NULL || node_lookup(TREE,*slot) != NULL) continue;
+            bad = node_check(TREE,*slot,bufs + (size_t) (slot - lbas) * JDISK_SECTOR_SIZE,rvs[slot - lbas]);
+            queue[tail] = t_node_install(TREE,*slot,bufs + (size_t) (slot - lbas) * JDISK_SECTOR_SIZE,t,j);
+            queue[tail++]->bad = (bad != 0);
+        }
+    }
 
-        // zero out the bytes (random stuff is not fun)
-        explicit_bzero(parent->bytes,JDISK_SECTOR_SIZE+256);
+    free(queue);
+    free(bufs);
+    free(rvs);
+    free(lbas);
+}
 
-        // set all the relationship stuff up + set the parent up
-        t->parent = parent;
-        TREE->root = parent;
-        TREE->first_free_block++;
-        parent->nkeys = 0;
-        parent->lbas[0] = t->lba;
-        t->parent_index = 0;
-        parent->internal = 1;
-        TREE->root_lba = parent->lba;
-    }
+/*  b_tree_preload
+ *  Reads the top levels of the tree into the node cache, level by level,
+ *  each level's sectors in ascending lba order with runs read together.  Held nodes are never
+ *  evicted, so they stay in memory until b_tree_detach().
+ *  Returns the number of nodes read.
+ *
+ *  @b_tree is the B_Tree
+ *  @levels is how many levels to hold, counting the root (0 = all)
+ *  @budget is how many bytes of nodes to read at most (0 = no limit)
+ */
+int b_tree_preload(void *b_tree, int levels, unsigned long budget){
+    B_Tree *TREE = b_tree;
+    unsigned char *bufs;
+    unsigned int *lbas;
+    Tree_Node **level, **next, *t;
+    Warm_Ref *refs;
+    int n, nrefs, nread, cut, depth, loaded, i, j, bad, *rvs;
 
-    // set local parent to t's parent and make sure to flush it to disk later
-    parent = t->parent;
-    parent->flush = 1;
+    wb_enter(TREE);
+    loaded = 0;
+    level = malloc(sizeof(Tree_Node *));
+    level[0] = TREE->root;
+    n = 1;
 
-    // find the middle of the node
-    middle = (TREE->keys_per_block/2);
+    for(depth = 1; n > 0 && (levels <= 0 || depth < levels); depth++){
 
-    // find where to put the middle key in the parent
-    pindex = 0;
-    for(i = 0; i < parent->nkeys; i++){
-        comp = memcmp(t->keys[middle],parent->keys[i],TREE->key_size);
-        if(comp < 0 && pindex == 0){
-            pindex = i;
-            break;
-        }else if(comp > 0 && i == parent->nkeys-1 && pindex == 0){
-            pindex = i+1;
+        // gather the next level's lbas and sort them
+        nrefs = 0;
+        for(i = 0; i < n; i++) if(level[i]->internal) nrefs += level[i]->nkeys + 1;
+        refs = malloc((size_t) nrefs * sizeof(Warm_Ref) + 1);
+        nrefs = 0;
+        for(i = 0; i < n; i++){
+            t = level[i];
+            if(!t->internal) continue;
+            for(j = 0; j <= t->nkeys; j++){
+                refs[nrefs].lba = t->lbas[j];
+                refs[nrefs].parent = t;
+                refs[nrefs].index = j;
+                nrefs++;
+            }
         }
-    }
-    t->parent_index = pindex;
-    
-    // move all the parent's keys over
-    for(i = parent->nkeys; i > t->parent_index; i--){
-        memcpy(parent->keys[i],parent->keys[i-1],TREE->key_size);
-    }
-    
-    // put the middle key into parent
-    memcpy(parent->keys[t->parent_index],t->keys[middle],TREE->key_size);
-
-    // move all of parents lbas, set the middle on, and increment the nkeys
-    for(i = parent->nkeys; i > t->parent_index; i--){
-        parent->lbas[i+1] = parent->lbas[i];
-    }
-    parent->nkeys++;
-    parent->lbas[t->parent_index] = t->lba;
+        qsort(refs,nrefs,sizeof(Warm_Ref),warm_ref_cmp);
 
-    // setup the sibling and set its values
-    sibling = t_node_setup(TREE,TREE->first_free_block,parent,t->parent_index+1);
-    TREE->first_free_block++;
-    sibling->nkeys = 0;
-    sibling->internal = t->internal;
-    sibling->flush = 1;
-    parent->lbas[t->parent_index+1] = sibling->lba;
+        // pick what fits in the budget and read it in runs
+        lbas = malloc((size_t) nrefs * sizeof(unsigned int) + 1);
+        nread = 0;
+        for(i = 0; i < nrefs; i++){
+            if(node_lookup(TREE,refs[i].lba) != NULL) continue;
+            if(budget != 0 && (unsigned long) (loaded + nread + 1) * TREE->node_size > budget) break;
+            lbas[nread++] = refs[i].lba;
+        }
+        cut = i;
+        bufs = aligned_alloc(JDISK_ALIGN,(size_t) nread * JDISK_SECTOR_SIZE + JDISK_ALIGN);
+        rvs = malloc((size_t) nread * sizeof(int) + 1);
+        read_sorted(TREE,lbas,nread,bufs,rvs);
 
-    // move all the stuff to the right of middle to the sibling
-    middle++;
-    for(i = middle; i < t->nkeys; i++){
-        memcpy(sibling->keys[i-middle],t->keys[i],TREE->key_size);
-        sibling->lbas[i-middle] = t->lbas[i];
-        sibling->nkeys++;
+        next = malloc((size_t) nrefs * sizeof(Tree_Node *) + 1);
+        n = 0;
+        nread = 0;
+        for(i = 0; i < cut; i++){
+            t = node_lookup(TREE,refs[i].lba);
+            if(t == NULL){
+                bad = node_check(TREE,refs[i].lba,bufs + (size_t) nread * JDISK_SECTOR_SIZE,rvs[nread]);
+                t = t_node_install(TREE,refs[i].lba,bufs + (size_t) nread++ * JDISK_SECTOR_SIZE,
+                                   refs[i].parent,refs[i].index);
+                t->bad = (bad != 0);
+            }
+            next[n++] = t;
+        }
+        loaded += nread;
+        free(bufs);
+        free(rvs);
+        free(lbas);
+        free(refs);
+        free(level);
+        level = next;
+        if(cut < nrefs) break;
     }
-    sibling->lbas[sibling->nkeys] = t->lbas[t->nkeys]; 
-
-    // set the number of keys for the node
-    t->nkeys = middle-1;
 
-    // recurse up to see if anything else needs to be split
-    split(TREE,parent);
+    free(level);
+    wb_leave(TREE);
+    return loaded;
 }
 
-/*  reset_flush
- *  Sets all nodes flush field to 0.
- *  
- *  @b is the B_Tree
+/*  b_tree_set_buffer
+ *  Buffers up to msgs inserts before they go into the tree, or takes
+ *  the buffer away when msgs is 0, putting everything in it into the tree.
+ *  A buffered insert writes only its record.  When the buffer fills,
+ *  the leaves with the most inserts waiting get them all in one write,
+ *  and one superblock write commits the batch.
+ *  b_tree_find() looks in the buffer first.  Buffered keys are not on
+ *  disk until their batch is committed; b_tree_detach() commits them all.
+ *  A buffered insert of a key the tree has gets a new record lba.
+ *  Returns 0, or -1 on a snapshot.
+ *
+ *  @b_tree is the B_Tree
+ *  @msgs is how many inserts to buffer (0 = none)
  */
-void reset_flush(B_Tree *b){
-    Tree_Node *t = b->free_list;
+int b_tree_set_buffer(void *b_tree, int msgs){
+    B_Tree *TREE = b_tree;
 
-    // set all flushes to 0
-    while(t != NULL){
-        t->flush = 0;
-        t= t->ptr;
+    if(TREE->snap_of != NULL) return -1;
+    if(msgs < 0) msgs = 0;
+
+    // what doesn't fit goes into the tree
+    wb_enter(TREE);
+    if(TREE->nmsgs > msgs) msg_flush(TREE,1);
+    TREE->msg_cap = msgs;
+    wb_leave(TREE);
+    if(msgs == 0){
+        free(TREE->msg_keys);
+        free(TREE->msg_lbas);
+        TREE->msg_keys = NULL;
+        TREE->msg_lbas = NULL;
+        return 0;
     }
-    b->flush = 0;
+    TREE->msg_keys = realloc(TREE->msg_keys,(size_t) msgs * TREE->key_size);
+    TREE->msg_lbas = realloc(TREE->msg_lbas,(size_t) msgs * sizeof(unsigned int));
+    return 0;
 }
 
-/*  b_tree_insert
- *  Inserts a key and record into a B_Tree.
+/*  b_tree_set_writeback
+ *  Turns write-back on, or off when max_dirty is 0.  With it on, inserts
+ *  leave the nodes and records they change in memory, and a flusher
+ *  thread writes them in checkpoints, each committed by one superblock
+ *  write.  A checkpoint starts when half of max_dirty sectors are
+ *  waiting, when interval_ms has gone by with anything waiting, and on
+ *  b_tree_checkpoint().  An insert only waits for the disk when all
+ *  max_dirty sectors are used and the last checkpoint is still being
+ *  written.  With copy-on-write, a crash loses only what came after the
+ *  last checkpoint that landed; without it, a crash while one is being
+ *  written can leave it half done, as a crash inside an insert can.
+ *  Turning it off, like b_tree_detach(), writes everything.  While it
+ *  is on, every call takes a lock the flusher shares, so don't insert
+ *  from a b_tree_traverse() function.
+ *  Returns 0, or -1 on a snapshot or if the thread can't be started.
  *
  *  @b_tree is the B_Tree
- *  @key is the insertion key
- *  @record is the data to insert
+ *  @max_dirty is how many sectors may wait for a checkpoint (0 = off)
+ *  @interval_ms is the longest anything waits for one (0 = no limit)
  */
-unsigned int b_tree_insert(void *b_tree, void *key, void *record){
-    // insert to the tree
-    unsigned int lba;
-    int i, index;
+int b_tree_set_writeback(void *b_tree, int max_dirty, int interval_ms){
     B_Tree *TREE = b_tree;
-    Tree_Node *t;
-    
-    // not enough room
-    if(TREE->first_free_block >= TREE->num_lbas) return 0;
+    pthread_mutexattr_t ma;
+    pthread_condattr_t ca;
 
-    reset_flush(TREE);
+    if(TREE->snap_of != NULL) return -1;
+    if(max_dirty < 0) max_dirty = 0;
+    if(interval_ms < 0) interval_ms = 0;
 
-    // find where the thing should go
-    lba = b_tree_find(b_tree,key);
+    // already on: change the policy, or stop the flusher once it has
+    // written everything
+    if(TREE->wb_max > 0){
+        pthread_mutex_lock(&TREE->wb_lock);
+        if(max_dirty > 0){
+            TREE->wb_max = max_dirty;
+            TREE->wb_interval = interval_ms * 1000000UL;
+        }else{
+            TREE->wb_quit = 1;
+        }
+        pthread_cond_signal(&TREE->wb_cond);
+        pthread_mutex_unlock(&TREE->wb_lock);
+        if(max_dirty > 0) return 0;
 
-    // if its already there then just replace the value
-    if(lba != 0){
-        jdisk_write(TREE->disk,lba,record);
-        return lba;
+        pthread_join(TREE->wb_thread,NULL);
+        TREE->wb_max = 0;
+        TREE->wb_quit = 0;
+        free(TREE->wb_recs);
+        TREE->wb_recs = NULL;
+        TREE->wb_recs_cap = 0;
+        pthread_mutex_destroy(&TREE->wb_lock);
+        pthread_cond_destroy(&TREE->wb_cond);
+        pthread_cond_destroy(&TREE->wb_room);
+        return 0;
     }
+    if(max_dirty == 0) return 0;
 
-    // get where it should go
-    t = TREE->tmp_e;
-    index = TREE->tmp_e_index;
+    // calls inside a traversal take the lock again, and the flusher's
+    // deadlines are on the monotonic clock
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_settype(&ma,PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&TREE->wb_lock,&ma);
+    pthread_mutexattr_destroy(&ma);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca,CLOCK_MONOTONIC);
+    pthread_cond_init(&TREE->wb_cond,&ca);
+    pthread_cond_init(&TREE->wb_room,&ca);
+    pthread_condattr_destroy(&ca);
 
-    if(t == NULL){
-        t = TREE->root;
-        index = 0;
+    TREE->wb_interval = interval_ms * 1000000UL;
+    TREE->wb_last = now_ns();
+    if(pthread_create(&TREE->wb_thread,NULL,wb_flusher,TREE) != 0){
+        pthread_mutex_destroy(&TREE->wb_lock);
+        pthread_cond_destroy(&TREE->wb_cond);
+        pthread_cond_destroy(&TREE->wb_room);
+        return -1;
     }
+    TREE->wb_max = max_dirty;
+    return 0;
+}
 
-    // move all the keys over and set the correct one
-    for(i = t->nkeys; i > index; i--) memcpy(t->keys[i],t->keys[i-1],TREE->key_size);
-    memcpy(t->keys[index],key,TREE->key_size);
-    t->nkeys += 1;
-    t->flush = 1;
+/*  b_tree_checkpoint
+ *  Returns once everything inserted so far, buffered inserts included,
+ *  is on disk.  With write-back off, only the buffer has to go in.
+ *  Returns 0, or -1 on a snapshot or if the tree has failed (see
+ *  b_tree_insert_size()).
+ *
+ *  @b_tree is the B_Tree
+ */
+int b_tree_checkpoint(void *b_tree){
+    B_Tree *TREE = b_tree;
+    unsigned long target;
 
-    // read in the data
-    lba = TREE->first_free_block;
-    jdisk_write(TREE->disk,lba,record);
-    TREE->first_free_block++;
-    TREE->flush = 1;
+    if(TREE->snap_of != NULL) return -1;
+    wb_enter(TREE);
+    msg_flush(TREE,1);
+    if(TREE->wb_max > 0){
 
-    // set all the lbas
-    for(i = t->nkeys; i > index; i--) t->lbas[i] = t->lbas[i-1];
-    t->lbas[index] = lba;
-    
-    // split if necessary
-    if(t->nkeys > TREE->keys_per_block){
-        split(TREE,t);
+        // it has to get into a batch, then that batch has to land
+        while(!TREE->failed && (wb_dirty(TREE) > 0 || TREE->flush)){
+            if(TREE->wb_batch == NULL){
+                wb_gather(TREE);
+            }else{
+                pthread_cond_wait(&TREE->wb_room,&TREE->wb_lock);
+            }
+        }
+        target = TREE->wb_gathered;
+        while(TREE->wb_done < target) pthread_cond_wait(&TREE->wb_room,&TREE->wb_lock);
     }
+    wb_leave(TREE);
+    return TREE->failed ? -1 : 0;
+}
 
-    // flush everything to disk that needs it
-    flush(TREE);
-    return lba;
+/*  b_tree_set_append
+ *  Tunes splits for keys that mostly arrive in increasing order.
+ *  With it on, a node on the right edge that fills up from an append
+ *  keeps all but one key on the left instead of splitting in half, so a
+ *  sequential load leaves nodes nearly full.  The new right nodes start
+ *  out below half full.
+ *  Returns 0, or -1 on a snapshot.
+ *
+ *  @b_tree is the B_Tree
+ *  @on is 1 to split unevenly on appends and 0 to always split in half
+ */
+int b_tree_set_append(void *b_tree, int on){
+    B_Tree *TREE = b_tree;
+
+    if(TREE->snap_of != NULL) return -1;
+    TREE->append = on;
+    return 0;
 }
 
-// returns the last lba in the node (used to get data lba of upper node)
-/*  get_last_lba
- *  Returns the last lba in a node.
- *  Recurses to find the node if you give it an internal node.
+/*  b_tree_set_trace
+ *  Starts logging every b_tree_find() and b_tree_insert() to a new trace
+ *  file, or stops when filename is NULL.  The format is in b_tree.h;
+ *  b_tree_replay plays it back.  Records aren't logged, only their sizes.
+ *  Returns 0, or -1 if the file can't be created or this is a snapshot.
+ *  Stopping returns -1 if any call couldn't be written to the trace,
+ *  since it would then replay differently.
  *
- *  @t is the node to find the lba of
- *  @TREE is the B_Tree
+ *  @b_tree is the B_Tree
+ *  @filename is the trace file (NULL = stop)
  */
-unsigned int get_last_lba(Tree_Node *t,B_Tree *TREE){
-    if(t->internal == 1){
-        return get_last_lba(t_node_setup(TREE,t->lbas[t->nkeys],t,t->nkeys),TREE);
+int b_tree_set_trace(void *b_tree, char *filename){
+    B_Tree *TREE = b_tree;
+    int rv;
+
+    rv = 0;
+    if(TREE->trace != NULL){
+        if(fclose(TREE->trace) != 0 || TREE->trace_errors > 0) rv = -1;
+        TREE->trace = NULL;
     }
-    return t->lbas[t->nkeys];
+    if(filename == NULL) return rv;
+    if(TREE->snap_of != NULL) return -1;
+
+    TREE->trace = fopen(filename,"w");
+    if(TREE->trace == NULL) return -1;
+    TREE->trace_errors = 0;
+    if(fwrite(B_TREE_TRACE_MAGIC,1,8,TREE->trace) != 8 || fwrite(&TREE->key_size,4,1,TREE->trace) != 1
+       || fwrite(&TREE->flags,4,1,TREE->trace) != 1){
+        TREE->trace_errors++;
+    }
+    TREE->trace_start = now_ns();
+    return 0;
 }
 
-/*  recusive_find
- *  Returns the lba associated with a key.
+/*  b_tree_set_manifest
+ *  Has b_tree_detach() write <jdisk file>.warm, the lbas of every node
+ *  this handle holds, so the next b_tree_attach() can read them back in
+ *  one sorted pass.  Returns 0, or -1 on a snapshot.
  *
- *  @TREE is the B_Tree
- *  @t is the current Tree_Node
- *  @key is the key
+ *  @b_tree is the B_Tree
+ *  @on is 1 to write the manifest and 0 not to
  */
-unsigned int recursive_find(B_Tree *TREE,Tree_Node *t, void *key){
-    int i, comp;
+int b_tree_set_manifest(void *b_tree, int on){
+    B_Tree *TREE = b_tree;
 
-    // loop through all the keys in the node
-    for(i = 0; i < t->nkeys; i++){
+    if(TREE->snap_of != NULL) return -1;
+    TREE->manifest = on;
+    return 0;
+}
 
-        // compare the key in this position with insertion key
-        comp = memcmp(key,t->keys[i],TREE->key_size);
+/*  b_tree_set_direct
+ *  Turns O_DIRECT on the tree's jdisk on or off.  With it on, sectors
+ *  skip the kernel's page cache, so a node the tree holds is in memory
+ *  once instead of twice, and nodes are read and written straight from
+ *  their frames, which are laid out aligned from then on.  Records and
+ *  anything else in an unaligned buffer take one copy through jdisk.
+ *  Reads that the node cache misses go to the device every time, so
+ *  it suits a tree whose nodes are held (b_tree_preload()).
+ *  Returns 0, or -1 on a snapshot or if the jdisk's file system can't
+ *  do direct I/O.
+ *
+ *  @b_tree is the B_Tree
+ *  @on is 1 for O_DIRECT and 0 for the page cache
+ */
+int b_tree_set_direct(void *b_tree, int on){
+    B_Tree *TREE = b_tree;
+    int rv;
 
-        if(t->internal == 1){
-            if(comp == 0){
-                // we found the key so get its lba
-                return get_last_lba(t_node_setup(TREE,t->lbas[i],t,i),TREE);
-            }else if(comp < 0){
-                // the key is to the left
-                return recursive_find(TREE,t_node_setup(TREE,t->lbas[i],t,i),key);;
-            }else if(comp > 0 && i == t->nkeys-1){
-                // the key is to the right (only at the end)
-                return recursive_find(TREE,t_node_setup(TREE,t->lbas[i+1],t,i+1),key);
-            }
-        }else{
-            if(comp == 0){
-                // this is the key so return its lba
-                return t->lbas[i];
-            }else if(comp < 0){
-                // it should be where this key is
-                TREE->tmp_e = t;
-                TREE->tmp_e_index = i;
-                return 0;
-            }else if(comp > 0 && i == t->nkeys-1){
-                // it should be after this key (always on the end)
-                TREE->tmp_e = t;
-                TREE->tmp_e_index = i+1;
-                return 0;
-            }
-        }
-    }
+    if(TREE->snap_of != NULL) return -1;
+    wb_enter(TREE);
+    rv = jdisk_set_direct(TREE->disk,on);
+    if(rv == 0) TREE->direct = on;
+    wb_leave(TREE);
+    return rv;
+}
 
-    return 0;
+/*  b_tree_bad_sectors
+ *  Returns how many sectors this handle found that failed their checksum
+ *  or couldn't be read.  Lookups under a bad node miss, traversals that
+ *  reach one return B_TREE_BAD_CHECKSUM, and once there is one, inserts
+ *  fail (return 0) so nothing is built on top of it.
+ *
+ *  @b_tree is the B_Tree
+ */
+long b_tree_bad_sectors(void *b_tree){
+    return ((B_Tree*) b_tree)->nbad;
 }
 
-/*  b_tree_find
- *  Returns the lba associated with key.
- *  Calls recursive_find.
- * 
+/*  b_tree_space_map
+ *  Fills in what each region of B_TREE_REGION_SECTORS sectors holds and
+ *  how much of it is used, for the first n regions of the jdisk, and
+ *  returns how many regions there are.  Without B_TREE_LOCALITY
+ *  everything below first_free_block is B_TREE_REGION_MIXED.  Freed
+ *  sectors waiting to be reused still count as used.  A snapshot
+ *  describes the tree it was taken of.
+ *
  *  @b_tree is the B_Tree
- *  @key is the key
+ *  @map gets the regions (room for n)
+ *  @n is how many to fill in
  */
-unsigned int b_tree_find(void *b_tree, void *key){
-    B_Tree *b = b_tree;
-    return recursive_find(b,b->root,key);
+long b_tree_space_map(void *b_tree, B_Tree_Region *map, long n){
+    B_Tree *TREE = b_tree;
+    unsigned long start;
+    long r, nregions;
+
+    if(TREE->snap_of != NULL) TREE = TREE->snap_of;
+    wb_enter(TREE);
+    nregions = (TREE->num_lbas + B_TREE_REGION_SECTORS - 1) / B_TREE_REGION_SECTORS;
+    for(r = 0; r < n && r < nregions; r++){
+        if(TREE->map != NULL){
+            map[r] = TREE->map[r];
+            continue;
+        }
+        start = (unsigned long) r * B_TREE_REGION_SECTORS;
+        map[r].kind = (start < TREE->first_free_block) ? B_TREE_REGION_MIXED : B_TREE_REGION_FREE;
+        map[r].used = (start >= TREE->first_free_block) ? 0
+                    : (TREE->first_free_block - start < B_TREE_REGION_SECTORS) ? TREE->first_free_block - start
+                    : B_TREE_REGION_SECTORS;
+    }
+    wb_leave(TREE);
+    return nregions;
 }
 
 /*  b_tree_disk
@@ -486,6 +4505,16 @@ int b_tree_key_size(void *b_tree){
     return ((B_Tree*) b_tree)->key_size;
 }
 
+/*  b_tree_flags
+ *  Returns the B_TREE_* flags, key type included, that a B_Tree
+ *  was created with.
+ *
+ *  @b_tree is the B_Tree
+ */
+int b_tree_flags(void *b_tree){
+    return ((B_Tree*) b_tree)->flags;
+}
+
 /*  print_node
  *  Prints a given node.
  *  Recurses to print all of its children.
@@ -499,7 +4528,7 @@ void print_node(Tree_Node *t, B_Tree *TREE){
     printf("LBA 0x%08x. Internal: %d\n",t->lba,t->internal);
     for(i = 0; i < t->nkeys+1; i++){
         if(i < t->nkeys){
-            printf("Entry %d: Key: %-20s LBA: 0x%08x\n",i,t->keys[i],t->lbas[i]);
+            printf("Entry %d: Key: %-20s LBA: 0x%08x\n",i,KEY(TREE,t,i),t->lbas[i]);
         }else{
             printf("Entry %d:                           LBA: 0x%08x\n",i,t->lbas[i]);
         }
@@ -522,7 +4551,7 @@ void b_tree_print_tree(void *b_tree){
 
     if(b->tmp_e != NULL) printf("0x%x  LBA: 0x%08x\n",b->tmp_e,b->tmp_e->lba);
     if(b->tmp_e != NULL) printf("%d\n",b->tmp_e_index);
-    if(b->tmp_e != NULL) printf("KEY: %s\n",b->tmp_e->keys[b->tmp_e_index]);
+    if(b->tmp_e != NULL) printf("KEY: %s\n",KEY(b,b->tmp_e,b->tmp_e_index));
     print_node(t,b);
 
     i = b->free_list;
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "b_tree.h"
+
+#define SCAN_MAX_THREADS (16)           /* Cold parallel scans run with 1, 2, 4 ... this many */
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_bench tree_file nkeys key_size rounds\n");
+  fprintf(stderr, "       tree_file must not exist.  It is created, filled and removed.\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+static int count_key(int part, void *key, unsigned int lba, void *arg)
+{
+  __atomic_fetch_add((long *) arg, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  void *t, *jd;
+  int nkeys, key_size, rounds, i, j, r, height;
+  unsigned char *keys;
+  unsigned char rec[JDISK_SECTOR_SIZE];
+  long reads, scanned;
+  unsigned long sum;
+  double start, elapsed, per_find;
+
+  if (argc != 5) usage(NULL);
+  if (sscanf(argv[2], "%d", &nkeys) != 1 || nkeys <= 0) usage("Bad nkeys");
+  if (sscanf(argv[3], "%d", &key_size) != 1 || key_size < 4 || key_size > 254) usage("Bad key_size");
+  if (sscanf(argv[4], "%d", &rounds) != 1 || rounds <= 0) usage("Bad rounds");
+
+  t = b_tree_create(argv[1], (long) JDISK_SECTOR_SIZE * (nkeys * 2 + 16), key_size);
+  if (t == NULL) { perror(argv[1]); exit(1); }
+
+  /* Random printable keys, zero padded like b_tree_test does. */
+
+  srand48(1);
+  keys = (unsigned char *) calloc(nkeys, key_size);
+  memset(rec, 0, JDISK_SECTOR_SIZE);
+  for (i = 0; i < nkeys; i++) {
+    for (j = 0; j < key_size - 1; j++) keys[i*key_size+j] = 'a' + lrand48() % 26;
+    sprintf((char *) rec, "%d", i);
+    b_tree_insert(t, keys + i*key_size, rec);
+  }
+  b_tree_detach(t);
+
+  /* A cold find after attaching reads one sector per level below the root. */
+
+  t = b_tree_attach(argv[1]);
+  jd = b_tree_disk(t);
+  reads = jdisk_reads(jd);
+  b_tree_find(t, keys);
+  height = jdisk_reads(jd) - reads + 1;
+
+  /* Warm the node cache, then time lookups that never touch the disk. */
+
+  for (i = 0; i < nkeys; i++) b_tree_find(t, keys + i*key_size);
+  reads = jdisk_reads(jd);
+
+  sum = 0;
+  start = now();
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < nkeys; i++) sum += b_tree_find(t, keys + i*key_size);
+  }
+  elapsed = now() - start;
+
+  if (jdisk_reads(jd) != reads) fprintf(stderr, "Warning: timed finds read from disk\n");
+
+  per_find = elapsed * 1e9 / ((double) rounds * nkeys);
+  printf("Keys: %d  Key_Size: %d  Height: %d  Checksum: %lu\n", nkeys, key_size, height, sum);
+  printf("Cached find: %.1f ns  (%.1f ns per level)\n", per_find, per_find / height);
+
+  b_tree_detach(t);
+
+  /* Full scans from a fresh attach, so every node below the root comes off the disk. */
+
+  for (i = 1; i <= SCAN_MAX_THREADS; i *= 2) {
+    t = b_tree_attach(argv[1]);
+    scanned = 0;
+    start = now();
+    b_tree_parallel_scan(t, i, count_key, &scanned);
+    elapsed = now() - start;
+    printf("Cold scan, %2d threads: %ld keys in %.3f s  (%.0f keys/s)\n", i, scanned, elapsed, scanned / elapsed);
+    b_tree_detach(t);
+  }
+
+  unlink(argv[1]);
+  free(keys);
+  exit(0);
+}
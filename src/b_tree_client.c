@@ -0,0 +1,325 @@
+//  B-Tree client
+//  Talks to b_tree_server over its Unix domain socket.  Batches are
+//  pipelined: up to B_TREE_SERVER_WINDOW requests go out in one write
+//  before any reply is read.
+
+#include <b_tree_server.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef struct {
+    int fd;                       /* The connection to the server */
+    int key_size;                 /* From the server's 'H' message */
+    unsigned int next_id;         /* id of the next request */
+    unsigned char *buf;           /* Requests waiting to be sent */
+    long len, cap;
+} B_Tree_Client;
+
+/*  write_all
+ *  Writes all n bytes of buf.  Returns 0, or -1 on error.
+ *
+ *  @fd is the socket
+ *  @buf is what to write
+ *  @n is how many bytes
+ */
+int write_all(int fd, void *buf, long n){
+    unsigned char *p = buf;
+    ssize_t rv;
+
+    while(n > 0){
+        rv = write(fd,p,n);
+        if(rv <= 0) return -1;
+        p += rv;
+        n -= rv;
+    }
+    return 0;
+}
+
+/*  read_all
+ *  Reads exactly n bytes into buf.  Returns 0, or -1 on error or if
+ *  the server hung up.
+ *
+ *  @fd is the socket
+ *  @buf gets the bytes
+ *  @n is how many bytes
+ */
+int read_all(int fd, void *buf, long n){
+    unsigned char *p = buf;
+    ssize_t rv;
+
+    while(n > 0){
+        rv = read(fd,p,n);
+        if(rv <= 0) return -1;
+        p += rv;
+        n -= rv;
+    }
+    return 0;
+}
+
+/*  add_request
+ *  Adds a request to the ones waiting to be sent.  Its payload is
+ *  a (a_len bytes) followed by b (b_len bytes).
+ *
+ *  @C is the B_Tree_Client
+ *  @op is the request
+ *  @a, @a_len, @b and @b_len are the payload
+ */
+void add_request(B_Tree_Client *C, int op, void *a, long a_len, void *b, long b_len){
+    B_Tree_Msg m;
+    long need;
+
+    need = C->len + sizeof(m) + a_len + b_len;
+    if(need > C->cap){
+        while(need > C->cap) C->cap = (C->cap == 0) ? 4096 : C->cap * 2;
+        C->buf = realloc(C->buf,C->cap);
+    }
+
+    memset(&m,0,sizeof(m));
+    m.op = op;
+    m.id = C->next_id++;
+    m.len = a_len + b_len;
+    memcpy(C->buf + C->len,&m,sizeof(m));
+    C->len += sizeof(m);
+    memcpy(C->buf + C->len,a,a_len);
+    C->len += a_len;
+    if(b_len > 0) memcpy(C->buf + C->len,b,b_len);
+    C->len += b_len;
+}
+
+/*  send_requests
+ *  Sends every waiting request in one write.  Returns 0, or -1 on error.
+ *
+ *  @C is the B_Tree_Client
+ */
+int send_requests(B_Tree_Client *C){
+    int rv;
+
+    rv = write_all(C->fd,C->buf,C->len);
+    C->len = 0;
+    return rv;
+}
+
+/*  read_reply
+ *  Reads the next reply, which must be op's, into buf.
+ *  Returns its length, or -1 on error or if it doesn't fit in cap bytes.
+ *
+ *  @C is the B_Tree_Client
+ *  @op is the request it answers
+ *  @buf gets the payload
+ *  @cap is the size of buf
+ */
+long read_reply(B_Tree_Client *C, int op, void *buf, long cap){
+    B_Tree_Msg m;
+
+    if(read_all(C->fd,&m,sizeof(m)) != 0) return -1;
+    if(m.op != op || m.len > cap) return -1;
+    if(read_all(C->fd,buf,m.len) != 0) return -1;
+    return m.len;
+}
+
+/*  b_tree_client_connect
+ *  Returns a handle to a connection to the b_tree_server listening
+ *  on socket_path, or NULL on failure.
+ *
+ *  @socket_path is the server's socket
+ */
+void *b_tree_client_connect(char *socket_path){
+    B_Tree_Client *C;
+    struct sockaddr_un addr;
+    int fd;
+
+    if(strlen(socket_path) >= sizeof(addr.sun_path)) return NULL;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,socket_path);
+
+    fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if(fd < 0) return NULL;
+    if(connect(fd,(struct sockaddr *) &addr,sizeof(addr)) != 0){
+        close(fd);
+        return NULL;
+    }
+
+    C = calloc(1,sizeof(B_Tree_Client));
+    C->fd = fd;
+    if(read_reply(C,'H',&C->key_size,4) != 4){
+        b_tree_client_close(C);
+        return NULL;
+    }
+    return C;
+}
+
+/*  b_tree_client_close
+ *  Closes the connection and frees the handle.
+ *  Returns 0 on success and -1 if the socket couldn't be closed.
+ *
+ *  @c is the connection
+ */
+int b_tree_client_close(void *c){
+    B_Tree_Client *C = c;
+    int rv;
+
+    rv = close(C->fd);
+    free(C->buf);
+    free(C);
+    return (rv == 0) ? 0 : -1;
+}
+
+/*  b_tree_client_key_size
+ *  Returns the key size of the server's tree.
+ *
+ *  @c is the connection
+ */
+int b_tree_client_key_size(void *c){
+    return ((B_Tree_Client *) c)->key_size;
+}
+
+/*  b_tree_client_find_batch
+ *  Looks up n keys, pipelining the requests.
+ *  Returns 0, or -1 if the connection failed.
+ *
+ *  @c is the connection
+ *  @n is the number of keys
+ *  @keys holds them, key_size bytes apart
+ *  @lbas gets what b_tree_find() returned for each
+ */
+int b_tree_client_find_batch(void *c, int n, void *keys, unsigned int *lbas){
+    B_Tree_Client *C = c;
+    unsigned char *k = keys;
+    int i, j, w;
+
+    for(i = 0; i < n; i += w){
+        w = (n - i < B_TREE_SERVER_WINDOW) ? n - i : B_TREE_SERVER_WINDOW;
+        for(j = 0; j < w; j++) add_request(C,'F',k + (long) (i+j) * C->key_size,C->key_size,NULL,0);
+        if(send_requests(C) != 0) return -1;
+        for(j = 0; j < w; j++){
+            if(read_reply(C,'F',&lbas[i+j],4) != 4) return -1;
+        }
+    }
+    return 0;
+}
+
+/*  b_tree_client_insert_batch
+ *  Inserts n keys with sector-sized records, pipelining the requests.
+ *  Returns 0, or -1 if the connection failed.
+ *
+ *  @c is the connection
+ *  @n is the number of keys
+ *  @keys holds them, key_size bytes apart
+ *  @records holds their records, JDISK_SECTOR_SIZE bytes apart
+ *  @lbas gets what b_tree_insert() returned for each
+ */
+int b_tree_client_insert_batch(void *c, int n, void *keys, void *records, unsigned int *lbas){
+    B_Tree_Client *C = c;
+    unsigned char *k = keys;
+    unsigned char *r = records;
+    int i, j, w;
+
+    for(i = 0; i < n; i += w){
+        w = (n - i < B_TREE_SERVER_WINDOW) ? n - i : B_TREE_SERVER_WINDOW;
+        for(j = 0; j < w; j++){
+            add_request(C,'I',k + (long) (i+j) * C->key_size,C->key_size,
+                        r + (long) (i+j) * JDISK_SECTOR_SIZE,JDISK_SECTOR_SIZE);
+        }
+        if(send_requests(C) != 0) return -1;
+        for(j = 0; j < w; j++){
+            if(read_reply(C,'I',&lbas[i+j],4) != 4) return -1;
+        }
+    }
+    return 0;
+}
+
+/*  b_tree_client_find
+ *  Returns what b_tree_find() on the server returns for key,
+ *  or 0 if the connection failed.
+ *
+ *  @c is the connection
+ *  @key is the key
+ */
+unsigned int b_tree_client_find(void *c, void *key){
+    unsigned int lba;
+
+    if(b_tree_client_find_batch(c,1,key,&lba) != 0) return 0;
+    return lba;
+}
+
+/*  b_tree_client_insert
+ *  Inserts a key and a record of size bytes, like b_tree_insert_size().
+ *  Returns the record's lba, or 0 on failure.
+ *
+ *  @c is the connection
+ *  @key is the key
+ *  @record is the record
+ *  @size is its length in bytes
+ */
+unsigned int b_tree_client_insert(void *c, void *key, void *record, int size){
+    B_Tree_Client *C = c;
+    unsigned int lba;
+
+    if(size <= 0 || size > B_TREE_MAX_RECORD) return 0;
+    add_request(C,'I',key,C->key_size,record,size);
+    if(send_requests(C) != 0) return 0;
+    if(read_reply(C,'I',&lba,4) != 4) return 0;
+    return lba;
+}
+
+/*  b_tree_client_read_record
+ *  Reads the record at lba from the server.
+ *  Returns its size in bytes, or -1 if it can't be read.
+ *
+ *  @c is the connection
+ *  @lba is the record's lba
+ *  @record gets the record (room for B_TREE_MAX_RECORD bytes is always enough)
+ */
+int b_tree_client_read_record(void *c, unsigned int lba, void *record){
+    B_Tree_Client *C = c;
+    long len;
+
+    add_request(C,'R',&lba,4,NULL,0);
+    if(send_requests(C) != 0) return -1;
+    len = read_reply(C,'R',record,B_TREE_MAX_RECORD);
+    return (len > 0) ? len : -1;
+}
+
+/*  b_tree_client_scan
+ *  Gets the keys from the first one that isn't less than lo, in order,
+ *  with their record lbas.  To go on, scan again from the last key
+ *  returned and skip it.
+ *  Returns how many it got (0 at the end), or -1 if the connection failed.
+ *
+ *  @c is the connection
+ *  @lo is the first key to get (NULL = from the first)
+ *  @max is the most keys to get (at most B_TREE_SERVER_SCAN_MAX are)
+ *  @keys gets them, key_size bytes apart
+ *  @lbas gets their lbas
+ */
+int b_tree_client_scan(void *c, void *lo, int max, void *keys, unsigned int *lbas){
+    B_Tree_Client *C = c;
+    unsigned char *buf, *k = keys;
+    long len;
+    int i, pair;
+
+    if(max > B_TREE_SERVER_SCAN_MAX) max = B_TREE_SERVER_SCAN_MAX;
+    if(max <= 0) return 0;
+    pair = C->key_size + 4;
+
+    add_request(C,'S',&max,4,lo,(lo == NULL) ? 0 : C->key_size);
+    if(send_requests(C) != 0) return -1;
+    buf = malloc((long) max * pair);
+    len = read_reply(C,'S',buf,(long) max * pair);
+    if(len < 0 || len % pair != 0){
+        free(buf);
+        return -1;
+    }
+
+    for(i = 0; i < len / pair; i++){
+        memcpy(k + (long) i * C->key_size,buf + (long) i * pair,C->key_size);
+        memcpy(&lbas[i],buf + (long) i * pair + C->key_size,4);
+    }
+    free(buf);
+    return len / pair;
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "b_tree_server.h"
+
+#define BUFSIZE 4000
+
+/* Takes the same lines as b_tree_test, plus 'T' to list the tree, and
+   sends them to a b_tree_server.  A run of finds or of inserts goes out
+   as one pipelined batch. */
+
+typedef struct {
+  char op;                      /* 'I' or 'F' for the lines in the batch, 0 if empty */
+  int n;
+  unsigned char keys[B_TREE_SERVER_WINDOW * 256];
+  unsigned char records[B_TREE_SERVER_WINDOW * JDISK_SECTOR_SIZE];
+  unsigned int lbas[B_TREE_SERVER_WINDOW];
+} Batch;
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_client_test socket_path\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+void send_batch(void *c, Batch *b)
+{
+  int i, rv;
+
+  if (b->n == 0) return;
+  if (b->op == 'I') {
+    rv = b_tree_client_insert_batch(c, b->n, b->keys, b->records, b->lbas);
+  } else {
+    rv = b_tree_client_find_batch(c, b->n, b->keys, b->lbas);
+  }
+  if (rv != 0) {
+    fprintf(stderr, "Lost the connection to the server\n");
+    exit(1);
+  }
+  for (i = 0; i < b->n; i++) {
+    if (b->op == 'I') {
+      printf("Insert return value: %u\n", b->lbas[i]);
+    } else {
+      printf("Find return value: %d\n", b->lbas[i]);
+    }
+  }
+  b->n = 0;
+}
+
+void list_tree(void *c, int key_size)
+{
+  unsigned char keys[B_TREE_SERVER_SCAN_MAX * 256];
+  unsigned char lo[256];
+  unsigned int lbas[B_TREE_SERVER_SCAN_MAX];
+  int n, i, first;
+
+  // each scan starts with the last key of the one before
+  n = b_tree_client_scan(c, NULL, B_TREE_SERVER_SCAN_MAX, keys, lbas);
+  first = 0;
+  while (n > first) {
+    for (i = first; i < n; i++) printf("%-30s LBA: %u\n", (char *) keys + i * key_size, lbas[i]);
+    memcpy(lo, keys + (n - 1) * key_size, key_size);
+    n = b_tree_client_scan(c, lo, B_TREE_SERVER_SCAN_MAX, keys, lbas);
+    first = 1;
+  }
+  if (n < 0) fprintf(stderr, "Lost the connection to the server\n");
+}
+
+int main(int argc, char **argv)
+{
+  void *c;
+  int key_size, m, i;
+  char line[BUFSIZE];
+  char fi[BUFSIZE];
+  char key[BUFSIZE];
+  char val[BUFSIZE];
+  Batch *b;
+
+  if (argc != 2) usage(NULL);
+  c = b_tree_client_connect(argv[1]);
+  if (c == NULL) {
+    fprintf(stderr, "Couldn't connect to %s.  Calling perror().\n", argv[1]);
+    perror(argv[1]);
+    exit(1);
+  }
+  key_size = b_tree_client_key_size(c);
+  printf("Connected to %s.  KS: %d\n", argv[1], key_size);
+
+  b = malloc(sizeof(Batch));
+  b->n = 0;
+  while (fgets((char *) line, BUFSIZE, stdin) != NULL) {
+    m = sscanf(line, "%s %s %s", fi, key, val);
+    if (m <= 0) {
+    } else if ((m == 1 && strcmp(fi, "T") != 0)
+                      || (m == 2 && strcmp(fi, "F") != 0)
+                      || (m == 3 && strcmp(fi, "I") != 0)) {
+      send_batch(c, b);
+      printf("Line must be 'I key val', 'F key' or 'T'\n");
+    } else if (strcmp(fi, "T") == 0) {
+      send_batch(c, b);
+      list_tree(c, key_size);
+    } else if (strlen(key) > key_size) {
+      send_batch(c, b);
+      printf("Key too big\n");
+    } else if (m == 3 && strlen(val) > JDISK_SECTOR_SIZE) {
+      send_batch(c, b);
+      printf("Val too big\n");
+    } else {
+      if (b->n == B_TREE_SERVER_WINDOW || (b->n > 0 && b->op != fi[0])) send_batch(c, b);
+      b->op = fi[0];
+      for (i = strlen(key); i < key_size; i++) key[i] = '\0';
+      memcpy(b->keys + b->n * key_size, key, key_size);
+      if (m == 3) {
+        for (i = strlen(val); i < JDISK_SECTOR_SIZE; i++) val[i] = '\0';
+        memcpy(b->records + b->n * JDISK_SECTOR_SIZE, val, JDISK_SECTOR_SIZE);
+      }
+      b->n++;
+    }
+  }
+  send_batch(c, b);
+
+  free(b);
+  b_tree_client_close(c);
+  exit(0);
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "b_tree_static.h"
+
+/* Exports a jdisk tree to a static file, then checks every key and record
+   of the copy against the tree and compares what lookups cost in each. */
+
+#define SAMPLE 200                      /* Cold lookups to count the live tree's reads on */
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_export jdisk_file static_file\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long file_size(char *fn)
+{
+  struct stat st;
+
+  return (stat(fn, &st) == 0) ? st.st_size : -1;
+}
+
+int main(int argc, char **argv)
+{
+  void *t, *st, *jd;
+  unsigned char *rec, *srec;
+  unsigned int lba;
+  long n, i, bad, step, reads, r0;
+  int size, samples;
+  double t0, live_ns, static_ns;
+
+  if (argc != 3) usage(NULL);
+
+  t = b_tree_attach(argv[1]);
+  if (t == NULL) {
+    fprintf(stderr, "Couldn't attach to %s.  Calling perror().\n", argv[1]);
+    perror(argv[1]);
+    exit(1);
+  }
+  if (b_tree_export(t, argv[2]) != 0) {
+    fprintf(stderr, "Couldn't export to %s -- calling perror()\n", argv[2]);
+    perror(argv[2]);
+    exit(1);
+  }
+  st = b_tree_static_open(argv[2]);
+  if (st == NULL) usage("Couldn't open the static file just written");
+  n = b_tree_static_count(st);
+
+  // every key in the copy finds itself, and the same record as the tree
+  rec = malloc(B_TREE_MAX_RECORD);
+  bad = 0;
+  for (i = 0; i < n; i++) {
+    lba = b_tree_find(t, b_tree_static_key(st, i));
+    srec = b_tree_static_record(st, b_tree_static_find(st, b_tree_static_key(st, i)), &size);
+    if (lba == 0 || srec == NULL || size != b_tree_record_size(t, lba) ||
+        b_tree_read_record(t, lba, rec) != 0 || memcmp(rec, srec, size) != 0) bad++;
+  }
+
+  // warm lookups, with every node of the tree already cached
+  t0 = now();
+  for (i = 0; i < n; i++) b_tree_find(t, b_tree_static_key(st, i));
+  live_ns = (n > 0) ? (now() - t0) / n * 1e9 : 0;
+  t0 = now();
+  for (i = 0; i < n; i++) b_tree_static_find(st, b_tree_static_key(st, i));
+  static_ns = (n > 0) ? (now() - t0) / n * 1e9 : 0;
+  b_tree_detach(t);
+
+  // cold lookups: a fresh attach reads the root, then one sector per level
+  reads = 0;
+  samples = 0;
+  step = (n > SAMPLE) ? n / SAMPLE : 1;
+  for (i = 0; i < n; i += step) {
+    t = b_tree_attach(argv[1]);
+    jd = b_tree_disk(t);
+    r0 = jdisk_reads(jd);
+    b_tree_find(t, b_tree_static_key(st, i));
+    reads += jdisk_reads(jd) - r0 + 1;
+    samples++;
+    b_tree_detach(t);
+  }
+
+  printf("Keys: %ld  Mismatches: %ld\n", n, bad);
+  printf("Size: jdisk %ld bytes, static %ld bytes\n", file_size(argv[1]), file_size(argv[2]));
+  printf("Blocks per cold lookup: live %.2f, static %d\n",
+         (samples > 0) ? (double) reads / samples : 0.0, b_tree_static_levels(st));
+  printf("Warm lookup: live %.0f ns, static %.0f ns\n", live_ns, static_ns);
+
+  free(rec);
+  b_tree_static_close(st);
+  exit(bad == 0 ? 0 : 1);
+}
@@ -0,0 +1,630 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "b_tree.h"
+
+/* Runs the tree through combinations of creation flags and setters, and
+   through disks that fill up, checking every acknowledged insert against
+   an in-memory model before and after a reattach.  Prints one line per
+   case and exits with 1 if any case fails. */
+
+typedef struct {
+  char *name;
+  int flags;                    /* For b_tree_create_flags() */
+  int key_size;
+  long sectors;                 /* jdisk size, or 0 for plenty */
+  int nkeys;                    /* Inserts to try, or 0 for the command line's */
+  int seq;                      /* New keys come in increasing order */
+  int cow;
+  int snap;                     /* Take a snapshot every snap inserts (needs cow) */
+  int reader;                   /* A thread reads through each snapshot while inserts go on */
+  int append;
+  int buffer;                   /* b_tree_set_buffer() */
+  int writeback;                /* b_tree_set_writeback() max_dirty */
+  int hot;                      /* b_tree_set_hot_cache() */
+  int manifest;
+  int direct;
+  long grow;                    /* b_tree_set_grow() extent in sectors */
+  int full;                     /* The disk is meant to fill up */
+  int damage;                   /* Overwrite a leaf before the reattach (needs checksums and locality) */
+  int trace;                    /* Trace the live handle, then replay it on a new tree (not with compression) */
+} Case;
+
+#define SMALL (2000)            /* Sectors in a disk that fills up */
+
+Case cases[] = {
+  /* name                        flags                                                             ks   sectors n      seq cow snap rd app buf  wb  hot  man dir grow full dmg tr */
+  { "plain",                     0,                                                                16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "compress",                  B_TREE_COMPRESS,                                                  16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "bloom",                     B_TREE_BLOOM,                                                     16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "extents",                   B_TREE_EXTENTS,                                                   16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "counts",                    B_TREE_COUNTS,                                                    16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "checksum",                  B_TREE_CHECKSUM,                                                  16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "locality",                  B_TREE_LOCALITY,                                                  16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "u64 keys",                  B_TREE_KEY_U64 | B_TREE_COUNTS,                                   8,   0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "i64 keys",                  B_TREE_KEY_I64,                                                   8,   0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "custom keys",               B_TREE_KEY_CUSTOM | B_TREE_COUNTS,                                16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "compress bloom counts crc", B_TREE_COMPRESS | B_TREE_BLOOM | B_TREE_COUNTS | B_TREE_CHECKSUM, 16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "extents counts crc",        B_TREE_EXTENTS | B_TREE_COUNTS | B_TREE_CHECKSUM,                 16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "big keys counts",           B_TREE_COUNTS,                                                    200, 0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "cow snapshots",             0,                                                                16,  0,      0,     0,  1,  50,  0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "cow snapshots crc",         B_TREE_CHECKSUM | B_TREE_BLOOM,                                   16,  0,      0,     0,  1,  50,  0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "cow reader compress crc",   B_TREE_COMPRESS | B_TREE_CHECKSUM,                                16,  0,      0,     0,  1,  7,   1, 0,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "append seq",                0,                                                                16,  0,      0,     1,  0,  0,   0, 1,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "append seq counts",         B_TREE_COUNTS,                                                    200, 0,      0,     1,  0,  0,   0, 1,  0,   0,  0,   0,  0,  0,   0,   0,  0 },
+  { "buffer",                    0,                                                                16,  0,      0,     0,  0,  0,   0, 0,  500, 0,  0,   0,  0,  0,   0,   0,  0 },
+  { "buffer compress bloom",     B_TREE_COMPRESS | B_TREE_BLOOM,                                   16,  0,      0,     0,  0,  0,   0, 0,  500, 0,  0,   0,  0,  0,   0,   0,  0 },
+  { "buffer cow counts",         B_TREE_COUNTS,                                                    16,  0,      0,     0,  1,  0,   0, 0,  500, 0,  0,   0,  0,  0,   0,   0,  0 },
+  { "buffer extents",            B_TREE_EXTENTS,                                                   16,  0,      0,     0,  0,  0,   0, 0,  300, 0,  0,   0,  0,  0,   0,   0,  0 },
+  { "writeback",                 0,                                                                16,  0,      0,     0,  0,  0,   0, 0,  0,   64, 0,   0,  0,  0,   0,   0,  0 },
+  { "writeback cow crc",         B_TREE_CHECKSUM,                                                  16,  0,      0,     0,  1,  0,   0, 0,  0,   64, 0,   0,  0,  0,   0,   0,  0 },
+  { "writeback cow snapshots",   0,                                                                16,  0,      0,     0,  1,  100, 0, 0,  0,   64, 0,   0,  0,  0,   0,   0,  0 },
+  { "locality cow buffer",       B_TREE_LOCALITY,                                                  16,  0,      0,     0,  1,  0,   0, 0,  500, 0,  0,   0,  0,  0,   0,   0,  0 },
+  { "hot append extents",        B_TREE_EXTENTS,                                                   16,  0,      0,     1,  0,  0,   0, 1,  0,   0,  256, 0,  0,  0,   0,   0,  0 },
+  { "manifest direct",           B_TREE_BLOOM,                                                     16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   1,  1,  0,   0,   0,  0 },
+  { "direct writeback cow",      B_TREE_CHECKSUM,                                                  16,  0,      0,     0,  1,  0,   0, 0,  0,   64, 0,   0,  1,  0,   0,   0,  0 },
+  { "grow",                      0,                                                                16,  300,    0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  64,  0,   0,  0 },
+  { "grow cow extents",          B_TREE_EXTENTS,                                                   16,  300,    0,     0,  1,  0,   0, 0,  0,   0,  0,   0,  0,  256, 0,   0,  0 },
+
+  { "trace replay",              B_TREE_BLOOM | B_TREE_COUNTS,                                     16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   0,  1 },
+  { "damaged leaf",              B_TREE_CHECKSUM | B_TREE_LOCALITY | B_TREE_COUNTS,                16,  0,      0,     0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   0,   1,  0 },
+
+  { "full plain",                0,                                                                16,  SMALL,  4000,  0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   1,   0,  0 },
+  { "full cow snapshots",        0,                                                                16,  SMALL,  4000,  0,  1,  50,  0, 0,  0,   0,  0,   0,  0,  0,   1,   0,  0 },
+  { "full cow counts",           B_TREE_COUNTS,                                                    16,  SMALL,  4000,  0,  1,  0,   0, 0,  0,   0,  0,   0,  0,  0,   1,   0,  0 },
+  { "full compress bloom",       B_TREE_COMPRESS | B_TREE_BLOOM,                                   16,  SMALL,  8000,  0,  0,  0,   0, 0,  0,   0,  0,   0,  0,  0,   1,   0,  0 },
+  { "full extents cow",          B_TREE_EXTENTS,                                                   16,  SMALL,  4000,  0,  1,  0,   0, 0,  0,   0,  0,   0,  0,  0,   1,   0,  0 },
+  { "full buffer",               0,                                                                16,  SMALL,  4000,  0,  0,  0,   0, 0,  500, 0,  0,   0,  0,  0,   1,   0,  0 },
+  { "full buffer cow",           B_TREE_CHECKSUM,                                                  16,  SMALL,  4000,  0,  1,  0,   0, 0,  500, 0,  0,   0,  0,  0,   1,   0,  0 },
+  { "full writeback cow",        0,                                                                16,  SMALL,  4000,  0,  1,  0,   0, 0,  0,   64, 0,   0,  0,  0,   1,   0,  0 },
+  { "full append seq",           0,                                                                16,  SMALL,  4000,  1,  0,  0,   0, 1,  0,   0,  0,   0,  0,  0,   1,   0,  0 },
+  { "full locality cow",         B_TREE_LOCALITY,                                                  16,  SMALL,  4000,  0,  1,  0,   0, 0,  0,   0,  0,   0,  0,  0,   1,   0,  0 },
+  { "full crc grow cap",         B_TREE_CHECKSUM,                                                  16,  SMALL,  12000, 0,  1,  0,   0, 0,  0,   0,  0,   0,  0,  500, 1,   0,  0 },
+
+
+
+
+
+
+};
+
+/* The model: every key tried, the version of its record that the tree
+   should hold, and that record's size.  A version of 0 means the key
+   was never acknowledged. */
+
+int KS;
+int TYPE;
+int NK;
+unsigned char *Keys;
+int *Ver;
+int *Size;
+int *Order;                     /* Acknowledged keys, sorted */
+int NOrder;
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_flag_test tree_file [nkeys]\n");
+  fprintf(stderr, "       tree_file must not exist.  It is created and removed for each case.\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+int reverse_compare(void *a, void *b, int key_size)
+{
+  return memcmp(b, a, key_size);
+}
+
+int key_compare(void *a, void *b)
+{
+  unsigned long x, y;
+  long i, j;
+
+  switch (TYPE) {
+    case B_TREE_KEY_U64:
+      memcpy(&x, a, 8); memcpy(&y, b, 8);
+      return (x > y) - (x < y);
+    case B_TREE_KEY_I64:
+      memcpy(&i, a, 8); memcpy(&j, b, 8);
+      return (i > j) - (i < j);
+    case B_TREE_KEY_CUSTOM:
+      return reverse_compare(a, b, KS);
+    default:
+      return memcmp(a, b, KS);
+  }
+}
+
+int order_compare(const void *a, const void *b)
+{
+  return key_compare(Keys + (long) *(int *) a * KS, Keys + (long) *(int *) b * KS);
+}
+
+/* Makes the key for model entry i.  Sequential keys are a counter. */
+
+void make_key(Case *c, int i)
+{
+  unsigned char *k;
+  unsigned long u;
+  int j;
+
+  k = Keys + (long) i * KS;
+  memset(k, 0, KS);
+  if (c->seq && TYPE == B_TREE_KEY_BYTES) {
+    sprintf((char *) k, "%0*d", KS - 1, i);
+  } else if (c->seq || TYPE == B_TREE_KEY_U64 || TYPE == B_TREE_KEY_I64) {
+    u = (c->seq) ? (unsigned long) i * 7 : ((unsigned long) lrand48() << 31) ^ lrand48();
+    memcpy(k, &u, 8);
+  } else {
+    for (j = 0; j < KS - 1; j++) k[j] = 'a' + lrand48() % 26;
+  }
+}
+
+/* Record sizes and contents follow from the key's index and version,
+   so they can be rebuilt to check what the tree returns.  About half
+   of every fourth record is random, and a sixteenth of the others, so
+   compression has something to do and packed sectors hold several
+   records.  Reads come back in whole sectors, padded with zeros. */
+
+int record_size(Case *c, int i, int v)
+{
+  unsigned int s;
+
+  if (!(c->flags & B_TREE_EXTENTS)) return JDISK_SECTOR_SIZE;
+  s = (unsigned int) i * 7919 + v * 104729;
+  if (s % 16 == 0) return 1 + s % B_TREE_MAX_RECORD;
+  return 1 + s % (2 * JDISK_SECTOR_SIZE);
+}
+
+void make_record(unsigned char *rec, int i, int v, int size)
+{
+  unsigned int s;
+  int j, n;
+
+  memset(rec, 0, size);
+  s = (unsigned int) i * 2654435761u + v;
+  n = (i % 4 == 0) ? size / 2 : size / 16;
+  for (j = 0; j < n; j++) {
+    s = s * 1103515245 + 12345;
+    rec[j] = s >> 16;
+  }
+  if (size >= 8) {
+    memcpy(rec, &i, 4);
+    memcpy(rec + 4, &v, 4);
+  }
+}
+
+int count_key(void *key, unsigned int lba, void *arg)
+{
+  (*(long *) arg)++;
+  return 0;
+}
+
+typedef struct {
+  unsigned char *prev;
+  long n, unordered;
+} Walk;
+
+int walk_key(void *key, unsigned int lba, void *arg)
+{
+  Walk *w;
+
+  w = (Walk *) arg;
+  if (w->n > 0 && key_compare(w->prev, key) >= 0) w->unordered++;
+  memcpy(w->prev, key, KS);
+  w->n++;
+  return 0;
+}
+
+/* A reader thread on a snapshot.  It finds and reads one key over and
+   over until told to stop, counting reads that don't give the record
+   the key had when the snapshot was taken. */
+
+typedef struct {
+  void *snap;
+  int k, v, size;
+  volatile int stop;
+  long reads, bad;
+  pthread_t tid;
+} Reader;
+
+void *snap_reader(void *arg)
+{
+  Reader *r;
+  unsigned char *rec, *want;
+  unsigned int lba;
+  int padded;
+
+  r = (Reader *) arg;
+  rec = (unsigned char *) malloc(B_TREE_MAX_RECORD);
+  want = (unsigned char *) malloc(B_TREE_MAX_RECORD);
+  padded = (r->size + JDISK_SECTOR_SIZE - 1) / JDISK_SECTOR_SIZE * JDISK_SECTOR_SIZE;
+  memset(want, 0, padded);
+  make_record(want, r->k, r->v, r->size);
+  while (!r->stop) {
+    lba = b_tree_find(r->snap, Keys + (long) r->k * KS);
+    if (lba == 0 || b_tree_read_record(r->snap, lba, rec) != 0 ||
+        memcmp(rec, want, padded) != 0) r->bad++;
+    r->reads++;
+  }
+  free(rec);
+  free(want);
+  return NULL;
+}
+
+/* Returns how many acknowledged keys the tree gets wrong: missing,
+   the wrong record, out of order in a traversal, or with the wrong
+   rank or select on a counted tree. */
+
+long check_tree(void *t, Case *c)
+{
+  unsigned char *rec, *want, *key;
+  unsigned int lba;
+  long bad, i, r;
+  int k, size, padded;
+  Walk w;
+
+  rec = (unsigned char *) malloc(B_TREE_MAX_RECORD);
+  want = (unsigned char *) malloc(B_TREE_MAX_RECORD);
+  key = (unsigned char *) malloc(KS);
+  bad = 0;
+
+  for (k = 0; k < NK; k++) {
+    if (Ver[k] == 0) continue;
+    lba = b_tree_find(t, Keys + (long) k * KS);
+    size = (lba == 0) ? -1 : b_tree_record_size(t, lba);
+    padded = (Size[k] + JDISK_SECTOR_SIZE - 1) / JDISK_SECTOR_SIZE * JDISK_SECTOR_SIZE;
+    memset(want, 0, padded);
+    make_record(want, k, Ver[k], Size[k]);
+    if (lba == 0 || size != padded || b_tree_read_record(t, lba, rec) != 0 ||
+        memcmp(rec, want, padded) != 0) bad++;
+  }
+
+  w.prev = key;
+  w.n = 0;
+  w.unordered = 0;
+  b_tree_traverse(t, walk_key, &w);
+  bad += w.unordered;
+  if (w.n != NOrder) bad += labs(w.n - NOrder);
+
+  if (c->flags & B_TREE_COUNTS) {
+    for (i = 0; i < NOrder; i += 1 + NOrder / 200) {
+      k = Order[i];
+      r = b_tree_rank(t, Keys + (long) k * KS);
+      if (r != i) bad++;
+      lba = b_tree_select(t, i, key);
+      if (lba == 0 || memcmp(key, Keys + (long) k * KS, KS) != 0) bad++;
+      if (i > 0 && b_tree_count_range(t, Keys + (long) Order[i/2] * KS, Keys + (long) k * KS) != i - i/2) bad++;
+    }
+    if (b_tree_count_range(t, NULL, NULL) != NOrder) bad++;
+  }
+
+  free(rec);
+  free(want);
+  free(key);
+  return bad;
+}
+
+/* For a damaged tree: calls that walk the tree must report the damage,
+   and must never hand back a key with record lba 0. */
+
+int zero_lba(void *key, unsigned int lba, void *arg)
+{
+  return (lba == 0);
+}
+
+int zero_lba_part(int part, void *key, unsigned int lba, void *arg)
+{
+  return (lba == 0);
+}
+
+/* Returns the first sector of the first leaf region, which the tree
+   keeps using as long as nothing is copied on write. */
+
+unsigned int first_leaf(void *t)
+{
+  B_Tree_Region *map;
+  long n, r;
+  unsigned int lba;
+
+  n = b_tree_space_map(t, NULL, 0);
+  map = (B_Tree_Region *) malloc((n + 1) * sizeof(B_Tree_Region));
+  n = b_tree_space_map(t, map, n);
+  lba = 0;
+  for (r = 0; r < n && lba == 0; r++) {
+    if (map[r].kind == B_TREE_REGION_LEAF && map[r].used > 0) lba = r * B_TREE_REGION_SECTORS;
+  }
+  free(map);
+  return lba;
+}
+
+/* Returns how many of the calls get a damaged tree wrong: a traversal
+   that doesn't end in B_TREE_BAD_CHECKSUM, a rank, select or count that
+   is neither right nor an error, or no error anywhere. */
+
+long check_damage(void *t, Case *c)
+{
+  unsigned char *key;
+  unsigned int lba;
+  long bad, errors, i, r;
+
+  key = (unsigned char *) malloc(KS);
+  bad = 0;
+  if (b_tree_traverse(t, zero_lba, NULL) != B_TREE_BAD_CHECKSUM) bad++;
+  if (b_tree_scan(t, Keys + (long) Order[0] * KS, zero_lba, NULL) != B_TREE_BAD_CHECKSUM) bad++;
+  if (b_tree_parallel_scan(t, 4, zero_lba_part, NULL) != B_TREE_BAD_CHECKSUM) bad++;
+
+  errors = 0;
+  for (i = 0; i < NOrder; i++) {
+    r = b_tree_rank(t, Keys + (long) Order[i] * KS);
+    if (r == B_TREE_BAD_CHECKSUM) errors++; else if (r != i) bad++;
+    lba = b_tree_select(t, i, key);
+    if (lba == 0) errors++; else if (memcmp(key, Keys + (long) Order[i] * KS, KS) != 0) bad++;
+    r = b_tree_count_range(t, Keys + (long) Order[0] * KS, Keys + (long) Order[i] * KS);
+    if (r == B_TREE_BAD_CHECKSUM) errors++; else if (r != i) bad++;
+  }
+  if (errors == 0 || b_tree_bad_sectors(t) == 0) bad++;
+  free(key);
+  return bad;
+}
+
+void *open_tree(Case *c, char *fn, int create)
+{
+  void *t;
+  long sectors;
+
+  if (create) {
+    sectors = c->sectors;
+    if (sectors == 0) sectors = (long) NK * ((c->flags & B_TREE_EXTENTS) ? 16 : 4) + 4000;
+    if (KS > 100) sectors += NK * 2;
+    t = b_tree_create_flags(fn, sectors * JDISK_SECTOR_SIZE, KS, c->flags);
+  } else {
+    t = b_tree_attach(fn);
+  }
+  if (t != NULL && TYPE == B_TREE_KEY_CUSTOM) b_tree_set_compare(t, reverse_compare);
+  return t;
+}
+
+/* Plays a trace of the case's live handle against a new tree.  The
+   records are zeros of the traced sizes, which lands them on the same
+   sectors as long as nothing is compressed, so every find must return
+   what it did in the trace.  Returns the finds that differ, plus one
+   if the trace doesn't hold the calls that were made. */
+
+long replay_trace(Case *c, char *fn, char *trace, long calls)
+{
+  FILE *f;
+  void *t;
+  char magic[8];
+  unsigned char *key, *rec;
+  B_Tree_Trace_Op op;
+  int key_size, flags;
+  long differ, n;
+  unsigned int lba;
+
+  f = fopen(trace, "r");
+  if (f == NULL) return 1;
+  if (fread(magic, 1, 8, f) != 8 || memcmp(magic, B_TREE_TRACE_MAGIC, 8) != 0 ||
+      fread(&key_size, 4, 1, f) != 1 || fread(&flags, 4, 1, f) != 1 ||
+      key_size != KS || flags != c->flags) {
+    fclose(f);
+    return 1;
+  }
+  unlink(fn);
+  t = open_tree(c, fn, 1);
+  if (t == NULL) {
+    fclose(f);
+    return 1;
+  }
+
+  key = (unsigned char *) malloc(KS);
+  rec = (unsigned char *) calloc(1, B_TREE_MAX_RECORD);
+  differ = 0;
+  n = 0;
+  while (fread(&op, sizeof(op), 1, f) == 1 && fread(key, 1, KS, f) == KS) {
+    if (op.op == 'F') {
+      lba = b_tree_find(t, key);
+      if (lba != op.result) differ++;
+    } else if (op.op == 'I') {
+      lba = b_tree_insert_size(t, key, rec, op.size);
+      if ((lba == 0) != (op.result == 0)) differ++;
+    } else {
+      break;
+    }
+    n++;
+  }
+  if (n != calls) differ++;
+  fclose(f);
+  b_tree_detach(t);
+  free(key);
+  free(rec);
+  return differ;
+}
+
+/* Runs one case.  Returns 0 if it passed. */
+
+int run_case(Case *c, char *fn, int nkeys)
+{
+  void *t, *snap;
+  unsigned char *rec;
+  unsigned int leaf;
+  void *jd;
+  char warm[1024], trace[1024];
+  long acked, refused, live, lost, bad, snap_keys, snap_bad, replayed, n;
+  int i, k, v, size, nnew, failed, last_k;
+  Reader reader;
+
+  KS = c->key_size;
+  TYPE = c->flags & B_TREE_KEY_TYPE;
+  NK = (c->nkeys != 0) ? c->nkeys : nkeys;
+  Keys = (unsigned char *) calloc(NK, KS);
+  Ver = (int *) calloc(NK, sizeof(int));
+  Size = (int *) calloc(NK, sizeof(int));
+  Order = (int *) malloc(NK * sizeof(int));
+  rec = (unsigned char *) malloc(B_TREE_MAX_RECORD);
+  srand48(NK);
+
+  unlink(fn);
+  t = open_tree(c, fn, 1);
+  if (t == NULL) {
+    printf("%-26s FAIL  couldn't create the tree\n", c->name);
+    return 1;
+  }
+  if (c->cow) b_tree_set_cow(t, 1);
+  if (c->append) b_tree_set_append(t, 1);
+  if (c->buffer) b_tree_set_buffer(t, c->buffer);
+  if (c->writeback) b_tree_set_writeback(t, c->writeback, 0);
+  if (c->hot) b_tree_set_hot_cache(t, c->hot);
+  if (c->manifest) b_tree_set_manifest(t, 1);
+  if (c->direct && b_tree_set_direct(t, 1) != 0) c->direct = -1;
+  if (c->grow) b_tree_set_grow(t, c->grow * JDISK_SECTOR_SIZE);
+  sprintf(trace, "%.1000s.trace", fn);
+  if (c->trace && b_tree_set_trace(t, trace) != 0) c->trace = -1;
+
+  /* Insert: mostly new keys, and every tenth a new version of an old one. */
+
+  acked = 0;
+  refused = 0;
+  snap = NULL;
+  snap_keys = 0;
+  snap_bad = 0;
+  failed = 0;
+  nnew = 0;
+  last_k = -1;
+  reader.snap = NULL;
+  for (i = 0; i < NK; i++) {
+    if (c->snap && i % c->snap == 0) {
+      if (reader.snap != NULL) {
+        reader.stop = 1;
+        pthread_join(reader.tid, NULL);
+        snap_bad += reader.bad;
+        reader.snap = NULL;
+      }
+      if (snap != NULL) {
+        n = 0;
+        b_tree_traverse(snap, count_key, &n);
+        if (n != snap_keys) snap_bad++;
+        b_tree_snapshot_release(snap);
+      }
+      snap = b_tree_snapshot(t);
+      if (snap == NULL) snap_bad++;
+      snap_keys = 0;
+      for (k = 0; k < nnew; k++) if (Ver[k] != 0) snap_keys++;
+
+      /* The newest record is the one most likely to share a sector
+         with the records that come next. */
+
+      if (c->reader && snap != NULL && last_k >= 0) {
+        reader.snap = snap;
+        reader.k = last_k;
+        reader.v = Ver[last_k];
+        reader.size = Size[last_k];
+        reader.stop = 0;
+        reader.reads = 0;
+        reader.bad = 0;
+        if (pthread_create(&reader.tid, NULL, snap_reader, &reader) != 0) reader.snap = NULL;
+      }
+    }
+
+    if (nnew > 0 && lrand48() % 10 == 0) {
+      k = lrand48() % nnew;
+      if (Ver[k] == 0) continue;
+    } else {
+      k = nnew++;
+      make_key(c, k);
+    }
+    v = Ver[k] + 1;
+    size = record_size(c, k, v);
+    make_record(rec, k, v, size);
+    if (b_tree_insert_size(t, Keys + (long) k * KS, rec, size) != 0) {
+      Ver[k] = v;
+      Size[k] = size;
+      last_k = k;
+      acked++;
+    } else {
+      refused++;
+      failed = 1;
+    }
+  }
+  if (reader.snap != NULL) {
+    reader.stop = 1;
+    pthread_join(reader.tid, NULL);
+    snap_bad += reader.bad;
+  }
+  if (snap != NULL) b_tree_snapshot_release(snap);
+
+  NOrder = 0;
+  for (k = 0; k < nnew; k++) if (Ver[k] != 0) Order[NOrder++] = k;
+  qsort(Order, NOrder, sizeof(int), order_compare);
+
+  /* Check the live handle, then again after a reattach. */
+
+  live = check_tree(t, c);
+  bad = b_tree_bad_sectors(t);
+  if (c->trace && b_tree_set_trace(t, NULL) != 0) c->trace = -1;
+  leaf = (c->damage) ? first_leaf(t) : 0;
+  if (b_tree_detach(t) != 0 && !failed) bad++;
+
+  /* Overwrite the leaf with garbage, so it fails its checksum. */
+
+  if (c->damage) {
+    jd = jdisk_attach(fn);
+    if (leaf == 0 || jd == NULL) {
+      bad++;
+    } else {
+      memset(rec, 0x5a, JDISK_SECTOR_SIZE);
+      jdisk_write(jd, leaf, rec);
+    }
+    if (jd != NULL) jdisk_unattach(jd);
+  }
+
+  t = open_tree(c, fn, 0);
+  if (t == NULL) {
+    lost = NOrder;
+  } else if (c->damage) {
+    lost = check_damage(t, c);
+    b_tree_detach(t);
+  } else {
+    lost = check_tree(t, c);
+    bad += b_tree_bad_sectors(t);
+    b_tree_detach(t);
+  }
+
+  /* The trace holds every insert tried and check_tree()'s finds. */
+
+  replayed = 0;
+  if (c->trace > 0) replayed = replay_trace(c, fn, trace, acked + refused + NOrder);
+
+  failed = (live != 0 || lost != 0 || bad != 0 || snap_bad != 0 || (refused != 0) != c->full ||
+            c->trace < 0 || replayed != 0);
+  printf("%-26s %s  acked %5ld  refused %5ld  wrong live %ld  lost %ld  bad sectors %ld%s%s%s\n",
+         c->name, failed ? "FAIL" : "ok  ", acked, refused, live, lost, bad,
+         snap_bad ? "  bad snapshots" : "", (c->direct < 0) ? "  (no O_DIRECT here)" : "",
+         (c->trace < 0 || replayed != 0) ? "  bad replay" : "");
+
+  unlink(fn);
+  sprintf(warm, "%.1000s.warm", fn);
+  unlink(warm);
+  unlink(trace);
+  free(Keys);
+  free(Ver);
+  free(Size);
+  free(Order);
+  free(rec);
+  return failed;
+}
+
+int main(int argc, char **argv)
+{
+  int nkeys, i, nfailed;
+
+  if (argc != 2 && argc != 3) usage(NULL);
+  nkeys = 2000;
+  if (argc == 3 && (sscanf(argv[2], "%d", &nkeys) != 1 || nkeys <= 0)) usage("Bad nkeys");
+  if (access(argv[1], F_OK) == 0) usage("tree_file exists");
+
+  nfailed = 0;
+  for (i = 0; i < sizeof(cases) / sizeof(Case); i++) nfailed += run_case(&cases[i], argv[1], nkeys);
+  printf("%d of %d cases failed\n", nfailed, (int) (sizeof(cases) / sizeof(Case)));
+  return (nfailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "b_tree.h"
+
+/* Folds a delta tree into a main tree, in place or into a new file,
+   and reports the keys and I/Os it took. */
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_merge main_file delta_file\n");
+  fprintf(stderr, "       b_tree_merge main_file delta_file new_file size\n");
+  fprintf(stderr, "       The first merges delta into main; the second writes both to new_file.\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int count_key(void *key, unsigned int lba, void *arg)
+{
+  (*(long *) arg)++;
+  return 0;
+}
+
+static void *attach(char *fn)
+{
+  void *t;
+
+  t = b_tree_attach(fn);
+  if (t == NULL) {
+    fprintf(stderr, "Couldn't attach to %s.  Calling perror().\n", fn);
+    perror(fn);
+    exit(1);
+  }
+  return t;
+}
+
+int main(int argc, char **argv)
+{
+  void *m, *d, *n;
+  long size, keys, reads, writes;
+  double t0;
+
+  if (argc != 3 && argc != 5) usage(NULL);
+  m = attach(argv[1]);
+  d = attach(argv[2]);
+
+  t0 = now();
+  if (argc == 3) {
+    if (b_tree_merge_into(m, d) != 0) usage("The merge failed: the keys don't match or main filled up");
+    n = m;
+  } else {
+    if (sscanf(argv[4], "%ld", &size) != 1) usage("Size must be an integer");
+    n = b_tree_merge(m, d, argv[3], size);
+    if (n == NULL) usage("The merge failed: the keys don't match or new_file couldn't be made or filled up");
+  }
+  t0 = now() - t0;
+
+  reads = jdisk_reads(b_tree_disk(m)) + jdisk_reads(b_tree_disk(d));
+  writes = jdisk_writes(b_tree_disk(m));
+  if (n != m) {
+    reads += jdisk_reads(b_tree_disk(n));
+    writes += jdisk_writes(b_tree_disk(n));
+  }
+  keys = 0;
+  b_tree_traverse(n, count_key, &keys);
+  printf("Keys: %ld  Reads: %ld  Writes: %ld  Time: %.3f s\n", keys, reads, writes, t0);
+
+  if (n != m) b_tree_detach(n);
+  b_tree_detach(d);
+  b_tree_detach(m);
+  exit(0);
+}
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "b_tree.h"
+
+/* Plays a trace from b_tree_set_trace() against a copy of a jdisk and
+   reports throughput, latency percentiles and sector I/O per call.
+   Records aren't in the trace, so inserts write zeros of the traced size. */
+
+typedef struct {
+  long n;
+  long cap;
+  unsigned long *latency;       /* ns, one per call */
+  long reads;
+  long writes;
+  long differ;                  /* Finds that returned something else than in the trace */
+} Stats;
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_replay trace_file jdisk_file [fast|paced]\n");
+  fprintf(stderr, "       The jdisk is copied to jdisk_file.replay, which is removed afterwards.\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+static unsigned long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int copy_file(char *from, char *to)
+{
+  FILE *in, *out;
+  char *buf;
+  size_t n;
+  int rv;
+
+  in = fopen(from, "r");
+  if (in == NULL) return -1;
+  out = fopen(to, "wx");
+  if (out == NULL) {
+    fclose(in);
+    return -1;
+  }
+  buf = malloc(1 << 20);
+  rv = 0;
+  while ((n = fread(buf, 1, 1 << 20, in)) > 0) {
+    if (fwrite(buf, 1, n, out) != n) rv = -1;
+  }
+  free(buf);
+  fclose(in);
+  if (fclose(out) != 0) rv = -1;
+  return rv;
+}
+
+static int ul_cmp(const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *) a;
+  unsigned long y = *(const unsigned long *) b;
+
+  return (x > y) - (x < y);
+}
+
+static void add(Stats *s, unsigned long latency, long reads, long writes)
+{
+  if (s->n == s->cap) {
+    s->cap = (s->cap == 0) ? 1024 : s->cap * 2;
+    s->latency = realloc(s->latency, s->cap * sizeof(unsigned long));
+  }
+  s->latency[s->n++] = latency;
+  s->reads += reads;
+  s->writes += writes;
+}
+
+static double pct(Stats *s, double p)
+{
+  long i;
+
+  i = (long) (p * s->n);
+  if (i >= s->n) i = s->n - 1;
+  return s->latency[i] / 1000.0;
+}
+
+static void report(char *name, Stats *s)
+{
+  if (s->n == 0) return;
+  qsort(s->latency, s->n, sizeof(unsigned long), ul_cmp);
+  printf("%-7s %9ld %9.1f %9.1f %9.1f %9.1f %9.1f %9.3f %9.3f\n", name, s->n,
+         pct(s, 0.5), pct(s, 0.9), pct(s, 0.99), pct(s, 0.999), pct(s, 1.0),
+         (double) s->reads / s->n, (double) s->writes / s->n);
+}
+
+int main(int argc, char **argv)
+{
+  FILE *f;
+  void *t, *jd;
+  char magic[8];
+  char *copy;
+  int key_size, flags, paced;
+  unsigned char *key, *rec;
+  B_Tree_Trace_Op op;
+  Stats finds, inserts;
+  unsigned long start, t0, took, target;
+  long r0, w0, ops;
+  unsigned int lba;
+  struct timespec ts;
+
+  if (argc != 3 && argc != 4) usage(NULL);
+  paced = 0;
+  if (argc == 4) {
+    if (strcmp(argv[3], "paced") == 0) {
+      paced = 1;
+    } else if (strcmp(argv[3], "fast") != 0) usage("pacing must be fast or paced");
+  }
+
+  f = fopen(argv[1], "r");
+  if (f == NULL) { perror(argv[1]); exit(1); }
+  if (fread(magic, 1, 8, f) != 8 || memcmp(magic, B_TREE_TRACE_MAGIC, 8) != 0 ||
+      fread(&key_size, 4, 1, f) != 1 || fread(&flags, 4, 1, f) != 1) {
+    usage("Not a trace file");
+  }
+
+  copy = malloc(strlen(argv[2]) + 8);
+  sprintf(copy, "%s.replay", argv[2]);
+  if (copy_file(argv[2], copy) != 0) {
+    fprintf(stderr, "Couldn't copy %s to %s -- calling perror()\n", argv[2], copy);
+    perror(copy);
+    exit(1);
+  }
+  t = b_tree_attach(copy);
+  if (t == NULL) {
+    unlink(copy);
+    usage("Couldn't attach to the copy of the jdisk");
+  }
+  if (b_tree_key_size(t) != key_size) {
+    b_tree_detach(t);
+    unlink(copy);
+    usage("The trace's key size doesn't match the jdisk's");
+  }
+  jd = b_tree_disk(t);
+
+  key = malloc(key_size);
+  rec = calloc(1, B_TREE_MAX_RECORD);
+  memset(&finds, 0, sizeof(Stats));
+  memset(&inserts, 0, sizeof(Stats));
+  ops = 0;
+
+  start = now_ns();
+  while (fread(&op, sizeof(op), 1, f) == 1 && fread(key, 1, key_size, f) == key_size) {
+
+    // at original pacing, wait until the call's time in the trace
+    if (paced) {
+      target = start + op.time;
+      t0 = now_ns();
+      if (t0 < target) {
+        ts.tv_sec = (target - t0) / 1000000000UL;
+        ts.tv_nsec = (target - t0) % 1000000000UL;
+        nanosleep(&ts, NULL);
+      }
+    }
+
+    r0 = jdisk_reads(jd);
+    w0 = jdisk_writes(jd);
+    t0 = now_ns();
+    if (op.op == 'F') {
+      lba = b_tree_find(t, key);
+      took = now_ns() - t0;
+      add(&finds, took, jdisk_reads(jd) - r0, jdisk_writes(jd) - w0);
+      if (lba != op.result) finds.differ++;
+    } else if (op.op == 'I') {
+      lba = b_tree_insert_size(t, key, rec, op.size);
+      took = now_ns() - t0;
+      add(&inserts, took, jdisk_reads(jd) - r0, jdisk_writes(jd) - w0);
+      if ((lba == 0) != (op.result == 0)) inserts.differ++;
+    } else {
+      fprintf(stderr, "Bad op %d in the trace after %ld calls\n", op.op, ops);
+      break;
+    }
+    ops++;
+  }
+  took = now_ns() - start;
+  fclose(f);
+
+  printf("Calls: %ld  Elapsed: %.3f s  Throughput: %.0f calls/s%s\n", ops, took / 1e9,
+         (took > 0) ? ops / (took / 1e9) : 0.0, paced ? " (paced)" : "");
+  printf("%-7s %9s %9s %9s %9s %9s %9s %9s %9s\n", "Call", "Count", "p50 us", "p90 us",
+         "p99 us", "p99.9 us", "max us", "reads", "writes");
+  report("find", &finds);
+  report("insert", &inserts);
+  printf("Finds that differ from the trace: %ld\n", finds.differ);
+  printf("Inserts that failed differently: %ld\n", inserts.differ);
+
+  b_tree_detach(t);
+  unlink(copy);
+  free(copy);
+  free(key);
+  free(rec);
+  free(finds.latency);
+  free(inserts.latency);
+  exit(0);
+}
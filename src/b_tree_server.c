@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "b_tree_server.h"
+
+/* Serves one B_Tree to local clients over a Unix domain socket.  The
+   protocol is in b_tree_server.h.  It is one thread: the tree isn't
+   thread safe, and a poll() loop lets every request that arrived in one
+   read be answered with one write. */
+
+#define READ_CHUNK (64 * 1024)          /* Bytes one read() may take from a client */
+#define OUT_LIMIT (1 << 20)             /* Stop reading a client with this much unsent */
+
+typedef struct {
+  int fd;
+  unsigned char *in;            /* Received bytes not yet made into requests */
+  long in_len, in_cap;
+  unsigned char *out;           /* Replies not yet written, from out_off on */
+  long out_len, out_off, out_cap;
+} Client;
+
+typedef struct {
+  unsigned char *p;             /* Where the next (key, lba) pair goes */
+  int n, max, key_size;
+} Scan_Arg;
+
+static volatile sig_atomic_t done;
+static long requests;
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_server jdisk_file socket_path [buffer_msgs]\n");
+  fprintf(stderr, "       Serves the tree until SIGINT or SIGTERM.  An old socket_path is removed.\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+static void stop(int sig)
+{
+  done = 1;
+}
+
+/* Makes room for a reply of len bytes and fills in its header.
+   Returns where the len bytes go. */
+
+static unsigned char *reply(Client *c, int op, unsigned int id, long len)
+{
+  B_Tree_Msg m;
+  unsigned char *p;
+
+  if (c->out_len + (long) sizeof(m) + len > c->out_cap) {
+    while (c->out_len + (long) sizeof(m) + len > c->out_cap) {
+      c->out_cap = (c->out_cap == 0) ? READ_CHUNK : c->out_cap * 2;
+    }
+    c->out = realloc(c->out, c->out_cap);
+  }
+  memset(&m, 0, sizeof(m));
+  m.op = op;
+  m.id = id;
+  m.len = len;
+  p = c->out + c->out_len;
+  memcpy(p, &m, sizeof(m));
+  c->out_len += sizeof(m) + len;
+  return p + sizeof(m);
+}
+
+/* Cuts the reply whose payload starts at p from old bytes down to len. */
+
+static void shrink(Client *c, unsigned char *p, long old, long len)
+{
+  unsigned int l = len;
+
+  memcpy(p - sizeof(B_Tree_Msg) + offsetof(B_Tree_Msg, len), &l, 4);
+  c->out_len -= old - len;
+}
+
+static int scan_pair(void *key, unsigned int lba, void *arg)
+{
+  Scan_Arg *s = arg;
+
+  memcpy(s->p, key, s->key_size);
+  memcpy(s->p + s->key_size, &lba, 4);
+  s->p += s->key_size + 4;
+  s->n++;
+  return (s->n == s->max);
+}
+
+/* Answers every complete request in c->in.  Returns -1 if one is
+   malformed, and the connection should be closed. */
+
+static int serve(Client *c, void *t, int key_size)
+{
+  B_Tree_Msg m;
+  Scan_Arg s;
+  unsigned char *p, *r;
+  unsigned int lba;
+  long off;
+  int max, size;
+
+  off = 0;
+  while (c->in_len - off >= (long) sizeof(m)) {
+    memcpy(&m, c->in + off, sizeof(m));
+    if (m.len > key_size + B_TREE_MAX_RECORD) return -1;
+    if (c->in_len - off - (long) sizeof(m) < m.len) break;
+    p = c->in + off + sizeof(m);
+    off += sizeof(m) + m.len;
+    requests++;
+
+    switch (m.op) {
+    case 'F':
+      if (m.len != key_size) return -1;
+      lba = b_tree_find(t, p);
+      memcpy(reply(c, 'F', m.id, 4), &lba, 4);
+      break;
+    case 'I':
+      if (m.len <= key_size) return -1;
+      lba = b_tree_insert_size(t, p, p + key_size, m.len - key_size);
+      memcpy(reply(c, 'I', m.id, 4), &lba, 4);
+      break;
+    case 'R':
+      if (m.len != 4) return -1;
+      memcpy(&lba, p, 4);
+      size = b_tree_record_size(t, lba);
+      r = reply(c, 'R', m.id, size);
+      if (b_tree_read_record(t, lba, r) != 0) shrink(c, r, size, 0);
+      break;
+    case 'S':
+      if (m.len != 4 && m.len != 4 + key_size) return -1;
+      memcpy(&max, p, 4);
+      if (max < 0) max = 0;
+      if (max > B_TREE_SERVER_SCAN_MAX) max = B_TREE_SERVER_SCAN_MAX;
+      r = reply(c, 'S', m.id, (long) max * (key_size + 4));
+      s.p = r;
+      s.n = 0;
+      s.max = max;
+      s.key_size = key_size;
+      if (max > 0) b_tree_scan(t, (m.len == 4) ? NULL : p + 4, scan_pair, &s);
+
+      // give back what the scan didn't fill
+      shrink(c, r, (long) max * (key_size + 4), (long) s.n * (key_size + 4));
+      break;
+    default:
+      return -1;
+    }
+  }
+
+  memmove(c->in, c->in + off, c->in_len - off);
+  c->in_len -= off;
+  return 0;
+}
+
+/* Writes what it can of c->out.  Returns -1 if the client is gone. */
+
+static int flush_out(Client *c)
+{
+  ssize_t n;
+
+  while (c->out_off < c->out_len) {
+    n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+    if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    c->out_off += n;
+  }
+  c->out_len = c->out_off = 0;
+  return 0;
+}
+
+static void drop(Client **clients, int *nclients, int i)
+{
+  close(clients[i]->fd);
+  free(clients[i]->in);
+  free(clients[i]->out);
+  free(clients[i]);
+  clients[i] = clients[--(*nclients)];
+}
+
+int main(int argc, char **argv)
+{
+  void *t;
+  int lfd, fd, key_size, msgs, i, nclients, cap;
+  long accepted;
+  Client **clients, *c;
+  struct pollfd *pfd;
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  ssize_t n;
+
+  if (argc != 3 && argc != 4) usage(NULL);
+  if (strlen(argv[2]) >= sizeof(addr.sun_path)) usage("socket_path is too long");
+
+  t = b_tree_attach(argv[1]);
+  if (t == NULL) {
+    fprintf(stderr, "Couldn't attach to %s.  Calling perror().\n", argv[1]);
+    perror(argv[1]);
+    exit(1);
+  }
+  if (argc == 4) {
+    if (sscanf(argv[3], "%d", &msgs) != 1 || msgs < 0) usage("Bad buffer_msgs");
+    if (b_tree_set_buffer(t, msgs) != 0) usage("Couldn't set up the insert buffer");
+  }
+  key_size = b_tree_key_size(t);
+
+  lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, argv[2]);
+  unlink(argv[2]);
+  if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(lfd, 64) != 0) {
+    perror(argv[2]);
+    b_tree_detach(t);
+    exit(1);
+  }
+  fcntl(lfd, F_SETFL, O_NONBLOCK);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  cap = 16;
+  clients = malloc(cap * sizeof(Client *));
+  pfd = malloc((cap + 1) * sizeof(struct pollfd));
+  nclients = 0;
+  accepted = 0;
+
+  while (!done) {
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+    for (i = 0; i < nclients; i++) {
+      c = clients[i];
+      pfd[i+1].fd = c->fd;
+      pfd[i+1].events = 0;
+      if (c->out_len - c->out_off < OUT_LIMIT) pfd[i+1].events |= POLLIN;
+      if (c->out_off < c->out_len) pfd[i+1].events |= POLLOUT;
+    }
+    if (poll(pfd, nclients + 1, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      break;
+    }
+
+    // go backwards, so dropping a client only moves one we've done
+    for (i = nclients - 1; i >= 0; i--) {
+      c = clients[i];
+      if (pfd[i+1].revents & POLLOUT) {
+        if (flush_out(c) != 0) { drop(clients, &nclients, i); continue; }
+      }
+      if (!(pfd[i+1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+      if (c->in_len + READ_CHUNK > c->in_cap) {
+        c->in_cap = c->in_len + READ_CHUNK;
+        c->in = realloc(c->in, c->in_cap);
+      }
+      n = read(c->fd, c->in + c->in_len, READ_CHUNK);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+      if (n <= 0) { drop(clients, &nclients, i); continue; }
+      c->in_len += n;
+
+      // everything this read completed is answered with one write
+      if (serve(c, t, key_size) != 0 || flush_out(c) != 0) drop(clients, &nclients, i);
+    }
+
+    if (pfd[0].revents & POLLIN) {
+      while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        if (nclients == cap) {
+          cap *= 2;
+          clients = realloc(clients, cap * sizeof(Client *));
+          pfd = realloc(pfd, (cap + 1) * sizeof(struct pollfd));
+        }
+        c = calloc(1, sizeof(Client));
+        c->fd = fd;
+        memcpy(reply(c, 'H', 0, 4), &key_size, 4);
+        clients[nclients++] = c;
+        accepted++;
+        if (flush_out(c) != 0) drop(clients, &nclients, nclients - 1);
+      }
+    }
+  }
+
+  while (nclients > 0) drop(clients, &nclients, nclients - 1);
+  close(lfd);
+  unlink(argv[2]);
+  free(clients);
+  free(pfd);
+  fprintf(stderr, "Served %ld requests from %ld clients\n", requests, accepted);
+  if (b_tree_detach(t) != 0) exit(1);
+  exit(0);
+}
@@ -0,0 +1,586 @@
+//  Sharded B-Tree
+//  Spreads keys over N independent B_Trees, each on its own jdisk,
+//  with one worker thread per shard for batched operations.
+
+#include <b_tree_shard.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+  char op;                      /* 'I' or 'F' */
+  int n;                        /* Number of operations for this shard */
+  int *idx;                     /* Their indices in the caller's arrays */
+  unsigned char *keys;          /* Caller's keys (key_size apart) */
+  unsigned char *records;       /* Caller's records (JDISK_SECTOR_SIZE apart) */
+  unsigned int *lbas;           /* Where to put the return values */
+} Shard_Job;
+
+typedef struct {
+  void *tree;                   /* The shard's B_Tree */
+  pthread_mutex_t lock;         /* Held by whoever is using tree */
+  pthread_cond_t cond;          /* Signals the worker that job or quit changed */
+  pthread_t tid;                /* The worker thread */
+  Shard_Job *job;               /* Pending batch job, NULL when idle */
+  int quit;                     /* Tells the worker to exit */
+  struct shard_tree *owner;     /* Back pointer for batch completion */
+} Shard;
+
+typedef struct shard_tree {
+  int nshards;
+  int mode;                     /* B_TREE_SHARD_HASH or B_TREE_SHARD_RANGE */
+  int key_size;
+  unsigned char *splits;        /* Range mode: nshards-1 ascending keys, shard i starts at splits[i-1] */
+  Shard *shards;
+
+  pthread_mutex_t batch_lock;   /* One batch at a time */
+  pthread_mutex_t done_lock;    /* Protects pending */
+  pthread_cond_t done_cond;     /* Signaled when a shard finishes its part of a batch */
+  int pending;                  /* Shards still working on the current batch */
+} Shard_Tree;
+
+/*  shard_of
+ *  Returns the index of the shard that owns key.
+ *  Hash mode uses FNV-1a over the whole key.  Range mode binary searches
+ *  the split keys, so shard i only holds keys smaller than shard i+1's.
+ *
+ *  @S is the Shard_Tree
+ *  @key is the key
+ */
+int shard_of(Shard_Tree *S, unsigned char *key){
+    unsigned int h;
+    int i, lo, hi;
+
+    // the owner is the number of split keys <= key
+    if(S->mode == B_TREE_SHARD_RANGE){
+        lo = 0;
+        hi = S->nshards - 1;
+        while(lo < hi){
+            i = (lo + hi) / 2;
+            if(memcmp(key,S->splits + (long) i * S->key_size,S->key_size) < 0) hi = i;
+            else lo = i + 1;
+        }
+        return lo;
+    }
+
+    h = 2166136261u;
+    for(i = 0; i < S->key_size; i++){
+        h ^= key[i];
+        h *= 16777619u;
+    }
+    return h % S->nshards;
+}
+
+/*  shard_worker
+ *  Body of a shard's worker thread.
+ *  Waits for a batch job, runs it against the shard's tree
+ *  and reports back to the owner.
+ *
+ *  @v is the Shard
+ */
+void *shard_worker(void *v){
+    Shard *s = v;
+    Shard_Tree *S = s->owner;
+    Shard_Job *j;
+    int i, k;
+
+    pthread_mutex_lock(&s->lock);
+    while(1){
+        while(s->job == NULL && !s->quit) pthread_cond_wait(&s->cond,&s->lock);
+        if(s->quit) break;
+
+        // run the batch while holding the shard lock
+        j = s->job;
+        for(i = 0; i < j->n; i++){
+            k = j->idx[i];
+            if(j->op == 'I'){
+                j->lbas[k] = b_tree_insert(s->tree,j->keys + (long) k * S->key_size,
+                                           j->records + (long) k * JDISK_SECTOR_SIZE);
+            }else{
+                j->lbas[k] = b_tree_find(s->tree,j->keys + (long) k * S->key_size);
+            }
+        }
+        s->job = NULL;
+
+        pthread_mutex_lock(&S->done_lock);
+        S->pending--;
+        pthread_cond_signal(&S->done_cond);
+        pthread_mutex_unlock(&S->done_lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/*  default_splits
+ *  Fills in the split keys that cut the first two key bytes into
+ *  nshards even ranges, which suits keys whose leading bytes are uniform.
+ *  Manifests written without split keys route this way.
+ *
+ *  @nshards is the number of shards
+ *  @key_size is the size of each key (at least 2)
+ *  @splits gets nshards-1 keys, key_size bytes apart
+ */
+void default_splits(int nshards, int key_size, unsigned char *splits){
+    unsigned char *k;
+    long h;
+    int i;
+
+    memset(splits,0,(long) (nshards-1) * key_size);
+    for(i = 1; i < nshards; i++){
+        h = ((long) i * 65536 + nshards - 1) / nshards;
+        if(h > 0xffff) h = 0xffff;
+        k = splits + (long) (i-1) * key_size;
+        k[0] = h >> 8;
+        k[1] = h & 0xff;
+    }
+}
+
+/*  splits_sorted
+ *  Returns 1 if the nshards-1 split keys are in ascending order, 0 if not.
+ *
+ *  @nshards is the number of shards
+ *  @key_size is the size of each key
+ *  @splits holds the split keys, key_size bytes apart
+ */
+int splits_sorted(int nshards, int key_size, unsigned char *splits){
+    int i;
+
+    for(i = 2; i < nshards; i++){
+        if(memcmp(splits + (long) (i-2) * key_size,splits + (long) (i-1) * key_size,key_size) > 0) return 0;
+    }
+    return 1;
+}
+
+/*  shard_tree_setup
+ *  Returns a Shard_Tree with its shards attached or created
+ *  and their workers running, or NULL on failure.
+ *  A failed create removes the shard files it made.
+ *
+ *  @filename is the manifest file; shard i lives in filename.i
+ *  @nshards, @mode and @key_size describe the sharding
+ *  @shard_size is the jdisk size of each shard, or 0 to attach
+ *  @splits is the range mode split keys (copied), or NULL
+ */
+void *shard_tree_setup(char *filename, int nshards, int mode, long shard_size, int key_size, unsigned char *splits){
+    Shard_Tree *S;
+    char *fn;
+    int i, j;
+
+    S = malloc(sizeof(Shard_Tree));
+    S->nshards = nshards;
+    S->mode = mode;
+    S->key_size = key_size;
+    S->splits = NULL;
+    if(mode == B_TREE_SHARD_RANGE){
+        S->splits = malloc((long) nshards * key_size);
+        memcpy(S->splits,splits,(long) (nshards-1) * key_size);
+    }
+    S->shards = calloc(nshards, sizeof(Shard));
+    S->pending = 0;
+    pthread_mutex_init(&S->batch_lock,NULL);
+    pthread_mutex_init(&S->done_lock,NULL);
+    pthread_cond_init(&S->done_cond,NULL);
+
+    fn = malloc(strlen(filename) + 16);
+    for(i = 0; i < nshards; i++){
+        sprintf(fn,"%s.%d",filename,i);
+        if(shard_size != 0){
+            S->shards[i].tree = b_tree_create(fn,shard_size,key_size);
+        }else{
+            S->shards[i].tree = b_tree_attach(fn);
+        }
+
+        if(S->shards[i].tree != NULL){
+            S->shards[i].job = NULL;
+            S->shards[i].quit = 0;
+            S->shards[i].owner = S;
+            pthread_mutex_init(&S->shards[i].lock,NULL);
+            pthread_cond_init(&S->shards[i].cond,NULL);
+            if(pthread_create(&S->shards[i].tid,NULL,shard_worker,&S->shards[i]) == 0) continue;
+
+            // no worker, so this shard can't go through b_tree_shard_detach()
+            b_tree_detach(S->shards[i].tree);
+            pthread_mutex_destroy(&S->shards[i].lock);
+            pthread_cond_destroy(&S->shards[i].cond);
+            if(shard_size != 0) unlink(fn);
+        }
+
+        // give back whatever we set up so far
+        S->nshards = i;
+        b_tree_shard_detach(S);
+        if(shard_size != 0){
+            for(j = 0; j < i; j++){
+                sprintf(fn,"%s.%d",filename,j);
+                unlink(fn);
+            }
+        }
+        free(fn);
+        return NULL;
+    }
+    free(fn);
+
+    return S;
+}
+
+/*  shard_create
+ *  Returns a handle to a new sharded B_Tree, or NULL on failure.
+ *  Writes the manifest, with the split keys in hex one per line,
+ *  then creates the shards.  Removes the manifest if that fails.
+ *
+ *  @filename is the name of the manifest file
+ *  @nshards, @mode, @shard_size and @key_size describe the sharding
+ *  @splits is the range mode split keys, or NULL
+ */
+void *shard_create(char *filename, int nshards, int mode, long shard_size, int key_size, unsigned char *splits){
+    FILE *f;
+    void *S;
+    int i, j, rv;
+
+    f = fopen(filename,"wx");
+    if(f == NULL) return NULL;
+    rv = fprintf(f,"B_TREE_SHARD %d %d %d\n",nshards,mode,key_size);
+    if(mode == B_TREE_SHARD_RANGE){
+        for(i = 0; i < nshards-1 && rv >= 0; i++){
+            for(j = 0; j < key_size && rv >= 0; j++) rv = fprintf(f,"%02x",splits[(long) i * key_size + j]);
+            if(rv >= 0) rv = fprintf(f,"\n");
+        }
+    }
+    if(fclose(f) != 0) rv = -1;
+
+    S = (rv < 0) ? NULL : shard_tree_setup(filename,nshards,mode,shard_size,key_size,splits);
+    if(S == NULL) unlink(filename);
+    return S;
+}
+
+/*  b_tree_shard_create
+ *  Returns a handle to a new sharded B_Tree, or NULL on failure.
+ *  Writes a small manifest to filename and creates one jdisk per shard.
+ *  Range mode splits the first two key bytes evenly; when keys are not
+ *  spread that way, use b_tree_shard_create_splits().
+ *
+ *  @filename is the name of the manifest file
+ *  @nshards is the number of shards
+ *  @mode is B_TREE_SHARD_HASH or B_TREE_SHARD_RANGE
+ *  @shard_size is the size of each shard's jdisk
+ *  @key_size is the size of each key
+ */
+void *b_tree_shard_create(char *filename, int nshards, int mode, long shard_size, int key_size){
+    unsigned char *splits;
+    void *S;
+
+    if(nshards <= 0 || key_size < 2) return NULL;
+    if(mode == B_TREE_SHARD_HASH) return shard_create(filename,nshards,mode,shard_size,key_size,NULL);
+    if(mode != B_TREE_SHARD_RANGE) return NULL;
+
+    splits = malloc((long) nshards * key_size);
+    default_splits(nshards,key_size,splits);
+    S = shard_create(filename,nshards,mode,shard_size,key_size,splits);
+    free(splits);
+    return S;
+}
+
+/*  b_tree_shard_create_splits
+ *  Returns a handle to a new range mode sharded B_Tree, or NULL on failure.
+ *  Shard 0 holds keys below splits[0], shard i keys from splits[i-1] up to
+ *  splits[i], and the last shard the rest.  The split keys go in the manifest.
+ *
+ *  @filename is the name of the manifest file
+ *  @nshards is the number of shards
+ *  @shard_size is the size of each shard's jdisk
+ *  @key_size is the size of each key
+ *  @splits holds nshards-1 ascending keys, key_size bytes apart
+ */
+void *b_tree_shard_create_splits(char *filename, int nshards, long shard_size, int key_size, void *splits){
+    if(nshards <= 0 || key_size <= 0) return NULL;
+    if(nshards > 1 && (splits == NULL || !splits_sorted(nshards,key_size,splits))) return NULL;
+    return shard_create(filename,nshards,B_TREE_SHARD_RANGE,shard_size,key_size,splits);
+}
+
+/*  b_tree_shard_sample_splits
+ *  Picks split keys for b_tree_shard_create_splits() from a sample of keys,
+ *  so that each shard gets about the same share of the sample.
+ *  Returns 0 on success and -1 on bad arguments.
+ *
+ *  @nshards is the number of shards
+ *  @key_size is the size of each key
+ *  @n is the number of sample keys
+ *  @keys holds the sample, key_size bytes apart
+ *  @splits gets nshards-1 keys, key_size bytes apart
+ */
+int b_tree_shard_sample_splits(int nshards, int key_size, int n, void *keys, void *splits){
+    unsigned char **sorted, *k;
+    int i, j, gap;
+
+    if(nshards <= 0 || key_size <= 0 || n <= 0) return -1;
+
+    // shell sort pointers to the sample keys
+    sorted = malloc(n * sizeof(unsigned char *));
+    for(i = 0; i < n; i++) sorted[i] = (unsigned char *) keys + (long) i * key_size;
+    for(gap = n / 2; gap > 0; gap /= 2){
+        for(i = gap; i < n; i++){
+            k = sorted[i];
+            for(j = i; j >= gap && memcmp(sorted[j-gap],k,key_size) > 0; j -= gap) sorted[j] = sorted[j-gap];
+            sorted[j] = k;
+        }
+    }
+
+    for(i = 1; i < nshards; i++){
+        memcpy((unsigned char *) splits + (long) (i-1) * key_size,sorted[(long) i * n / nshards],key_size);
+    }
+    free(sorted);
+    return 0;
+}
+
+/*  b_tree_shard_attach
+ *  Returns a handle to an existing sharded B_Tree, or NULL on failure.
+ *
+ *  @filename is the name of the manifest file
+ */
+void *b_tree_shard_attach(char *filename){
+    FILE *f;
+    unsigned char *splits;
+    void *S;
+    int nshards, mode, key_size, n;
+    long i;
+
+    f = fopen(filename,"r");
+    if(f == NULL) return NULL;
+    n = fscanf(f,"B_TREE_SHARD %d %d %d",&nshards,&mode,&key_size);
+    if(n != 3 || nshards <= 0 || key_size <= 0 || (mode != B_TREE_SHARD_HASH && mode != B_TREE_SHARD_RANGE)){
+        fclose(f);
+        return NULL;
+    }
+
+    // read the split keys, falling back to the old two-byte split if there are none
+    splits = NULL;
+    if(mode == B_TREE_SHARD_RANGE){
+        splits = malloc((long) nshards * key_size);
+        for(i = 0; i < (long) (nshards-1) * key_size; i++){
+            if(fscanf(f," %2hhx",&splits[i]) != 1) break;
+        }
+        if(i == 0 && nshards > 1 && key_size >= 2) default_splits(nshards,key_size,splits);
+        else if(i != (long) (nshards-1) * key_size || !splits_sorted(nshards,key_size,splits)){
+            free(splits);
+            fclose(f);
+            return NULL;
+        }
+    }
+    fclose(f);
+
+    S = shard_tree_setup(filename,nshards,mode,0,key_size,splits);
+    free(splits);
+    return S;
+}
+
+/*  b_tree_shard_detach
+ *  Stops the workers and detaches every shard.
+ *  Returns 0 on success and -1 if any shard failed to detach.
+ *
+ *  @sh is the sharded B_Tree
+ */
+int b_tree_shard_detach(void *sh){
+    Shard_Tree *S = sh;
+    Shard *s;
+    int i, rv;
+
+    rv = 0;
+    for(i = 0; i < S->nshards; i++){
+        s = &S->shards[i];
+
+        pthread_mutex_lock(&s->lock);
+        s->quit = 1;
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->tid,NULL);
+
+        if(b_tree_detach(s->tree) != 0) rv = -1;
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->cond);
+    }
+
+    free(S->shards);
+    free(S->splits);
+    free(S);
+    return rv;
+}
+
+/*  b_tree_shard_insert
+ *  Inserts a key and record into the shard that owns the key.
+ *  Returns the record's lba within that shard's jdisk (0 on failure).
+ *  Safe to call from several threads; calls on different shards run in parallel.
+ *
+ *  @sh is the sharded B_Tree
+ *  @key is the insertion key
+ *  @record is the data to insert
+ */
+unsigned int b_tree_shard_insert(void *sh, void *key, void *record){
+    Shard_Tree *S = sh;
+    Shard *s = &S->shards[shard_of(S,key)];
+    unsigned int lba;
+
+    pthread_mutex_lock(&s->lock);
+    lba = b_tree_insert(s->tree,key,record);
+    pthread_mutex_unlock(&s->lock);
+    return lba;
+}
+
+/*  b_tree_shard_find
+ *  Returns the lba associated with key within its shard's jdisk.
+ *
+ *  @sh is the sharded B_Tree
+ *  @key is the key
+ */
+unsigned int b_tree_shard_find(void *sh, void *key){
+    Shard_Tree *S = sh;
+    Shard *s = &S->shards[shard_of(S,key)];
+    unsigned int lba;
+
+    pthread_mutex_lock(&s->lock);
+    lba = b_tree_find(s->tree,key);
+    pthread_mutex_unlock(&s->lock);
+    return lba;
+}
+
+/*  run_batch
+ *  Splits n operations by shard, hands each shard's part to its
+ *  worker and waits for all of them.
+ *  Returns the number of operations with a non-zero lba.
+ *
+ *  @S is the Shard_Tree
+ *  @op is 'I' or 'F'
+ *  @n is the number of operations
+ *  @keys, @records and @lbas are the caller's arrays
+ */
+int run_batch(Shard_Tree *S, char op, int n, unsigned char *keys, unsigned char *records, unsigned int *lbas){
+    Shard_Job *jobs;
+    int *idx, *start;
+    int i, sid, found;
+
+    jobs = calloc(S->nshards, sizeof(Shard_Job));
+    start = calloc(S->nshards+1, sizeof(int));
+    idx = malloc(n * sizeof(int));
+
+    // bucket the operations by shard, keeping their order within a shard
+    for(i = 0; i < n; i++) start[shard_of(S,keys + (long) i * S->key_size)+1]++;
+    for(i = 0; i < S->nshards; i++) start[i+1] += start[i];
+    for(i = 0; i < n; i++){
+        sid = shard_of(S,keys + (long) i * S->key_size);
+        idx[start[sid] + jobs[sid].n++] = i;
+    }
+
+    pthread_mutex_lock(&S->batch_lock);
+
+    S->pending = 0;
+    for(sid = 0; sid < S->nshards; sid++) if(jobs[sid].n > 0) S->pending++;
+
+    // hand out the work
+    for(sid = 0; sid < S->nshards; sid++){
+        if(jobs[sid].n == 0) continue;
+        jobs[sid].op = op;
+        jobs[sid].idx = idx + start[sid];
+        jobs[sid].keys = keys;
+        jobs[sid].records = records;
+        jobs[sid].lbas = lbas;
+
+        pthread_mutex_lock(&S->shards[sid].lock);
+        S->shards[sid].job = &jobs[sid];
+        pthread_cond_signal(&S->shards[sid].cond);
+        pthread_mutex_unlock(&S->shards[sid].lock);
+    }
+
+    // wait for every shard to finish
+    pthread_mutex_lock(&S->done_lock);
+    while(S->pending > 0) pthread_cond_wait(&S->done_cond,&S->done_lock);
+    pthread_mutex_unlock(&S->done_lock);
+
+    pthread_mutex_unlock(&S->batch_lock);
+
+    found = 0;
+    for(i = 0; i < n; i++) if(lbas[i] != 0) found++;
+
+    free(jobs);
+    free(start);
+    free(idx);
+    return found;
+}
+
+/*  b_tree_shard_insert_batch
+ *  Inserts n keys and records, with every shard working in parallel.
+ *  Returns the number of successful inserts.
+ *
+ *  @sh is the sharded B_Tree
+ *  @n is the number of keys
+ *  @keys holds n keys, key_size bytes apart
+ *  @records holds n records, JDISK_SECTOR_SIZE bytes apart
+ *  @lbas gets each insert's return value
+ */
+int b_tree_shard_insert_batch(void *sh, int n, void *keys, void *records, unsigned int *lbas){
+    return run_batch(sh,'I',n,keys,records,lbas);
+}
+
+/*  b_tree_shard_find_batch
+ *  Looks up n keys, with every shard working in parallel.
+ *  Returns the number of keys found.
+ *
+ *  @sh is the sharded B_Tree
+ *  @n is the number of keys
+ *  @keys holds n keys, key_size bytes apart
+ *  @lbas gets each find's return value
+ */
+int b_tree_shard_find_batch(void *sh, int n, void *keys, unsigned int *lbas){
+    return run_batch(sh,'F',n,keys,NULL,lbas);
+}
+
+/*  b_tree_shard_traverse
+ *  Calls fn on every key, one shard after another.
+ *  In range mode this is global key order; in hash mode keys are
+ *  only ordered within each shard.
+ *
+ *  @sh is the sharded B_Tree
+ *  @fn is called with each key, its record lba and arg
+ *  @arg is passed through to fn
+ */
+int b_tree_shard_traverse(void *sh, B_Tree_Traverse_Fn fn, void *arg){
+    Shard_Tree *S = sh;
+    int i, rv;
+
+    for(i = 0; i < S->nshards; i++){
+        pthread_mutex_lock(&S->shards[i].lock);
+        rv = b_tree_traverse(S->shards[i].tree,fn,arg);
+        pthread_mutex_unlock(&S->shards[i].lock);
+        if(rv != 0) return rv;
+    }
+    return 0;
+}
+
+/*  b_tree_shard_tree
+ *  Returns the B_Tree of the shard that owns key.
+ *  Use b_tree_disk() on it to read a record whose lba came from this shard.
+ *
+ *  @sh is the sharded B_Tree
+ *  @key is the key
+ */
+void *b_tree_shard_tree(void *sh, void *key){
+    Shard_Tree *S = sh;
+    return S->shards[shard_of(S,key)].tree;
+}
+
+/*  b_tree_shard_count
+ *  Returns the number of shards.
+ *
+ *  @sh is the sharded B_Tree
+ */
+int b_tree_shard_count(void *sh){
+    return ((Shard_Tree *) sh)->nshards;
+}
+
+/*  b_tree_shard_key_size
+ *  Returns the key size of a sharded B_Tree.
+ *
+ *  @sh is the sharded B_Tree
+ */
+int b_tree_shard_key_size(void *sh){
+    return ((Shard_Tree *) sh)->key_size;
+}
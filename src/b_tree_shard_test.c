@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "b_tree_shard.h"
+
+#define BUFSIZE 4000
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_shard_test file [CREATE nshards hash|range shard_size key_size [sample_keys]] [BATCH n]\n");
+  fprintf(stderr, "       With BATCH, runs of up to n inserts or finds go through the batch calls,\n");
+  fprintf(stderr, "       and each result is checked against a single call.\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+int print_key(void *key, unsigned int lba, void *arg)
+{
+  printf("%-30.*s LBA: %u\n", *(int *) arg, (char *) key, lba);
+  return 0;
+}
+
+/* A run of inserts or finds waiting to go through the batch calls. */
+
+typedef struct {
+  char op;                      /* 'I' or 'F', or 0 when empty */
+  int n;
+  int max;
+  unsigned char *keys;
+  unsigned char *records;
+  unsigned int *lbas;
+} Batch;
+
+/* Runs the batch, prints each result as the single calls would, and
+   checks it against them: after an insert batch, each key's last insert
+   must be what a find returns, and a find batch must return what the
+   finds do one at a time. */
+
+void flush_batch(void *sh, Batch *b, int key_size)
+{
+  unsigned char *key;
+  unsigned int lba;
+  int i, j, nonzero, rv;
+
+  if (b->n == 0) return;
+  if (b->op == 'I') {
+    rv = b_tree_shard_insert_batch(sh, b->n, b->keys, b->records, b->lbas);
+  } else {
+    rv = b_tree_shard_find_batch(sh, b->n, b->keys, b->lbas);
+  }
+
+  nonzero = 0;
+  for (i = 0; i < b->n; i++) {
+    if (b->op == 'I') {
+      printf("Insert return value: %u\n", b->lbas[i]);
+    } else {
+      printf("Find return value: %d\n", b->lbas[i]);
+    }
+    if (b->lbas[i] != 0) nonzero++;
+
+    key = b->keys + i * key_size;
+    if (b->op == 'I') {
+      if (b->lbas[i] == 0) continue;
+      for (j = i + 1; j < b->n && memcmp(key, b->keys + j * key_size, key_size) != 0; j++) ;
+      if (j < b->n) continue;
+    }
+    lba = b_tree_shard_find(sh, key);
+    if (lba != b->lbas[i]) {
+      printf("Batch %s of %.*s returned %u, but a single find returns %u\n",
+             (b->op == 'I') ? "insert" : "find", key_size, (char *) key, b->lbas[i], lba);
+    }
+  }
+  if (rv != nonzero) printf("Batch returned %d, but %d of its lbas are non-zero\n", rv, nonzero);
+  b->n = 0;
+  b->op = 0;
+}
+
+/* Reads one key per line from fn, zero padded to key_size, and picks
+   range split keys from them. */
+
+unsigned char *sample_splits(char *fn, int nshards, int key_size)
+{
+  FILE *f;
+  unsigned char *keys, *splits;
+  char line[BUFSIZE];
+  int n, size;
+
+  f = fopen(fn, "r");
+  if (f == NULL) { perror(fn); exit(1); }
+  n = 0;
+  size = 1024;
+  keys = (unsigned char *) malloc(size * key_size);
+  while (fscanf(f, "%s", line) == 1) {
+    if (strlen(line) > key_size) usage("Sample key too big\n");
+    if (n == size) {
+      size *= 2;
+      keys = (unsigned char *) realloc(keys, size * key_size);
+    }
+    memset(keys + n * key_size, 0, key_size);
+    memcpy(keys + n * key_size, line, strlen(line));
+    n++;
+  }
+  fclose(f);
+
+  splits = (unsigned char *) malloc(nshards * key_size);
+  if (b_tree_shard_sample_splits(nshards, key_size, n, keys, splits) != 0) usage("Empty sample file\n");
+  free(keys);
+  return splits;
+}
+
+int main(int argc, char **argv)
+{
+  void *sh;
+  unsigned char *splits;
+  int key_size, nshards, mode, m, i;
+  char op;
+  Batch batch;
+  unsigned long file_size;
+  unsigned int lba;
+  char line[BUFSIZE];
+  char fi[BUFSIZE];
+  char key[BUFSIZE];
+  char val[BUFSIZE];
+
+  memset(&batch, 0, sizeof(Batch));
+  if (argc >= 4 && strcmp(argv[argc-2], "BATCH") == 0) {
+    batch.max = atoi(argv[argc-1]);
+    if (batch.max <= 0) usage("BATCH n must be positive\n");
+    argc -= 2;
+  }
+  if (argc != 2 && argc != 7 && argc != 8) usage(NULL);
+  if (argc >= 7) {
+    if (strcmp(argv[2], "CREATE") != 0) usage(NULL);
+    nshards = atoi(argv[3]);
+    if (nshards <= 0) usage("nshards must be positive\n");
+    if (strcmp(argv[4], "hash") == 0) {
+      mode = B_TREE_SHARD_HASH;
+    } else if (strcmp(argv[4], "range") == 0) {
+      mode = B_TREE_SHARD_RANGE;
+    } else usage("mode must be hash or range\n");
+    key_size = atoi(argv[6]);
+    if (key_size < 4 || key_size > 254) usage("key_size must be between 4 and 254\n");
+    if (sscanf(argv[5], "%lu", &file_size) != 1 || file_size == 0 ||
+        file_size % JDISK_SECTOR_SIZE != 0) {
+      usage("bad shard size.\n");
+    }
+    if (argc == 8) {
+      if (mode != B_TREE_SHARD_RANGE) usage("sample_keys only goes with range\n");
+      splits = sample_splits(argv[7], nshards, key_size);
+      sh = b_tree_shard_create_splits(argv[1], nshards, file_size, key_size, splits);
+      free(splits);
+    } else {
+      sh = b_tree_shard_create(argv[1], nshards, mode, file_size, key_size);
+    }
+    if (sh == NULL) {
+      fprintf(stderr, "Couldn't create sharded b_tree -- calling perror()\n");
+      perror(argv[1]);
+      exit(1);
+    }
+  } else {
+    sh = b_tree_shard_attach(argv[1]);
+    if (sh == NULL) {
+      fprintf(stderr, "Couldn't attach to %s.  Calling perror().\n", argv[1]);
+      perror(argv[1]);
+      exit(1);
+    }
+    key_size = b_tree_shard_key_size(sh);
+    printf("Attached to %s.  Shards: %d  -  KS: %d\n", argv[1], b_tree_shard_count(sh), key_size);
+  }
+  if (batch.max > 0) {
+    batch.keys = (unsigned char *) malloc(batch.max * key_size);
+    batch.records = (unsigned char *) malloc(batch.max * JDISK_SECTOR_SIZE);
+    batch.lbas = (unsigned int *) malloc(batch.max * sizeof(unsigned int));
+  }
+  while (fgets((char *) line, BUFSIZE, stdin) != NULL) {
+    m = sscanf(line, "%s %s %s", fi, key, val);
+
+    /* A batch runs when it's full, or before anything but another good
+       line of the same call, so the output comes out in order. */
+
+    if (batch.n > 0) {
+      if (batch.n == batch.max || m <= 0 || strlen(key) > key_size) {
+        op = 0;
+      } else if (m == 3 && strcmp(fi, "I") == 0 && strlen(val) <= JDISK_SECTOR_SIZE) {
+        op = 'I';
+      } else if (m == 2 && strcmp(fi, "F") == 0) {
+        op = 'F';
+      } else {
+        op = 0;
+      }
+      if (op != batch.op) flush_batch(sh, &batch, key_size);
+    }
+    if (m <= 0) {
+    } else if ((m == 1 && strcmp(fi, "T") != 0)
+                      || (m == 2 && strcmp(fi, "F") != 0)
+                      || (m == 3 && strcmp(fi, "I") != 0)) {
+      printf("Line must be 'I key val', 'F key' or 'T'\n");
+    } else if (strcmp(fi, "T") == 0) {
+      b_tree_shard_traverse(sh, print_key, &key_size);
+    } else if (strcmp(fi, "I") == 0) {
+      if (strlen(key) > key_size) {
+        printf("Key too big\n");
+      } else if (strlen(val) > JDISK_SECTOR_SIZE) {
+        printf("Val too big\n");
+      } else {
+        for (i = strlen(key); i < key_size; i++) key[i] = '\0';
+        for (i = strlen(val); i < JDISK_SECTOR_SIZE; i++) val[i] = '\0';
+        if (batch.max > 0) {
+          batch.op = 'I';
+          memcpy(batch.keys + batch.n * key_size, key, key_size);
+          memcpy(batch.records + batch.n * JDISK_SECTOR_SIZE, val, JDISK_SECTOR_SIZE);
+          batch.n++;
+        } else {
+          lba = b_tree_shard_insert(sh, key, val);
+          printf("Insert return value: %u\n", lba);
+        }
+      }
+    } else {
+      if (strlen(key) > key_size) {
+        printf("Key too big\n");
+      } else {
+        for (i = strlen(key); i < key_size; i++) key[i] = '\0';
+        if (batch.max > 0) {
+          batch.op = 'F';
+          memcpy(batch.keys + batch.n * key_size, key, key_size);
+          batch.n++;
+        } else {
+          lba = b_tree_shard_find(sh, key);
+          printf("Find return value: %d\n", lba);
+        }
+      }
+    }
+  }
+
+  flush_batch(sh, &batch, key_size);
+  b_tree_shard_detach(sh);
+  free(batch.keys);
+  free(batch.records);
+  free(batch.lbas);
+  exit(0);
+}
@@ -0,0 +1,487 @@
+//  Static B-Tree
+//  A read-only copy of a B_Tree with every block full, written once by
+//  b_tree_export() and read through mmap().
+
+#include <b_tree_static.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* The file is a header sector, the blocks of each level from the leaves
+   up, a Static_Value for each key and then the records in key order.
+   Level 0 holds every key.  Each level above holds the first key of
+   every block of the one below, so the child of key c in block j is
+   block j * per_block + c of the next level down.
+
+   Inside a block the keys are not stored in order.  The block is cut
+   into nodes of per_node sorted keys, as many as fit in a cache line,
+   and node k's children are nodes k * (per_node+1) + 1 through
+   k * (per_node+1) + per_node + 1, so a search reads a line or two per
+   step instead of bouncing around the sector.  The nodes sit back to
+   back, so every block holds JDISK_SECTOR_SIZE / key_size keys, and the
+   last node may be short.  Slots past the last key of a short block
+   repeat that key. */
+#define STATIC_MAGIC "BTSTAT2"              /* 8 bytes, with the '\0' */
+#define STATIC_MAX_LEVELS (32)
+#define STATIC_LINE (64)                    /* Bytes in a cache line, the most a node's keys take */
+
+typedef struct {
+    char magic[8];
+    int key_size;
+    int key_type;                           /* B_TREE_KEY_* */
+    unsigned long nkeys;
+    int per_block;                          /* Keys in each block */
+    int nlevels;                            /* Levels, counting the leaves */
+    unsigned long level_off[STATIC_MAX_LEVELS];   /* Where each level's blocks start */
+    unsigned long values_off;               /* Where the Static_Values start */
+    unsigned long size;                     /* Of the whole file */
+} Static_Header;
+
+typedef struct {
+    unsigned long off;                      /* Where the record is in the file */
+    unsigned int size;                      /* and its length */
+    unsigned int pad;
+} Static_Value;
+
+typedef struct {
+    unsigned char *base;                    /* The mapped file */
+    Static_Header *h;                       /* which starts with the header */
+    size_t size;
+    unsigned long level_keys[STATIC_MAX_LEVELS];   /* Keys in each level */
+    int per_node;                           /* Keys in each node (the last may have fewer) */
+    int node_bytes;                         /* Size of a full node */
+    int *rank_of;                           /* Sorted position of each slot in a block */
+    int *key_off;                           /* Where the key of each sorted position sits in a block */
+} Static_Tree;
+
+typedef struct {
+    unsigned char *keys;                    /* Every key of the tree, in order */
+    unsigned int *lbas;                     /* and its record lba */
+    long n, cap;
+    int key_size;
+} Export_List;
+
+/*  st_cmp
+ *  Compares two keys of a given B_TREE_KEY_* type like memcmp().
+ *
+ *  @type is the key type
+ *  @key_size is the key size
+ *  @a and @b are the keys
+ */
+int st_cmp(int type, int key_size, void *a, void *b){
+    unsigned long x, y;
+    unsigned int u, v;
+    long i, j;
+
+    switch(type){
+    case B_TREE_KEY_U32:
+        memcpy(&u,a,4);
+        memcpy(&v,b,4);
+        return (u > v) - (u < v);
+    case B_TREE_KEY_U64:
+        memcpy(&x,a,8);
+        memcpy(&y,b,8);
+        return (x > y) - (x < y);
+    case B_TREE_KEY_I64:
+        memcpy(&i,a,8);
+        memcpy(&j,b,8);
+        return (i > j) - (i < j);
+    default:
+        return memcmp(a,b,key_size);
+    }
+}
+
+/*  level_sizes
+ *  Fills in how many keys each level has, from the leaves up, and
+ *  returns the number of levels.  The top one fits in a block.
+ *
+ *  @nkeys is the number of keys
+ *  @per_block is the number of keys in a block
+ *  @level_keys gets the counts
+ */
+int level_sizes(unsigned long nkeys, int per_block, unsigned long *level_keys){
+    int l = 0;
+
+    level_keys[0] = nkeys;
+    while(level_keys[l] > per_block){
+        if(l + 1 == STATIC_MAX_LEVELS) return -1;
+        level_keys[l+1] = (level_keys[l] + per_block - 1) / per_block;
+        l++;
+    }
+    return l + 1;
+}
+
+/*  line_order
+ *  Fills in the sorted position of every slot of a block's nodes,
+ *  visiting node k and its children in order.  Slot s is key
+ *  s % per_node of node s / per_node.  Returns the next position.
+ *  Only the last node can be short, and it has no children.
+ *
+ *  @k is the node
+ *  @nodes is the number of nodes in a block
+ *  @per_node is the number of keys in a node
+ *  @per_block is the number of slots in a block
+ *  @rank_of gets the positions
+ *  @r is the position of the first key under node k
+ */
+int line_order(int k, int nodes, int per_node, int per_block, int *rank_of, int r){
+    int c;
+
+    if(k >= nodes) return r;
+    for(c = 0; c < per_node && k * per_node + c < per_block; c++){
+        r = line_order(k * (per_node+1) + 1 + c,nodes,per_node,per_block,rank_of,r);
+        rank_of[k * per_node + c] = r++;
+    }
+    return line_order(k * (per_node+1) + 1 + per_node,nodes,per_node,per_block,rank_of,r);
+}
+
+/*  block_layout
+ *  Works out how the keys of a block are laid out in nodes and returns
+ *  the number of keys in a block.  Keys bigger than half a line get a
+ *  node each, which makes the block an Eytzinger ordered array.
+ *
+ *  @key_size is the key size, no more than half a sector
+ *  @per_node and @node_bytes get the node shape
+ *  @rank_of and @key_off get malloc()ed tables, per_block long
+ */
+int block_layout(int key_size, int *per_node, int *node_bytes, int **rank_of, int **key_off){
+    int per_block, nodes, s;
+
+    per_block = JDISK_SECTOR_SIZE / key_size;
+    *per_node = (key_size <= STATIC_LINE) ? STATIC_LINE / key_size : 1;
+    *node_bytes = *per_node * key_size;
+    nodes = (per_block + *per_node - 1) / *per_node;
+
+    *rank_of = malloc(per_block * sizeof(int));
+    *key_off = malloc(per_block * sizeof(int));
+    line_order(0,nodes,*per_node,per_block,*rank_of,0);
+    for(s = 0; s < per_block; s++) (*key_off)[(*rank_of)[s]] = s * key_size;
+    return per_block;
+}
+
+/*  export_key
+ *  b_tree_traverse() callback that adds a key to an Export_List.
+ */
+int export_key(void *key, unsigned int lba, void *arg){
+    Export_List *E = arg;
+
+    if(E->n == E->cap){
+        E->cap = (E->cap == 0) ? 1024 : E->cap * 2;
+        E->keys = realloc(E->keys,E->cap * E->key_size);
+        E->lbas = realloc(E->lbas,E->cap * sizeof(unsigned int));
+    }
+    memcpy(E->keys + E->n * E->key_size,key,E->key_size);
+    E->lbas[E->n++] = lba;
+    return 0;
+}
+
+/*  b_tree_export
+ *  Writes a static copy of a B_Tree, records and all, to filename.
+ *  Returns 0, or -1 if the file can't be written or the tree's keys
+ *  are B_TREE_KEY_CUSTOM (the copy couldn't be searched without the
+ *  function).
+ *
+ *  @b_tree is the B_Tree
+ *  @filename is the file to write
+ */
+int b_tree_export(void *b_tree, char *filename){
+    Export_List E;
+    Static_Header h;
+    Static_Value v;
+    unsigned long level_keys[STATIC_MAX_LEVELS];
+    unsigned long stride, off, rec_off, idx;
+    unsigned char block[JDISK_SECTOR_SIZE];
+    unsigned char *rec;
+    FILE *f;
+    long i, b, nblocks;
+    int l, c, rv, per_node, node_bytes;
+    int *rank_of, *key_off;
+
+    if((b_tree_flags(b_tree) & B_TREE_KEY_TYPE) == B_TREE_KEY_CUSTOM) return -1;
+    if(b_tree_key_size(b_tree) > JDISK_SECTOR_SIZE / 2) return -1;
+
+    // every key and lba, in order
+    memset(&E,0,sizeof(E));
+    E.key_size = b_tree_key_size(b_tree);
+    b_tree_traverse(b_tree,export_key,&E);
+
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,STATIC_MAGIC,8);
+    h.key_size = E.key_size;
+    h.key_type = b_tree_flags(b_tree) & B_TREE_KEY_TYPE;
+    h.nkeys = E.n;
+    h.per_block = block_layout(E.key_size,&per_node,&node_bytes,&rank_of,&key_off);
+    h.nlevels = level_sizes(E.n,h.per_block,level_keys);
+
+    f = (h.nlevels < 0) ? NULL : fopen(filename,"w");
+    if(f == NULL){
+        free(rank_of);
+        free(key_off);
+        free(E.keys);
+        free(E.lbas);
+        return -1;
+    }
+
+    // the header goes in last, once the offsets are known
+    memset(block,0,JDISK_SECTOR_SIZE);
+    fwrite(block,1,JDISK_SECTOR_SIZE,f);
+    off = JDISK_SECTOR_SIZE;
+
+    // key i of level l is key i * per_block^l of the tree
+    stride = 1;
+    for(l = 0; l < h.nlevels; l++){
+        h.level_off[l] = off;
+        nblocks = (level_keys[l] + h.per_block - 1) / h.per_block;
+        for(b = 0; b < nblocks; b++){
+            memset(block,0,JDISK_SECTOR_SIZE);
+            for(c = 0; c < h.per_block; c++){
+                idx = b * h.per_block + c;
+                if(idx >= level_keys[l]) idx = level_keys[l] - 1;
+                memcpy(block + key_off[c],E.keys + idx * stride * E.key_size,E.key_size);
+            }
+            fwrite(block,1,JDISK_SECTOR_SIZE,f);
+            off += JDISK_SECTOR_SIZE;
+        }
+        stride *= h.per_block;
+    }
+
+    // the records start on a sector after the values
+    h.values_off = off;
+    off += (E.n * sizeof(Static_Value) + JDISK_SECTOR_SIZE - 1) / JDISK_SECTOR_SIZE * JDISK_SECTOR_SIZE;
+    rec_off = off;
+    memset(&v,0,sizeof(v));
+    for(i = 0; i < E.n; i++){
+        v.off = off;
+        v.size = b_tree_record_size(b_tree,E.lbas[i]);
+        fwrite(&v,sizeof(v),1,f);
+        off += v.size;
+    }
+
+    rv = 0;
+    rec = malloc(B_TREE_MAX_RECORD);
+    fseek(f,rec_off,SEEK_SET);
+    for(i = 0; i < E.n; i++){
+        if(b_tree_read_record(b_tree,E.lbas[i],rec) != 0) rv = -1;
+        fwrite(rec,1,b_tree_record_size(b_tree,E.lbas[i]),f);
+    }
+    free(rec);
+
+    h.size = off;
+    fseek(f,0,SEEK_SET);
+    fwrite(&h,sizeof(h),1,f);
+    if(ferror(f)) rv = -1;
+    if(fclose(f) != 0) rv = -1;
+
+    free(rank_of);
+    free(key_off);
+    free(E.keys);
+    free(E.lbas);
+    return rv;
+}
+
+/*  static_fits
+ *  Returns 1 if every level and the Static_Values lie inside the
+ *  mapping where b_tree_export() puts them, 0 if not.
+ *
+ *  @S is the static tree, with level_keys filled in
+ */
+int static_fits(Static_Tree *S){
+    Static_Header *h = S->h;
+    unsigned long nblocks;
+    int l;
+
+    for(l = 0; l < h->nlevels; l++){
+        nblocks = (S->level_keys[l] + h->per_block - 1) / h->per_block;
+        if(h->level_off[l] < JDISK_SECTOR_SIZE || h->level_off[l] % JDISK_SECTOR_SIZE != 0) return 0;
+        if(h->level_off[l] > S->size || nblocks > (S->size - h->level_off[l]) / JDISK_SECTOR_SIZE) return 0;
+    }
+    if(h->values_off < JDISK_SECTOR_SIZE || h->values_off % JDISK_SECTOR_SIZE != 0) return 0;
+    if(h->values_off > S->size || h->nkeys > (S->size - h->values_off) / sizeof(Static_Value)) return 0;
+    return 1;
+}
+
+/*  b_tree_static_open
+ *  Returns a handle to a static tree written by b_tree_export(), or NULL
+ *  if the file can't be mapped or isn't one.  The header's offsets are
+ *  checked against the file; nothing else is read up front, and blocks
+ *  come in as lookups touch them.
+ *
+ *  @filename is the file
+ */
+void *b_tree_static_open(char *filename){
+    Static_Tree *S;
+    Static_Header *h;
+    struct stat st;
+    void *base;
+    int fd, ok;
+
+    fd = open(filename,O_RDONLY);
+    if(fd < 0) return NULL;
+    if(fstat(fd,&st) != 0 || st.st_size < JDISK_SECTOR_SIZE){
+        close(fd);
+        return NULL;
+    }
+    base = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if(base == MAP_FAILED) return NULL;
+
+    S = malloc(sizeof(Static_Tree));
+    S->base = base;
+    S->h = base;
+    S->size = st.st_size;
+    S->rank_of = NULL;
+    S->key_off = NULL;
+    h = S->h;
+    if(memcmp(h->magic,STATIC_MAGIC,8) != 0 || h->size != S->size
+       || h->key_size <= 0 || h->key_size > JDISK_SECTOR_SIZE / 2
+       || h->nkeys > S->size / sizeof(Static_Value)){
+        b_tree_static_close(S);
+        return NULL;
+    }
+    switch(h->key_type){
+    case B_TREE_KEY_BYTES: ok = 1; break;
+    case B_TREE_KEY_U32: ok = (h->key_size == 4); break;
+    case B_TREE_KEY_U64: case B_TREE_KEY_I64: ok = (h->key_size == 8); break;
+    default: ok = 0;
+    }
+    if(!ok || h->per_block != block_layout(h->key_size,&S->per_node,&S->node_bytes,&S->rank_of,&S->key_off)
+       || level_sizes(h->nkeys,h->per_block,S->level_keys) != h->nlevels || !static_fits(S)){
+        b_tree_static_close(S);
+        return NULL;
+    }
+    return S;
+}
+
+/*  b_tree_static_close
+ *  Unmaps a static tree and frees the handle.
+ *  Returns 0, or -1 if it couldn't be unmapped.
+ *
+ *  @st is the static tree
+ */
+int b_tree_static_close(void *st){
+    Static_Tree *S = st;
+    int rv;
+
+    rv = munmap(S->base,S->size);
+    free(S->rank_of);
+    free(S->key_off);
+    free(S);
+    return (rv == 0) ? 0 : -1;
+}
+
+/*  b_tree_static_find
+ *  Returns the index of key in the static tree (0 is the smallest), or
+ *  -1 if it isn't there.  It walks the nodes of one block per level.
+ *
+ *  @st is the static tree
+ *  @key is the key
+ */
+long b_tree_static_find(void *st, void *key){
+    Static_Tree *S = st;
+    Static_Header *h = S->h;
+    unsigned char *block, *node, *best;
+    unsigned long j;
+    int l, n, k, c, r, hi, mid, nodes;
+
+    if(h->nkeys == 0) return -1;
+    nodes = (h->per_block + S->per_node - 1) / S->per_node;
+
+    j = 0;
+    for(l = h->nlevels - 1; l >= 0; l--){
+        block = S->base + h->level_off[l] + j * JDISK_SECTOR_SIZE;
+        n = h->per_block;
+        if(S->level_keys[l] - j * h->per_block < n) n = S->level_keys[l] - j * h->per_block;
+
+        // the last key that isn't bigger than key
+        r = -1;
+        best = NULL;
+        for(k = 0; k < nodes; k = k * (S->per_node+1) + 1 + c){
+            // c is the number of the node's keys that aren't bigger than key
+            node = block + k * S->node_bytes;
+            c = 0;
+            hi = S->per_node;
+            if(k * S->per_node + hi > h->per_block) hi = h->per_block - k * S->per_node;
+            while(c < hi){
+                mid = (c + hi) / 2;
+                if(st_cmp(h->key_type,h->key_size,node + mid * h->key_size,key) <= 0) c = mid + 1;
+                else hi = mid;
+            }
+            if(c > 0){
+                r = S->rank_of[k * S->per_node + c - 1];
+                best = node + (c - 1) * h->key_size;
+            }
+        }
+        if(r < 0) return -1;
+
+        // the slots past n repeat the block's last key
+        if(r >= n) r = n - 1;
+        j = j * h->per_block + r;
+        if(l == 0 && st_cmp(h->key_type,h->key_size,best,key) != 0) return -1;
+    }
+    return j;
+}
+
+/*  b_tree_static_key
+ *  Returns a pointer to key i, or NULL if i is out of range.
+ *
+ *  @st is the static tree
+ *  @i is the key's index
+ */
+void *b_tree_static_key(void *st, long i){
+    Static_Tree *S = st;
+
+    if(i < 0 || i >= S->h->nkeys) return NULL;
+    return S->base + S->h->level_off[0] + (i / S->h->per_block) * JDISK_SECTOR_SIZE
+           + S->key_off[i % S->h->per_block];
+}
+
+/*  b_tree_static_record
+ *  Returns a pointer to the record of key i, or NULL if i is out of
+ *  range or its Static_Value points outside the file.
+ *  It points into the mapping, so it lives until the close.
+ *
+ *  @st is the static tree
+ *  @i is the key's index
+ *  @size gets the record's length in bytes
+ */
+void *b_tree_static_record(void *st, long i, int *size){
+    Static_Tree *S = st;
+    Static_Value *v;
+
+    if(i < 0 || i >= S->h->nkeys) return NULL;
+    v = (Static_Value *) (S->base + S->h->values_off) + i;
+    if(v->off > S->size || v->size > S->size - v->off || v->size > B_TREE_MAX_RECORD) return NULL;
+    *size = v->size;
+    return S->base + v->off;
+}
+
+/*  b_tree_static_count
+ *  Returns the number of keys in a static tree.
+ *
+ *  @st is the static tree
+ */
+long b_tree_static_count(void *st){
+    return ((Static_Tree *) st)->h->nkeys;
+}
+
+/*  b_tree_static_key_size
+ *  Returns the key size of a static tree.
+ *
+ *  @st is the static tree
+ */
+int b_tree_static_key_size(void *st){
+    return ((Static_Tree *) st)->h->key_size;
+}
+
+/*  b_tree_static_levels
+ *  Returns how many blocks a lookup touches: one per level.
+ *
+ *  @st is the static tree
+ */
+int b_tree_static_levels(void *st){
+    return ((Static_Tree *) st)->h->nlevels;
+}
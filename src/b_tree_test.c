@@ -9,7 +9,8 @@
 
 void usage(char *s)
 {
-  fprintf(stderr, "usage: b_tree_test file [CREATE file_size key_size]\n");
+  fprintf(stderr, "usage: b_tree_test file [CREATE file_size key_size] [trace_file]\n");
+  fprintf(stderr, "       With a trace_file, every insert and find is traced to it for b_tree_replay.\n");
   if (s != NULL) fprintf(stderr, "%s\n", s);
   exit(1);
 }
@@ -24,7 +25,14 @@ int main(int argc, char **argv)
   char fi[BUFSIZE];
   char key[BUFSIZE];
   char val[BUFSIZE];
+  char *trace;
 
+  if (argc < 2 || argc > 6) usage(NULL);
+  trace = NULL;
+  if (argc == 3 || argc == 6) {
+    trace = argv[argc-1];
+    argc--;
+  }
   if (argc != 2 && argc != 5) usage(NULL);
   if (argc == 5) {
     if (strcmp(argv[2], "CREATE") != 0) usage(NULL);
@@ -53,6 +61,11 @@ int main(int argc, char **argv)
     key_size = b_tree_key_size(bp);
     printf("Attached to %s.  FS: %lu  -  KS: %d\n", argv[1], jdisk_size(jd), key_size);
   }
+  if (trace != NULL && b_tree_set_trace(bp, trace) != 0) {
+    fprintf(stderr, "Couldn't create trace file %s -- calling perror()\n", trace);
+    perror(trace);
+    exit(1);
+  }
   while (fgets((char *) line, BUFSIZE, stdin) != NULL) {
     m = sscanf(line, "%s %s %s", fi, key, val);
     if (m == 0) {
@@ -86,6 +99,8 @@ int main(int argc, char **argv)
 
   printf("Reads: %ld\n", jdisk_reads(jd));
   printf("Writes: %ld\n", jdisk_writes(jd));
+  if (trace != NULL && b_tree_set_trace(bp, NULL) != 0) fprintf(stderr, "Writing trace file %s failed\n", trace);
+  b_tree_detach(bp);
       
   exit(0);
 }
@@ -0,0 +1,92 @@
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_CRC_INSN
+#endif
+
+/* The table version goes 8 bytes at a time ("slicing by 8"): table[k][b]
+   is the CRC of byte b followed by k zero bytes.  The instruction version
+   is one crc32 per 8 bytes. */
+
+#define POLY (0x82f63b78)                   /* Castagnoli, bit reflected */
+
+static unsigned int table[8][256];
+static int use_insn;
+
+static void crc32c_init(void) __attribute__((constructor));
+
+static void crc32c_init(void)
+{
+  unsigned int c;
+  int b, k, i;
+
+  for (b = 0; b < 256; b++) {
+    c = b;
+    for (i = 0; i < 8; i++) c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+    table[0][b] = c;
+  }
+  for (b = 0; b < 256; b++) {
+    for (k = 1; k < 8; k++) table[k][b] = (table[k-1][b] >> 8) ^ table[0][table[k-1][b] & 0xff];
+  }
+#ifdef HAVE_CRC_INSN
+  __builtin_cpu_init();
+  use_insn = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static unsigned int crc_table(unsigned int c, const unsigned char *p, size_t n)
+{
+  unsigned int lo, hi;
+
+  while (n >= 8) {
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= c;
+    c = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+        table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+        table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+        table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    p += 8;
+    n -= 8;
+  }
+  while (n > 0) {
+    c = (c >> 8) ^ table[0][(c ^ *p++) & 0xff];
+    n--;
+  }
+  return c;
+}
+
+#ifdef HAVE_CRC_INSN
+__attribute__((target("sse4.2")))
+static unsigned int crc_insn(unsigned int c, const unsigned char *p, size_t n)
+{
+#ifdef __x86_64__
+  unsigned long long c64, v;
+
+  c64 = c;
+  while (n >= 8) {
+    memcpy(&v, p, 8);
+    c64 = _mm_crc32_u64(c64, v);
+    p += 8;
+    n -= 8;
+  }
+  c = c64;
+#endif
+  while (n > 0) {
+    c = _mm_crc32_u8(c, *p++);
+    n--;
+  }
+  return c;
+}
+#endif
+
+unsigned int crc32c(unsigned int crc, const void *buf, size_t n)
+{
+  crc = ~crc;
+#ifdef HAVE_CRC_INSN
+  if (use_insn) return ~crc_insn(crc, buf, n);
+#endif
+  return ~crc_table(crc, buf, n);
+}
@@ -1,24 +1,78 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "jdisk.h"
 
+/* Readahead: once RA_TRIGGER reads in a row follow a pattern (each one
+   starts where the last ended, or the same stride of at most RA_MAX_STRIDE
+   sectors from the last one's start), a read that misses the window
+   fetches a new one with one preadv(), starting at RA_MIN sectors and
+   doubling up to the handle's maximum.  Reads that fall inside the window
+   are copied from it.  Writes through the handle update it; writes by
+   other handles or processes aren't seen. */
+
+#define RA_MIN (4)
+#define RA_TRIGGER (2)
+#define RA_MAX_STRIDE (8)
+
 typedef struct {
   unsigned long size;  
   int fd;
   char *fn;
   int reads;
   int writes;
+  pthread_mutex_t ra_lock;      /* Guards everything below */
+  int ra_max;                   /* Biggest window in sectors, 0 = off */
+  unsigned char *ra_buf;        /* The window */
+  unsigned char *ra_hit;        /* Which of its sectors have been read */
+  unsigned int ra_lba;          /* Its first sector */
+  int ra_n;                     /* and how many */
+  int ra_win;                   /* Sectors the next window fetches */
+  unsigned int last_lba;        /* Where the last read started */
+  unsigned int last_end;        /* and ended */
+  long stride;                  /* Its start minus the one before, 0 if contiguous */
+  int run;                      /* Reads in a row that kept the stride */
+  long ra_gen;                  /* Bumped by every write */
+  long ra_fetched;              /* Sectors read ahead */
+  long ra_used;                 /* of them, how many reads used */
+  long ra_wasted;               /* and how many were dropped unread */
+  int direct;                   /* The fd is open with O_DIRECT */
 } Disk;
 
+static Disk *new_disk(int fd, char *fn)
+{
+  Disk *d;
+
+  d = (Disk *) calloc(1, sizeof(Disk));
+  d->fd = fd;
+  d->fn = strdup(fn);
+  pthread_mutex_init(&d->ra_lock, NULL);
+  d->ra_win = RA_MIN;
+  d->last_end = 0xffffffff;
+  return d;
+}
+
+/* Sets the file to size bytes.  New space reads as zeros.  On Linux the
+   blocks are reserved up front, so writes into them won't fail for lack
+   of space; elsewhere the file is just left sparse. */
+
+static int set_size(int fd, unsigned long old_size, unsigned long size)
+{
+  if (ftruncate(fd, size) != 0) return -1;
+#ifdef __linux__
+  fallocate(fd, FALLOC_FL_KEEP_SIZE, old_size, size - old_size);
+#endif
+  return 0;
+}
+
 void *jdisk_create(char *fn, unsigned long size)
 {
   int fd;
   Disk *d;
-  char buf[JDISK_SECTOR_SIZE];
-  long i;
   
   if (size <= 0 || size % JDISK_SECTOR_SIZE != 0) return NULL;
   if (size / JDISK_SECTOR_SIZE > 0xffffffff) return NULL;
@@ -26,16 +80,14 @@ void *jdisk_create(char *fn, unsigned long size)
   fd = open(fn, O_RDWR | O_CREAT | O_EXCL, 0666);
   if (fd < 0) return NULL;
 
-  for (i = 0; i < size; i += JDISK_SECTOR_SIZE) {
-    write(fd, buf, JDISK_SECTOR_SIZE);
+  if (set_size(fd, 0, size) != 0) {
+    close(fd);
+    unlink(fn);
+    return NULL;
   }
   
-  d = (Disk *) malloc(sizeof(Disk));
+  d = new_disk(fd, fn);
   d->size = size;
-  d->fd = fd;
-  d->fn = strdup(fn);
-  d->reads = 0;
-  d->writes = 0;
   return (void *) d;
 }
 
@@ -50,12 +102,8 @@ void *jdisk_attach(char *fn)
   fd = open(fn, O_RDWR);
   if (fd < 0) return NULL;
 
-  d = (Disk *) malloc(sizeof(Disk));
-  d->fd = fd;
-  d->fn = strdup(fn);
+  d = new_disk(fd, fn);
   d->size = lseek(fd, zero, SEEK_END);
-  d->reads = 0;
-  d->writes = 0;
   if (d->size % JDISK_SECTOR_SIZE != 0) {
     fprintf(stderr, "jdisk_attach: Disk size needs to be a multiple of %d\n",
        JDISK_SECTOR_SIZE);
@@ -70,11 +118,26 @@ int jdisk_unattach(void *vd)
 
   d = (Disk *) vd;
   free(d->fn);
+  free(d->ra_buf);
+  free(d->ra_hit);
+  pthread_mutex_destroy(&d->ra_lock);
   if (close(d->fd) != 0) return -1;
   free(d);
   return 0;
 }
 
+int jdisk_grow(void *vd, unsigned long size)
+{
+  Disk *d;
+
+  d = (Disk *) vd;
+  if (size <= d->size || size % JDISK_SECTOR_SIZE != 0) return -1;
+  if (size / JDISK_SECTOR_SIZE > 0xffffffff) return -1;
+  if (set_size(d->fd, d->size, size) != 0) return -1;
+  d->size = size;
+  return 0;
+}
+
 unsigned long jdisk_size(void *vd)
 {
   Disk *d;
@@ -83,33 +146,357 @@ unsigned long jdisk_size(void *vd)
   return d->size;
 }
 
+/* The vectored calls move the sectors starting at lba to or from iov in
+   one preadv()/pwritev(), so a run of sectors costs one I/O.  The iovecs
+   must add up to a whole number of sectors.
+
+   With O_DIRECT, the buffers must start and end on JDISK_ALIGN bytes.
+   Ones that don't go through an aligned bounce buffer, so every caller
+   works, but only aligned ones skip the copy. */
+
+static long iov_sectors(Disk *d, unsigned int lba, const struct iovec *iov, int iovcnt)
+{
+  unsigned long bytes;
+  int i;
+
+  bytes = 0;
+  for (i = 0; i < iovcnt; i++) bytes += iov[i].iov_len;
+  if (bytes == 0 || bytes % JDISK_SECTOR_SIZE != 0) return -1;
+  if (lba + bytes / JDISK_SECTOR_SIZE > d->size / JDISK_SECTOR_SIZE) return -2;
+  return bytes;
+}
+
+static void *alloc_aligned(size_t n)
+{
+  void *p;
+
+  if (posix_memalign(&p, JDISK_ALIGN, (n + JDISK_ALIGN - 1) / JDISK_ALIGN * JDISK_ALIGN) != 0) return NULL;
+  return p;
+}
+
+/* Copies n bytes between buf and iov, starting off bytes into iov. */
+
+static void iov_copy(const struct iovec *iov, int iovcnt, long off, unsigned char *buf, long n, int to_iov)
+{
+  long len;
+  int i;
+
+  for (i = 0; i < iovcnt && n > 0; i++) {
+    if (off >= iov[i].iov_len) {
+      off -= iov[i].iov_len;
+      continue;
+    }
+    len = iov[i].iov_len - off;
+    if (len > n) len = n;
+    if (to_iov) {
+      memcpy((unsigned char *) iov[i].iov_base + off, buf, len);
+    } else {
+      memcpy(buf, (unsigned char *) iov[i].iov_base + off, len);
+    }
+    buf += len;
+    n -= len;
+    off = 0;
+  }
+}
+
+/* Reads or writes bytes at lba with one preadv()/pwritev(), bouncing
+   them through an aligned buffer if O_DIRECT needs it.  Returns 0, or -1
+   if the I/O was short or failed. */
+
+static int dio(Disk *d, int write, unsigned int lba, const struct iovec *iov, int iovcnt, long bytes)
+{
+  struct iovec v;
+  ssize_t rv;
+  int i;
+
+  usleep(JDISK_DELAY);
+  for (i = 0; d->direct && i < iovcnt; i++) {
+    if ((unsigned long) iov[i].iov_base % JDISK_ALIGN != 0 || iov[i].iov_len % JDISK_ALIGN != 0) break;
+  }
+  if (!d->direct || i == iovcnt) {
+    if (write) {
+      rv = pwritev(d->fd, iov, iovcnt, (off_t) lba * JDISK_SECTOR_SIZE);
+    } else {
+      rv = preadv(d->fd, iov, iovcnt, (off_t) lba * JDISK_SECTOR_SIZE);
+    }
+    return (rv == bytes) ? 0 : -1;
+  }
+
+  v.iov_base = alloc_aligned(bytes);
+  v.iov_len = bytes;
+  if (v.iov_base == NULL) return -1;
+  if (write) {
+    iov_copy(iov, iovcnt, 0, v.iov_base, bytes, 0);
+    rv = pwritev(d->fd, &v, 1, (off_t) lba * JDISK_SECTOR_SIZE);
+  } else {
+    rv = preadv(d->fd, &v, 1, (off_t) lba * JDISK_SECTOR_SIZE);
+    if (rv == bytes) iov_copy(iov, iovcnt, 0, v.iov_base, bytes, 1);
+  }
+  free(v.iov_base);
+  return (rv == bytes) ? 0 : -1;
+}
+
+/* Drops the window, counting the sectors nothing read.  Call with
+   ra_lock held. */
+
+static void ra_drop(Disk *d)
+{
+  int i;
+
+  for (i = 0; i < d->ra_n; i++) if (!d->ra_hit[i]) d->ra_wasted++;
+  free(d->ra_buf);
+  free(d->ra_hit);
+  d->ra_buf = NULL;
+  d->ra_hit = NULL;
+  d->ra_n = 0;
+}
+
+/* Copies sectors [lba, lba+n) out of the window if they are all in it.
+   Returns 1 if they were, 0 if not.  Call with ra_lock held. */
+
+static int ra_serve(Disk *d, unsigned int lba, int n, const struct iovec *iov, int iovcnt)
+{
+  int i;
+
+  if (d->ra_n == 0 || lba < d->ra_lba || lba + n > d->ra_lba + d->ra_n) return 0;
+  iov_copy(iov, iovcnt, 0, d->ra_buf + (long) (lba - d->ra_lba) * JDISK_SECTOR_SIZE,
+           (long) n * JDISK_SECTOR_SIZE, 1);
+  for (i = lba - d->ra_lba; i < lba - d->ra_lba + n; i++) {
+    if (!d->ra_hit[i]) {
+      d->ra_hit[i] = 1;
+      d->ra_used++;
+    }
+  }
+  return 1;
+}
+
+/* Reads sectors [lba, lba+n) through the readahead window: from it if they
+   are there, or by fetching a new one if the reads so far follow a pattern.
+   Returns 1 if iov was filled in, 0 if the caller should read it itself. */
+
+static int ra_read(Disk *d, unsigned int lba, int n, const struct iovec *iov, int iovcnt)
+{
+  unsigned char *buf;
+  unsigned long nsec;
+  long stride, first, span, gen;
+  struct iovec v;
+
+  pthread_mutex_lock(&d->ra_lock);
+  if (d->ra_max == 0) {
+    pthread_mutex_unlock(&d->ra_lock);
+    return 0;
+  }
+
+  // follow the stream
+  stride = (lba == d->last_end) ? 0 : (long) lba - d->last_lba;
+  if (stride == d->stride && stride >= -RA_MAX_STRIDE && stride <= RA_MAX_STRIDE) {
+    d->run++;
+  } else {
+    d->stride = stride;
+    d->run = 0;
+    d->ra_win = RA_MIN;
+  }
+  d->last_lba = lba;
+  d->last_end = lba + n;
+
+  if (ra_serve(d, lba, n, iov, iovcnt)) {
+    pthread_mutex_unlock(&d->ra_lock);
+    return 1;
+  }
+  if (d->run < RA_TRIGGER) {
+    pthread_mutex_unlock(&d->ra_lock);
+    return 0;
+  }
+
+  // the window runs ra_win reads ahead in the stream's direction, within the disk
+  span = (long) d->ra_win * ((d->stride == 0) ? n : labs(d->stride));
+  if (span > d->ra_max) span = d->ra_max;
+  if (span < n) span = n;
+  first = (d->stride < 0) ? (long) lba + n - span : lba;
+  if (first < 0) first = 0;
+  nsec = d->size / JDISK_SECTOR_SIZE;
+  if (first + span > nsec) span = nsec - first;
+  if (span <= n || span > d->ra_max) {
+    pthread_mutex_unlock(&d->ra_lock);
+    return 0;
+  }
+  gen = d->ra_gen;
+  pthread_mutex_unlock(&d->ra_lock);
+
+  // the I/O is done unlocked; if a write lands meanwhile the window may be stale
+  buf = (unsigned char *) alloc_aligned(span * JDISK_SECTOR_SIZE);
+  if (buf == NULL) return 0;
+  v.iov_base = buf;
+  v.iov_len = span * JDISK_SECTOR_SIZE;
+  if (dio(d, 0, first, &v, 1, v.iov_len) != 0) {
+    free(buf);
+    return 0;
+  }
+  __atomic_add_fetch(&d->reads, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&d->ra_lock);
+  if (d->ra_gen != gen || d->ra_max == 0) {
+    pthread_mutex_unlock(&d->ra_lock);
+    free(buf);
+    return 0;
+  }
+  ra_drop(d);
+  d->ra_buf = buf;
+  d->ra_hit = (unsigned char *) calloc(span, 1);
+  d->ra_lba = first;
+  d->ra_n = span;
+  d->ra_fetched += span;
+  if (d->ra_win < d->ra_max) d->ra_win *= 2;
+  ra_serve(d, lba, n, iov, iovcnt);
+  pthread_mutex_unlock(&d->ra_lock);
+  return 1;
+}
+
+/* Puts sectors just written into the window where it holds them. */
+
+static void ra_write(Disk *d, unsigned int lba, int n, const struct iovec *iov, int iovcnt)
+{
+  long lo, hi;
+
+  pthread_mutex_lock(&d->ra_lock);
+  d->ra_gen++;
+  lo = (lba > d->ra_lba) ? lba : d->ra_lba;
+  hi = (lba + n < d->ra_lba + d->ra_n) ? lba + n : d->ra_lba + d->ra_n;
+  if (d->ra_n > 0 && lo < hi) {
+    iov_copy(iov, iovcnt, (lo - lba) * JDISK_SECTOR_SIZE, d->ra_buf + (lo - d->ra_lba) * JDISK_SECTOR_SIZE,
+             (hi - lo) * JDISK_SECTOR_SIZE, 0);
+  }
+  pthread_mutex_unlock(&d->ra_lock);
+}
+
 int jdisk_read(void *jd, unsigned int lba, void *buf)
 {
   Disk *d;
+  struct iovec v;
 
   d = (Disk *) jd;
 
   if (lba >= (d->size / JDISK_SECTOR_SIZE)) return -2;
-  lseek(d->fd, lba * JDISK_SECTOR_SIZE, SEEK_SET);
-  usleep(JDISK_DELAY);
-  if (read(d->fd, buf, JDISK_SECTOR_SIZE) != JDISK_SECTOR_SIZE) return -1;
-  d->reads++;
+  v.iov_base = buf;
+  v.iov_len = JDISK_SECTOR_SIZE;
+  if (ra_read(d, lba, 1, &v, 1)) return 0;
+  if (dio(d, 0, lba, &v, 1, JDISK_SECTOR_SIZE) != 0) return -1;
+  __atomic_add_fetch(&d->reads, 1, __ATOMIC_RELAXED);
   return 0;
 }
 
 int jdisk_write(void *jd, unsigned int lba, void *buf)
 {
   Disk *d;
+  struct iovec v;
 
   d = (Disk *)jd;
   if (lba >= (d->size / JDISK_SECTOR_SIZE)) return -2;
-  lseek(d->fd, lba * JDISK_SECTOR_SIZE, SEEK_SET);
-  usleep(JDISK_DELAY);
-  if (write(d->fd, buf, JDISK_SECTOR_SIZE) != JDISK_SECTOR_SIZE) return -1;
-  d->writes++;
+  v.iov_base = buf;
+  v.iov_len = JDISK_SECTOR_SIZE;
+  if (dio(d, 1, lba, &v, 1, JDISK_SECTOR_SIZE) != 0) return -1;
+  __atomic_add_fetch(&d->writes, 1, __ATOMIC_RELAXED);
+  ra_write(d, lba, 1, &v, 1);
+  return 0;
+}
+
+int jdisk_readv(void *jd, unsigned int lba, const struct iovec *iov, int iovcnt)
+{
+  Disk *d;
+  long bytes;
+
+  d = (Disk *) jd;
+  bytes = iov_sectors(d, lba, iov, iovcnt);
+  if (bytes < 0) return bytes;
+  if (ra_read(d, lba, bytes / JDISK_SECTOR_SIZE, iov, iovcnt)) return 0;
+  if (dio(d, 0, lba, iov, iovcnt, bytes) != 0) return -1;
+  __atomic_add_fetch(&d->reads, 1, __ATOMIC_RELAXED);
   return 0;
 }
 
+int jdisk_writev(void *jd, unsigned int lba, const struct iovec *iov, int iovcnt)
+{
+  Disk *d;
+  long bytes;
+
+  d = (Disk *) jd;
+  bytes = iov_sectors(d, lba, iov, iovcnt);
+  if (bytes < 0) return bytes;
+  if (dio(d, 1, lba, iov, iovcnt, bytes) != 0) return -1;
+  __atomic_add_fetch(&d->writes, 1, __ATOMIC_RELAXED);
+  ra_write(d, lba, bytes / JDISK_SECTOR_SIZE, iov, iovcnt);
+  return 0;
+}
+
+/* Sets the biggest readahead window to max_sectors (0 turns readahead off,
+   which is how a handle starts).  Returns 0, or -1 if max_sectors is
+   negative. */
+
+int jdisk_set_readahead(void *jd, int max_sectors)
+{
+  Disk *d;
+
+  d = (Disk *) jd;
+  if (max_sectors < 0) return -1;
+  pthread_mutex_lock(&d->ra_lock);
+  ra_drop(d);
+  d->ra_max = max_sectors;
+  d->ra_win = RA_MIN;
+  d->run = 0;
+  pthread_mutex_unlock(&d->ra_lock);
+  return 0;
+}
+
+/* Turns O_DIRECT on or off, so reads and writes skip the page cache.
+   Use it when the caller caches sectors itself and would otherwise hold
+   them twice.  Returns 0, or -1 if the file system can't do direct I/O
+   on JDISK_ALIGN byte buffers (the handle is then left as it was). */
+
+int jdisk_set_direct(void *jd, int on)
+{
+  Disk *d;
+  struct iovec v;
+  int fl, rv;
+
+  d = (Disk *) jd;
+  fl = fcntl(d->fd, F_GETFL);
+  if (fl < 0) return -1;
+  fl = on ? (fl | O_DIRECT) : (fl & ~O_DIRECT);
+  if (fcntl(d->fd, F_SETFL, fl) != 0) return -1;
+  d->direct = on;
+  if (!on) return 0;
+
+  // some file systems take the flag, then fail every read
+  v.iov_base = alloc_aligned(JDISK_SECTOR_SIZE);
+  v.iov_len = JDISK_SECTOR_SIZE;
+  rv = (v.iov_base == NULL) ? -1 : dio(d, 0, 0, &v, 1, JDISK_SECTOR_SIZE);
+  free(v.iov_base);
+  if (rv != 0) {
+    fcntl(d->fd, F_SETFL, fl & ~O_DIRECT);
+    d->direct = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/* Readahead counters: sectors fetched ahead, how many of them reads used,
+   and how many were dropped (by a newer window) without being read. */
+
+long jdisk_ra_fetched(void *jd)
+{
+  return ((Disk *) jd)->ra_fetched;
+}
+
+long jdisk_ra_used(void *jd)
+{
+  return ((Disk *) jd)->ra_used;
+}
+
+long jdisk_ra_wasted(void *jd)
+{
+  return ((Disk *) jd)->ra_wasted;
+}
+
 long jdisk_reads(void *jd)
 {
   Disk *d;
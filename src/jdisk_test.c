@@ -51,6 +51,9 @@ int main(int argc, char **argv)
   jd = jdisk_attach(argv[2]);
   if (jd == NULL) usage("disk doesn't exist");
 
+  // a long read goes sector by sector, so let jdisk fetch ahead
+  if (rw == 'R') jdisk_set_readahead(jd, JDISK_READAHEAD);
+
   if (sscanf(argv[4], "%ld", &sp) == 0 || sp < 0 || sp > jdisk_size(jd)) usage("Bad seek pointer");
 
   if (rw == 'R') {
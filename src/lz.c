@@ -0,0 +1,154 @@
+#include <string.h>
+#include "lz.h"
+
+/* Each sequence is a token byte, extra literal length bytes, the literals,
+   a little-endian 16-bit match offset and extra match length bytes.
+   The high nibble of the token is the literal length and the low nibble
+   is the match length minus 4.  A nibble of 15 means more length bytes
+   follow, each added in until one is less than 255.  The last sequence
+   has literals only. */
+
+#define HASH_BITS (12)
+#define MIN_MATCH (4)
+#define LAST_LITERALS (5)
+
+static unsigned int read32(const unsigned char *p)
+{
+  unsigned int v;
+
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static int hash(unsigned int v)
+{
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Writes a length that didn't fit in its nibble.  Returns the new output
+   position, or -1 if it would go past cap. */
+
+static int put_length(unsigned char *dst, int op, int cap, int len)
+{
+  while (len >= 255) {
+    if (op >= cap) return -1;
+    dst[op++] = 255;
+    len -= 255;
+  }
+  if (op >= cap) return -1;
+  dst[op++] = len;
+  return op;
+}
+
+static int put_sequence(unsigned char *dst, int op, int cap,
+                        const unsigned char *lit, int nlit, int offset, int mlen)
+{
+  int token;
+
+  if (op >= cap) return -1;
+  token = op++;
+  dst[token] = ((nlit < 15) ? nlit : 15) << 4;
+  if (nlit >= 15 && (op = put_length(dst, op, cap, nlit - 15)) < 0) return -1;
+
+  if (op + nlit > cap) return -1;
+  memcpy(dst + op, lit, nlit);
+  op += nlit;
+
+  if (mlen == 0) return op;
+
+  if (op + 2 > cap) return -1;
+  dst[op++] = offset & 0xff;
+  dst[op++] = offset >> 8;
+  mlen -= MIN_MATCH;
+  dst[token] |= (mlen < 15) ? mlen : 15;
+  if (mlen >= 15 && (op = put_length(dst, op, cap, mlen - 15)) < 0) return -1;
+  return op;
+}
+
+/* Compresses n bytes of src into dst.  Returns the compressed size, or 0
+   if it doesn't fit in cap bytes. */
+
+int lz_compress(const void *vsrc, int n, void *vdst, int cap)
+{
+  const unsigned char *src = vsrc;
+  unsigned char *dst = vdst;
+  int table[1 << HASH_BITS];
+  int ip, anchor, op, ref, h, mlen;
+
+  for (h = 0; h < (1 << HASH_BITS); h++) table[h] = -1;
+
+  ip = 0;
+  anchor = 0;
+  op = 0;
+  while (ip + MIN_MATCH + LAST_LITERALS < n) {
+    h = hash(read32(src + ip));
+    ref = table[h];
+    table[h] = ip;
+
+    if (ref < 0 || ip - ref > 0xffff || read32(src + ref) != read32(src + ip)) {
+      ip++;
+      continue;
+    }
+
+    mlen = MIN_MATCH;
+    while (ip + mlen < n - LAST_LITERALS && src[ref + mlen] == src[ip + mlen]) mlen++;
+
+    op = put_sequence(dst, op, cap, src + anchor, ip - anchor, ip - ref, mlen);
+    if (op < 0) return 0;
+    ip += mlen;
+    anchor = ip;
+  }
+
+  op = put_sequence(dst, op, cap, src + anchor, n - anchor, 0, 0);
+  return (op < 0) ? 0 : op;
+}
+
+/* Decompresses n bytes of src into dst.  Returns the decompressed size,
+   or -1 if src is corrupt or the output doesn't fit in cap bytes. */
+
+int lz_decompress(const void *vsrc, int n, void *vdst, int cap)
+{
+  const unsigned char *src = vsrc;
+  unsigned char *dst = vdst;
+  int ip, op, token, len, offset, b;
+
+  ip = 0;
+  op = 0;
+  while (ip < n) {
+    token = src[ip++];
+
+    len = token >> 4;
+    if (len == 15) {
+      do {
+        if (ip >= n) return -1;
+        b = src[ip++];
+        len += b;
+      } while (b == 255);
+    }
+    if (ip + len > n || op + len > cap) return -1;
+    memcpy(dst + op, src + ip, len);
+    ip += len;
+    op += len;
+
+    if (ip == n) break;
+
+    if (ip + 2 > n) return -1;
+    offset = src[ip] | (src[ip+1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op) return -1;
+
+    len = (token & 15) + MIN_MATCH;
+    if ((token & 15) == 15) {
+      do {
+        if (ip >= n) return -1;
+        b = src[ip++];
+        len += b;
+      } while (b == 255);
+    }
+    if (op + len > cap) return -1;
+
+    /* Byte by byte, since the match may overlap what it is producing. */
+    for (b = 0; b < len; b++, op++) dst[op] = dst[op - offset];
+  }
+  return op;
+}